@@ -4,6 +4,8 @@
 //=============================================================================
 #include "Precomp.h"
 #include "CPURaytracer/CPURaytracer.h"
+#include "CPURasterizer/CPURasterizer.h"
+#include "Util/FrameStream.h"
 
 bool __stdcall RZRendererCreate(RZRendererType type,
   const RZRendererCreateParams* params,
@@ -22,8 +24,25 @@ bool __stdcall RZRendererCreate(RZRendererType type,
   case RZRenderer_CPURaytracer:
     return CPURaytracer::Create(params, out_renderer);
 
+  case RZRenderer_CPURasterizer:
+    return CPURasterizer::Create(params, out_renderer);
+
   default:
     assert(false);
     return false;
   }
 }
+
+bool __stdcall RZFrameStreamCreate(
+  const RZFrameStreamCreateParams* params,
+  IRZFrameStream** out_stream)
+{
+  if (!params || !out_stream)
+  {
+    assert(false);
+    return false;
+  }
+
+  *out_stream = nullptr;
+  return FrameStream::Create(params, out_stream);
+}
@@ -0,0 +1,510 @@
+//=============================================================================
+// CPURasterizer.cpp - Tile binning rasterizer implemented using the CPU
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURasterizer.h"
+#include "CPURaytracer/RenderTarget.h"
+#include "CPURaytracer/ToneMapping.h"
+
+// Rows per work item when resolving the visibility buffer
+static const int ResolveRows = 16;
+
+template <typename T>
+static T* GetRow(T* plane, uint32_t row_pitch, int y)
+{
+  return (T*)((uint8_t*)plane + (size_t)y * row_pitch);
+}
+
+CPURasterizer::~CPURasterizer()
+{
+  pipeline_.Flush();
+}
+
+bool CPURasterizer::Create(const RZRendererCreateParams* params, IRZRenderer** out_renderer)
+{
+  CPURasterizer* renderer = new CPURasterizer();
+  if (!renderer->Initialize(params))
+  {
+    delete renderer;
+    renderer = nullptr;
+    return false;
+  }
+
+  *out_renderer = renderer;
+  return true;
+}
+
+bool CPURasterizer::Initialize(const RZRendererCreateParams* params)
+{
+  width_ = params->RenderWidth;
+  height_ = params->RenderHeight;
+  dist_to_plane_ = width_ * 0.5f / tanf(params->HorizFOV * 0.5f);
+  aov_mask_ = params->Aovs | RZAov_Depth | RZAov_PrimitiveID;
+
+  if (params->ToneMap > RZToneMap_ACES)
+  {
+    assert(false);
+    return false;
+  }
+  tone_map_ = params->ToneMap;
+
+  int num_buffers = params->NumFrameBuffers > 0 ? (int)params->NumFrameBuffers : 2;
+  windowed_ = params->WindowHandle != nullptr;
+  if (windowed_ && !framebuffer_.Initialize((HWND)params->WindowHandle, width_, height_, num_buffers))
+  {
+    return false;
+  }
+
+  if (!pipeline_.Initialize(num_buffers,
+    [this](FramePipeline::frame& frame) { RenderFrame(frame, nullptr); },
+    [this](const FramePipeline::frame& frame) { framebuffer_.Present(frame.buffer); }))
+  {
+    return false;
+  }
+
+  if (!thread_pool_.Initialize((int)params->NumThreads))
+  {
+    assert(false);
+    return false;
+  }
+
+  if (!rasterizer_.Initialize(width_, height_, dist_to_plane_, &thread_pool_, (aov_mask_ & RZAov_Barycentrics) != 0))
+  {
+    assert(false);
+    return false;
+  }
+
+  material_ = RZMaterial{ RZVector3{ 1.f, 1.f, 1.f }, 0.f };
+
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  inv_timer_freq_ = 1000. / (double)freq.QuadPart;
+
+  return true;
+}
+
+// Scene changes are applied by the pipeline between frames, as in the raytracer
+
+uint32_t CPURasterizer::AddVertices(uint32_t num_vertices, const RZVector3* positions)
+{
+  uint32_t index = num_vertices_;
+  num_vertices_ += num_vertices;
+
+  pipeline_.Update([this, vertices = std::vector<RZVector3>(positions, positions + num_vertices)]()
+  {
+    positions_.insert(positions_.end(), vertices.begin(), vertices.end());
+  });
+  return index;
+}
+
+void CPURasterizer::SetMaterial(const RZMaterial& material)
+{
+  pipeline_.Update([this, material]()
+  {
+    material_ = material;
+  });
+}
+
+void CPURasterizer::AddMesh(uint32_t num_indices, const uint32_t* indices)
+{
+  pipeline_.Update([this, mesh_indices = std::vector<uint32_t>(indices, indices + num_indices)]()
+  {
+    mesh_first_triangles_.push_back((uint32_t)triangle_colors_.size());
+    tree_invalidated_ = true;
+    indices_.insert(indices_.end(), mesh_indices.begin(), mesh_indices.end());
+
+    // Same directional light as the raytracer's direct integrator, four triangles at a
+    // time. Only quantized to a color, so the fast normalize is close enough
+    size_t num_triangles = mesh_indices.size() / 3;
+    for (size_t first = 0; first < num_triangles; first += 4)
+    {
+      int count = (int)std::min<size_t>(4, num_triangles - first);
+      Vector3x4 v0 = Vector3x4::Splat(RZVector3{});
+      Vector3x4 v1 = v0, v2 = v0;
+      for (int i = 0; i < count; ++i)
+      {
+        const uint32_t* t = &mesh_indices[(first + i) * 3];
+        SetLane(&v0, i, positions_[t[0]]);
+        SetLane(&v1, i, positions_[t[1]]);
+        SetLane(&v2, i, positions_[t[2]]);
+      }
+
+      Vector3x4 normal = Normalize(Cross(v1 - v0, v2 - v0));
+      float4 d = Min(Max(Dot(Vector3x4::Splat(light_dir), normal), float4::Zero()), float4(1.f));
+      float lit[4];
+      d.Store(lit);
+      for (int i = 0; i < count; ++i)
+      {
+        triangle_radiance_.push_back(material_.Albedo * lit[i]);
+        triangle_colors_.push_back(ToneMapColor(triangle_radiance_.back(), tone_map_));
+      }
+    }
+  });
+}
+
+void CPURasterizer::RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+{
+  if (!windowed_)
+  {
+    assert(false);
+    return;
+  }
+
+  pipeline_.Flush();
+
+  FramePipeline::frame frame{ 0, viewer_position, viewer_orientation, 0, 0, 0 };
+  RenderFrame(frame, nullptr);
+  framebuffer_.Present(frame.buffer);
+}
+
+void CPURasterizer::RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+  const RZRenderTarget& target)
+{
+  if (!IsValidRenderTarget(target, width_))
+  {
+    assert(false);
+    return;
+  }
+
+  pipeline_.Flush();
+
+  FramePipeline::frame frame{ 0, viewer_position, viewer_orientation, 0, 0, 0 };
+  RenderFrame(frame, &target);
+}
+
+uint64_t CPURasterizer::BeginRender(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+{
+  if (!windowed_)
+  {
+    assert(false);
+    return 0;
+  }
+
+  return pipeline_.Submit(viewer_position, viewer_orientation);
+}
+
+void CPURasterizer::WaitFrame(uint64_t frame)
+{
+  pipeline_.Wait(frame);
+}
+
+bool CPURasterizer::TryGetFrame(uint64_t frame)
+{
+  return pipeline_.IsComplete(frame);
+}
+
+void CPURasterizer::RenderFrame(FramePipeline::frame& frame, const RZRenderTarget* target)
+{
+  LARGE_INTEGER start, now;
+  QueryPerformanceCounter(&start);
+
+  last_position_ = frame.viewer_position;
+  rasterizer_.Render(frame.viewer_position, positions_.data(), indices_.data(), 3 * sizeof(uint32_t),
+    (uint32_t)triangle_colors_.size());
+
+  // Resolve the visibility buffer to colors (or depth, or triangle IDs)
+  RZRenderTarget output = target ? *target :
+    RZRenderTarget{ framebuffer_.GetPixels(frame.buffer), width_ * 4u, RZPixelFormat_BGRA8 };
+  uint32_t pixel_size = GetPixelSize(output.Format);
+  uint32_t background_color = ToneMapColor(background, tone_map_);
+  thread_pool_.ParallelFor((height_ + ResolveRows - 1) / ResolveRows, [&](int index, int)
+  {
+    int y_end = std::min(height_, (index + 1) * ResolveRows);
+    for (int y = index * ResolveRows; y < y_end; ++y)
+    {
+      uint8_t* row = (uint8_t*)output.Pixels + (size_t)y * output.RowPitch;
+      for (int x = 0; x < width_; ++x)
+      {
+        uint32_t triangle = rasterizer_.GetTriangle(x, y);
+        if (output.Format == RZPixelFormat_BGRA8 || output.Format == RZPixelFormat_RGBA8)
+        {
+          uint32_t c = (triangle == Rasterizer::NoTriangle) ? background_color : triangle_colors_[triangle];
+          if (output.Format == RZPixelFormat_RGBA8)
+          {
+            c = (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+          }
+          ((uint32_t*)row)[x] = c;
+        }
+        else if (output.Format == RZPixelFormat_Depth32F)
+        {
+          float inv_depth = rasterizer_.GetInvDepth(x, y);
+          ((float*)row)[x] = inv_depth > 0.f ? 1.f / inv_depth : FLT_MAX;
+        }
+        else if (output.Format == RZPixelFormat_PrimitiveID)
+        {
+          ((uint32_t*)row)[x] = triangle;
+        }
+        else
+        {
+          StoreColor(output.Format, row + x * pixel_size,
+            (triangle == Rasterizer::NoTriangle) ? background : triangle_radiance_[triangle]);
+        }
+      }
+    }
+  });
+
+  frame.present_width = width_;
+  frame.present_height = height_;
+
+  QueryPerformanceCounter(&now);
+  std::lock_guard<std::mutex> lock(stats_lock_);
+  stats_ = RZRenderStats{};
+  stats_.SamplesPerPixel = 1;
+  stats_.FrameSamples = 1;
+  stats_.VisibleTriangles = rasterizer_.GetVisibleTriangleCount();
+  stats_.FrameTime = (float)((now.QuadPart - start.QuadPart) * inv_timer_freq_);
+  stats_.InstructionSet = RZInstructionSet_SSE2;
+
+  size_t num_triangles = indices_.size() / 3;
+  size_t geometry_bytes = positions_.capacity() * sizeof(RZVector3) + indices_.capacity() * sizeof(uint32_t) +
+    triangle_colors_.capacity() * sizeof(uint32_t) + triangle_radiance_.capacity() * sizeof(RZVector3) +
+    tree_.GetMemorySize();
+  stats_.GeometryBytesPerTriangle = num_triangles > 0 ? (float)((double)geometry_bytes / num_triangles) : 0.f;
+}
+
+void CPURasterizer::SetRegionsOfInterest(uint32_t num_regions, const RZRegionOfInterest* regions)
+{
+  // Rasterizing every pixel is already cheap
+  UNREFERENCED_PARAMETER(num_regions);
+  UNREFERENCED_PARAMETER(regions);
+}
+
+void CPURasterizer::GetStats(RZRenderStats* stats)
+{
+  if (!stats)
+  {
+    assert(false);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(stats_lock_);
+  *stats = stats_;
+}
+
+void CPURasterizer::GetAovs(const RZAovTarget& target)
+{
+  if ((target.Mask & ~aov_mask_) != 0 || !IsValidAovTarget(target, width_))
+  {
+    // Planes that weren't enabled at creation, or missing
+    assert(false);
+    return;
+  }
+
+  pipeline_.Flush();
+
+  // Everything is worked out from the last frame's visibility buffer
+  uint32_t mask = target.Mask;
+  float half_width = width_ * 0.5f;
+  float half_height = height_ * 0.5f;
+  thread_pool_.ParallelFor(height_, [&](int y, int)
+  {
+    for (int x = 0; x < width_; ++x)
+    {
+      uint32_t triangle = rasterizer_.GetTriangle(x, y);
+      bool found_hit = (triangle != Rasterizer::NoTriangle);
+      float depth = found_hit ? 1.f / rasterizer_.GetInvDepth(x, y) : FLT_MAX;
+
+      if ((mask & RZAov_Depth) != 0)
+      {
+        GetRow(target.Depth, target.RowPitch, y)[x] = depth;
+      }
+      if ((mask & RZAov_PrimitiveID) != 0)
+      {
+        GetRow(target.PrimitiveID, target.RowPitch, y)[x] = triangle;
+      }
+      if ((mask & RZAov_MeshID) != 0)
+      {
+        GetRow(target.MeshID, target.RowPitch, y)[x] = found_hit ? GetTriangleMesh(triangle) : Rasterizer::NoTriangle;
+      }
+      if ((mask & RZAov_Normal) != 0)
+      {
+        RZVector3 normal{};
+        if (found_hit)
+        {
+          RZVector3 v0 = positions_[indices_[triangle * 3]];
+          RZVector3 v1 = positions_[indices_[triangle * 3 + 1]];
+          RZVector3 v2 = positions_[indices_[triangle * 3 + 2]];
+          normal = RZVector3::Normalize(RZVector3::Cross(v1 - v0, v2 - v0));
+        }
+        GetRow(target.Normal[0], target.RowPitch, y)[x] = normal.x;
+        GetRow(target.Normal[1], target.RowPitch, y)[x] = normal.y;
+        GetRow(target.Normal[2], target.RowPitch, y)[x] = normal.z;
+      }
+      if ((mask & RZAov_Barycentrics) != 0)
+      {
+        float b1 = 0.f, b2 = 0.f;
+        if (found_hit)
+        {
+          rasterizer_.GetBarycentrics(x, y, &b1, &b2);
+        }
+        GetRow(target.Barycentrics[0], target.RowPitch, y)[x] = b1;
+        GetRow(target.Barycentrics[1], target.RowPitch, y)[x] = b2;
+      }
+      if ((mask & RZAov_Position) != 0)
+      {
+        // Back along the pixel center's ray, which has a z of dist_to_plane_
+        RZVector3 position{};
+        if (found_hit)
+        {
+          RZVector3 dir{ x + 0.5f - half_width, half_height - (y + 0.5f), dist_to_plane_ };
+          position = last_position_ + dir * (depth / dist_to_plane_);
+        }
+        GetRow(target.Position[0], target.RowPitch, y)[x] = position.x;
+        GetRow(target.Position[1], target.RowPitch, y)[x] = position.y;
+        GetRow(target.Position[2], target.RowPitch, y)[x] = position.z;
+      }
+    }
+  });
+}
+
+uint32_t CPURasterizer::GetVisibleMeshes(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+  uint32_t max_meshes, uint32_t* out_meshes)
+{
+  // As the projection, which doesn't rotate
+  UNREFERENCED_PARAMETER(viewer_orientation);
+
+  if (max_meshes > 0 && !out_meshes)
+  {
+    assert(false);
+    return 0;
+  }
+
+  UpdateTree();
+
+  float tan_half_fov_x = width_ * 0.5f / dist_to_plane_;
+  float tan_half_fov_y = height_ * 0.5f / dist_to_plane_;
+  FrustumQuery frustum = FrustumQuery::FromCamera(viewer_position, tan_half_fov_x, tan_half_fov_y);
+
+  std::vector<uint8_t> visible(mesh_first_triangles_.size());
+  uint32_t num_visible = 0;
+  tree_.TraverseFrustum(frustum, [&](const uint32_t* triangles, int count)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      uint32_t mesh = GetTriangleMesh(triangles[i]);
+      if (!visible[mesh])
+      {
+        visible[mesh] = 1;
+        ++num_visible;
+      }
+    }
+    return num_visible < (uint32_t)visible.size();
+  });
+
+  uint32_t written = 0;
+  for (uint32_t i = 0; i < (uint32_t)visible.size() && written < max_meshes; ++i)
+  {
+    if (visible[i])
+    {
+      out_meshes[written++] = i;
+    }
+  }
+  return num_visible;
+}
+
+bool CPURasterizer::FindNearestSurfacePoint(const RZVector3& point, float max_distance, RZSurfacePoint* out_result)
+{
+  if (!out_result)
+  {
+    assert(false);
+    return false;
+  }
+
+  FindNearestSurfacePoints(1, &point, max_distance, out_result);
+  return out_result->PrimitiveID != Rasterizer::NoTriangle;
+}
+
+void CPURasterizer::FindNearestSurfacePoints(uint32_t num_points, const RZVector3* points, float max_distance,
+  RZSurfacePoint* out_results)
+{
+  if (num_points > 0 && (!points || !out_results))
+  {
+    assert(false);
+    return;
+  }
+
+  UpdateTree();
+
+  NearestPointSearch<decltype(tree_), triangle> search(tree_, (const triangle*)indices_.data(), positions_.data());
+  if (num_points == 1)
+  {
+    search.FindNearest(points[0], max_distance, Rasterizer::NoTriangle, out_results);
+  }
+  else
+  {
+    search.FindNearestBatch(thread_pool_, num_points, points, max_distance, out_results, &nearest_keys_);
+  }
+
+  for (uint32_t i = 0; i < num_points; ++i)
+  {
+    if (out_results[i].PrimitiveID != Rasterizer::NoTriangle)
+    {
+      out_results[i].MeshID = GetTriangleMesh(out_results[i].PrimitiveID);
+    }
+  }
+}
+
+uint32_t CPURasterizer::FindMeshOverlaps(uint32_t mesh_a, uint32_t mesh_b, bool first_only,
+  uint32_t max_pairs, RZTrianglePair* out_pairs)
+{
+  if ((max_pairs > 0 && !out_pairs) || mesh_a == mesh_b)
+  {
+    assert(false);
+    return 0;
+  }
+
+  UpdateTree();
+  if (mesh_a >= mesh_first_triangles_.size() || mesh_b >= mesh_first_triangles_.size())
+  {
+    assert(false);
+    return 0;
+  }
+
+  std::vector<RZTrianglePair> pairs;
+  MeshOverlapSearch<triangle_tree, triangle> search((const triangle*)indices_.data(), positions_.data());
+  search.FindOverlaps(thread_pool_, GetMeshTree(mesh_a), mesh_first_triangles_[mesh_a],
+    GetMeshTree(mesh_b), mesh_first_triangles_[mesh_b], first_only, &pairs);
+
+  std::copy_n(pairs.begin(), std::min((uint32_t)pairs.size(), max_pairs), out_pairs);
+  return (uint32_t)pairs.size();
+}
+
+const CPURasterizer::triangle_tree& CPURasterizer::GetMeshTree(uint32_t mesh)
+{
+  // Meshes never change once added, so a tree stays valid once built
+  mesh_trees_.resize(mesh_first_triangles_.size());
+  if (!mesh_trees_[mesh])
+  {
+    uint32_t first = mesh_first_triangles_[mesh];
+    uint32_t end = (mesh + 1 < mesh_first_triangles_.size()) ?
+      mesh_first_triangles_[mesh + 1] : (uint32_t)(indices_.size() / 3);
+
+    mesh_trees_[mesh].reset(new triangle_tree());
+    mesh_trees_[mesh]->Rebuild((const triangle*)indices_.data() + first, (int)(end - first),
+      IndexedTriangleBounds<triangle>{ positions_.data() });
+  }
+  return *mesh_trees_[mesh];
+}
+
+void CPURasterizer::UpdateTree()
+{
+  // The scene isn't complete until queued changes are applied, and frames in flight
+  // may be using the threads
+  pipeline_.Flush();
+  if (tree_invalidated_)
+  {
+    tree_scratch_.Reset();
+    tree_.Rebuild((const triangle*)indices_.data(), (int)(indices_.size() / 3),
+      IndexedTriangleBounds<triangle>{ positions_.data() }, &tree_scratch_);
+    tree_invalidated_ = false;
+  }
+}
+
+uint32_t CPURasterizer::GetTriangleMesh(uint32_t triangle) const
+{
+  // Meshes are sorted by first triangle, find the last one starting at or before this triangle
+  auto it = std::upper_bound(mesh_first_triangles_.begin(), mesh_first_triangles_.end(), triangle);
+  assert(it != mesh_first_triangles_.begin());
+  return (uint32_t)(it - mesh_first_triangles_.begin() - 1);
+}
@@ -0,0 +1,116 @@
+//=============================================================================
+// CPURasterizer.h - Tile binning rasterizer implemented using the CPU
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "Rasterizer.h"
+#include "Util/AabbTree.h"
+#include "Util/Framebuffer.h"
+#include "Util/FramePipeline.h"
+#include "Util/MeshOverlaps.h"
+#include "Util/NearestPoints.h"
+#include "Util/ThreadPool.h"
+
+class CPURasterizer : public BaseObject<IRZRenderer>
+{
+public:
+  static bool Create(const RZRendererCreateParams* params, IRZRenderer** out_renderer);
+
+  virtual uint32_t AddVertices(uint32_t num_vertices, const RZVector3* positions) override;
+
+  virtual void SetMaterial(const RZMaterial& material) override;
+
+  virtual void AddMesh(uint32_t num_indices, const uint32_t* indices) override;
+
+  virtual void SetRegionsOfInterest(uint32_t num_regions, const RZRegionOfInterest* regions) override;
+
+  virtual void RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) override;
+
+  virtual void RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+    const RZRenderTarget& target) override;
+
+  virtual uint64_t BeginRender(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) override;
+
+  virtual void WaitFrame(uint64_t frame) override;
+
+  virtual bool TryGetFrame(uint64_t frame) override;
+
+  virtual void GetStats(RZRenderStats* stats) override;
+
+  virtual void GetAovs(const RZAovTarget& target) override;
+
+  virtual uint32_t GetVisibleMeshes(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+    uint32_t max_meshes, uint32_t* out_meshes) override;
+
+  virtual bool FindNearestSurfacePoint(const RZVector3& point, float max_distance, RZSurfacePoint* out_result) override;
+
+  virtual void FindNearestSurfacePoints(uint32_t num_points, const RZVector3* points, float max_distance,
+    RZSurfacePoint* out_results) override;
+
+  virtual uint32_t FindMeshOverlaps(uint32_t mesh_a, uint32_t mesh_b, bool first_only,
+    uint32_t max_pairs, RZTrianglePair* out_pairs) override;
+
+private:
+  // indices_ seen as triangles, for the trees
+  struct triangle
+  {
+    uint32_t i0, i1, i2;
+  };
+
+  typedef AabbTree<triangle, IndexedTriangleBounds<triangle>> triangle_tree;
+
+private:
+  CPURasterizer() {}
+  virtual ~CPURasterizer();
+
+  bool Initialize(const RZRendererCreateParams* params);
+
+  // Render stage: rasterize and resolve into target, or the frame's framebuffer if null
+  void RenderFrame(FramePipeline::frame& frame, const RZRenderTarget* target);
+
+  // Index of the mesh the triangle was added with
+  uint32_t GetTriangleMesh(uint32_t triangle) const;
+
+  // Apply queued scene changes, and rebuild the tree if the geometry changed
+  void UpdateTree();
+
+  // Tree over just the mesh's triangles, built the first time it's needed
+  const triangle_tree& GetMeshTree(uint32_t mesh);
+
+private:
+  bool windowed_ = false;
+  int width_ = 0;
+  int height_ = 0;
+  float dist_to_plane_ = 0.f;
+  double inv_timer_freq_ = 0.;
+  RZVector3 last_position_{};               // Camera of the last frame, for position AOVs
+  uint32_t aov_mask_ = 0;
+  RZToneMap tone_map_ = RZToneMap_Linear;
+
+  Framebuffer framebuffer_;
+  ThreadPool thread_pool_;
+  Rasterizer rasterizer_;
+
+  uint32_t num_vertices_ = 0;               // Including vertices still queued behind frames in flight
+  std::vector<RZVector3> positions_;
+  std::vector<uint32_t> indices_;           // 3 per triangle
+  std::vector<uint32_t> triangle_colors_;   // Lighting doesn't depend on the view, so shade (and tone map) once
+  std::vector<RZVector3> triangle_radiance_;  // Linear, for floating point targets
+  std::vector<uint32_t> mesh_first_triangles_;
+  RZMaterial material_{};
+
+  // Only needed for visibility queries, so built the first time one is made after
+  // the geometry changes
+  bool tree_invalidated_ = true;
+  triangle_tree tree_;
+  Arena tree_scratch_;                      // Build inputs, reused by every rebuild
+  std::vector<uint64_t> nearest_keys_;      // FindNearestSurfacePoints sort scratch
+  std::vector<std::unique_ptr<triangle_tree>> mesh_trees_;  // Per mesh, for overlaps. Built as needed
+
+  std::mutex stats_lock_;
+  RZRenderStats stats_{};
+
+  // Destroyed (and its threads stopped) first
+  FramePipeline pipeline_;
+};
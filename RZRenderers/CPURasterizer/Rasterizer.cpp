@@ -0,0 +1,366 @@
+//=============================================================================
+// Rasterizer.cpp - Tile binning triangle rasterizer producing a visibility buffer
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Rasterizer.h"
+#include "Math/Simd.h"
+#include "Util/ThreadPool.h"
+
+const float Rasterizer::NearPlane = 0.01f;
+
+// Triangles per work item during setup
+static const int SetupChunkSize = 1024;
+
+bool Rasterizer::Initialize(int width, int height, float dist_to_plane, ThreadPool* thread_pool, bool barycentrics)
+{
+  thread_pool_ = thread_pool;
+  width_ = width;
+  height_ = height;
+  half_width_ = width * 0.5f;
+  half_height_ = height * 0.5f;
+  dist_to_plane_ = dist_to_plane;
+
+  tiles_x_ = (width_ + TileSize - 1) / TileSize;
+  tiles_y_ = (height_ + TileSize - 1) / TileSize;
+  stride_ = tiles_x_ * TileSize;
+
+  inv_depths_.resize(stride_ * tiles_y_ * TileSize);
+  triangles_.resize(stride_ * tiles_y_ * TileSize);
+  hiz_.resize(tiles_x_ * tiles_y_ * BlocksPerTile * BlocksPerTile);
+
+  barycentrics_ = barycentrics;
+  if (barycentrics_)
+  {
+    bary1_.resize(stride_ * tiles_y_ * TileSize);
+    bary2_.resize(stride_ * tiles_y_ * TileSize);
+  }
+
+  int num_threads = thread_pool_->GetThreadCount();
+  setup_.resize(num_threads);
+  bins_.resize(num_threads);
+  for (auto& bins : bins_)
+  {
+    bins.resize(tiles_x_ * tiles_y_);
+  }
+
+  return true;
+}
+
+void Rasterizer::Render(const RZVector3& viewer_position,
+  const RZVector3* positions, const uint32_t* indices, int index_stride, uint32_t num_triangles)
+{
+  eye_ = viewer_position;
+  visible_count_ = 0;
+
+  for (int i = 0; i < (int)setup_.size(); ++i)
+  {
+    setup_[i].clear();
+    for (auto& bin : bins_[i])
+    {
+      bin.clear();
+    }
+  }
+
+  // Triangle setup & binning
+  int num_chunks = (int)((num_triangles + SetupChunkSize - 1) / SetupChunkSize);
+  thread_pool_->ParallelFor(num_chunks, [&](int chunk, int thread_index)
+  {
+    uint32_t end = std::min(num_triangles, (uint32_t)(chunk + 1) * SetupChunkSize);
+    for (uint32_t i = (uint32_t)chunk * SetupChunkSize; i < end; ++i)
+    {
+      const uint32_t* tri = (const uint32_t*)((const uint8_t*)indices + (size_t)i * index_stride);
+      SetupTriangle(positions[tri[0]], positions[tri[1]], positions[tri[2]], i, thread_index);
+    }
+  });
+
+  visible_triangles_ = visible_count_;
+
+  // Rasterize. Each tile is owned by one thread, so no synchronization is needed
+  thread_pool_->ParallelFor(tiles_x_ * tiles_y_, [&](int tile_index, int)
+  {
+    RasterizeTile(tile_index);
+  });
+}
+
+void Rasterizer::SetupTriangle(const RZVector3& v0, const RZVector3& v1, const RZVector3& v2,
+  uint32_t triangle, int thread_index)
+{
+  // View space (the camera doesn't rotate)
+  RZVector3 p[3] = { v0 - eye_, v1 - eye_, v2 - eye_ };
+
+  // Back face culling: same test the raytracer applies per ray
+  RZVector3 normal = RZVector3::Cross(p[1] - p[0], p[2] - p[0]);
+  if (!(RZVector3::Dot(normal, p[0]) < 0.f))
+  {
+    return;
+  }
+
+  // Clip against the near plane. A triangle becomes at most a quad. New vertices
+  // carry their barycentrics in the source triangle along
+  static const float vertex_bary[3][2] = { { 0.f, 0.f }, { 1.f, 0.f }, { 0.f, 1.f } };
+  RZVector3 clipped[4];
+  float clipped_bary[4][2];
+  int num_clipped = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    int j = (i + 1) % 3;
+    const RZVector3& a = p[i];
+    const RZVector3& b = p[j];
+    bool a_in = a.z >= NearPlane;
+    bool b_in = b.z >= NearPlane;
+    if (a_in)
+    {
+      clipped_bary[num_clipped][0] = vertex_bary[i][0];
+      clipped_bary[num_clipped][1] = vertex_bary[i][1];
+      clipped[num_clipped++] = a;
+    }
+    if (a_in != b_in)
+    {
+      float t = (NearPlane - a.z) / (b.z - a.z);
+      clipped_bary[num_clipped][0] = vertex_bary[i][0] + (vertex_bary[j][0] - vertex_bary[i][0]) * t;
+      clipped_bary[num_clipped][1] = vertex_bary[i][1] + (vertex_bary[j][1] - vertex_bary[i][1]) * t;
+      clipped[num_clipped++] = a + (b - a) * t;
+    }
+  }
+
+  if (num_clipped < 3)
+  {
+    return;
+  }
+
+  // Project all (up to four) vertices at once. Everything past the near plane has
+  // z >= NearPlane, so the fast reciprocal is well behaved
+  Vector3x4 c = Vector3x4::Splat(clipped[0]);
+  for (int i = 1; i < num_clipped; ++i)
+  {
+    SetLane(&c, i, clipped[i]);
+  }
+  float4 w = Rcp(c.z);
+  float4 scale = float4(dist_to_plane_) * w;
+  float sx[4], sy[4], sw[4];
+  (float4(half_width_) + c.x * scale).Store(sx);
+  (float4(half_height_) - c.y * scale).Store(sy);
+  w.Store(sw);
+
+  screen_vertex s[4];
+  for (int i = 0; i < num_clipped; ++i)
+  {
+    s[i].x = sx[i];
+    s[i].y = sy[i];
+    s[i].w = sw[i];
+    s[i].b1 = clipped_bary[i][0];
+    s[i].b2 = clipped_bary[i][1];
+  }
+
+  AddScreenTriangle(s[0], s[1], s[2], triangle, thread_index);
+  if (num_clipped == 4)
+  {
+    AddScreenTriangle(s[0], s[2], s[3], triangle, thread_index);
+  }
+}
+
+void Rasterizer::AddScreenTriangle(const screen_vertex& v0, const screen_vertex& v1, const screen_vertex& v2,
+  uint32_t triangle, int thread_index)
+{
+  // Pixel (x, y) is sampled at (x + 0.5, y + 0.5)
+  float fmin_x = std::min(std::min(v0.x, v1.x), v2.x);
+  float fmax_x = std::max(std::max(v0.x, v1.x), v2.x);
+  float fmin_y = std::min(std::min(v0.y, v1.y), v2.y);
+  float fmax_y = std::max(std::max(v0.y, v1.y), v2.y);
+
+  if (fmax_x < 0.f || fmax_y < 0.f || fmin_x > (float)width_ || fmin_y > (float)height_)
+  {
+    return;
+  }
+
+  setup_triangle t;
+  t.min_x = std::max(0, (int)ceilf(fmin_x - 0.5f));
+  t.min_y = std::max(0, (int)ceilf(fmin_y - 0.5f));
+  t.max_x = std::min(width_ - 1, (int)floorf(fmax_x - 0.5f));
+  t.max_y = std::min(height_ - 1, (int)floorf(fmax_y - 0.5f));
+  if (t.min_x > t.max_x || t.min_y > t.max_y)
+  {
+    // Falls between pixel centers
+    return;
+  }
+
+  float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+  if (fabsf(area) < 1e-8f)
+  {
+    return;
+  }
+
+  // Edge i is opposite vertex i, and evaluates to area at that vertex
+  const screen_vertex* v[3] = { &v0, &v1, &v2 };
+  float sign = area > 0.f ? 1.f : -1.f;
+  float inv_area = 1.f / area;
+  t.wa = t.wb = t.wc = 0.f;
+  t.b1a = t.b1b = t.b1c = 0.f;
+  t.b2a = t.b2b = t.b2c = 0.f;
+  for (int i = 0; i < 3; ++i)
+  {
+    const screen_vertex& a = *v[(i + 1) % 3];
+    const screen_vertex& b = *v[(i + 2) % 3];
+    float ea = a.y - b.y;
+    float eb = b.x - a.x;
+    float ec = a.x * b.y - b.x * a.y;
+
+    // Barycentric i is edge_i / area, so 1 / z interpolates with the same coefficients
+    t.wa += ea * inv_area * v[i]->w;
+    t.wb += eb * inv_area * v[i]->w;
+    t.wc += ec * inv_area * v[i]->w;
+
+    // As do attributes divided by z, for perspective correct interpolation
+    t.b1a += ea * inv_area * v[i]->w * v[i]->b1;
+    t.b1b += eb * inv_area * v[i]->w * v[i]->b1;
+    t.b1c += ec * inv_area * v[i]->w * v[i]->b1;
+    t.b2a += ea * inv_area * v[i]->w * v[i]->b2;
+    t.b2b += eb * inv_area * v[i]->w * v[i]->b2;
+    t.b2c += ec * inv_area * v[i]->w * v[i]->b2;
+
+    t.ea[i] = ea * sign;
+    t.eb[i] = eb * sign;
+    t.ec[i] = ec * sign;
+  }
+
+  t.max_w = std::max(std::max(v0.w, v1.w), v2.w);
+  t.triangle = triangle;
+
+  std::vector<setup_triangle>& setup = setup_[thread_index];
+  uint32_t index = (uint32_t)setup.size();
+  setup.push_back(t);
+  ++visible_count_;
+
+  // Bin into every tile the bounds overlap
+  std::vector<std::vector<uint32_t>>& bins = bins_[thread_index];
+  for (int ty = t.min_y / TileSize; ty <= t.max_y / TileSize; ++ty)
+  {
+    for (int tx = t.min_x / TileSize; tx <= t.max_x / TileSize; ++tx)
+    {
+      bins[ty * tiles_x_ + tx].push_back(index);
+    }
+  }
+}
+
+void Rasterizer::RasterizeTile(int tile_index)
+{
+  int tile_x = (tile_index % tiles_x_) * TileSize;
+  int tile_y = (tile_index / tiles_x_) * TileSize;
+
+  // Clear
+  for (int y = tile_y; y < tile_y + TileSize; ++y)
+  {
+    std::fill_n(&inv_depths_[y * stride_ + tile_x], TileSize, 0.f);
+    std::fill_n(&triangles_[y * stride_ + tile_x], TileSize, NoTriangle);
+  }
+  std::fill_n(&hiz_[tile_index * BlocksPerTile * BlocksPerTile], BlocksPerTile * BlocksPerTile, 0.f);
+
+  for (int thread_index = 0; thread_index < (int)bins_.size(); ++thread_index)
+  {
+    const std::vector<setup_triangle>& setup = setup_[thread_index];
+    for (uint32_t index : bins_[thread_index][tile_index])
+    {
+      RasterizeTriangle(setup[index], tile_x, tile_y);
+    }
+  }
+}
+
+void Rasterizer::RasterizeTriangle(const setup_triangle& t, int tile_x, int tile_y)
+{
+  int x0 = std::max(t.min_x, tile_x) & ~3;
+  int x1 = std::min(t.max_x, tile_x + TileSize - 1);
+  int y0 = std::max(t.min_y, tile_y);
+  int y1 = std::min(t.max_y, tile_y + TileSize - 1);
+
+  float* hiz = &hiz_[((tile_y / TileSize) * tiles_x_ + tile_x / TileSize) * BlocksPerTile * BlocksPerTile];
+  uint32_t dirty_blocks = 0;
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  const __m128 ea0 = _mm_set1_ps(t.ea[0]), ea1 = _mm_set1_ps(t.ea[1]), ea2 = _mm_set1_ps(t.ea[2]);
+  const __m128 wa = _mm_set1_ps(t.wa);
+  const __m128i triangle = _mm_set1_epi32((int)t.triangle);
+
+  for (int y = y0; y <= y1; ++y)
+  {
+    float py = y + 0.5f;
+    __m128 row0 = _mm_set1_ps(t.eb[0] * py + t.ec[0]);
+    __m128 row1 = _mm_set1_ps(t.eb[1] * py + t.ec[1]);
+    __m128 row2 = _mm_set1_ps(t.eb[2] * py + t.ec[2]);
+    __m128 roww = _mm_set1_ps(t.wb * py + t.wc);
+    int block_row = ((y - tile_y) / BlockSize) * BlocksPerTile;
+
+    for (int x = x0; x <= x1; x += 4)
+    {
+      // Whole block already closer than any point on the triangle?
+      int block = block_row + (x - tile_x) / BlockSize;
+      if (t.max_w <= hiz[block])
+      {
+        continue;
+      }
+
+      __m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+      __m128 e0 = _mm_add_ps(_mm_mul_ps(ea0, px), row0);
+      __m128 e1 = _mm_add_ps(_mm_mul_ps(ea1, px), row1);
+      __m128 e2 = _mm_add_ps(_mm_mul_ps(ea2, px), row2);
+      __m128 w = _mm_add_ps(_mm_mul_ps(wa, px), roww);
+
+      float* depth_ptr = &inv_depths_[y * stride_ + x];
+      __m128 depth = _mm_loadu_ps(depth_ptr);
+
+      __m128 mask = _mm_and_ps(
+        _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+        _mm_and_ps(_mm_cmpge_ps(e2, zero), _mm_cmpgt_ps(w, depth)));
+
+      if (_mm_movemask_ps(mask) == 0)
+      {
+        continue;
+      }
+
+      _mm_storeu_ps(depth_ptr, _mm_or_ps(_mm_and_ps(mask, w), _mm_andnot_ps(mask, depth)));
+
+      __m128i* triangle_ptr = (__m128i*)&triangles_[y * stride_ + x];
+      __m128i imask = _mm_castps_si128(mask);
+      __m128i old = _mm_loadu_si128(triangle_ptr);
+      _mm_storeu_si128(triangle_ptr, _mm_or_si128(_mm_and_si128(imask, triangle), _mm_andnot_si128(imask, old)));
+
+      if (barycentrics_)
+      {
+        __m128 inv_w = _mm_div_ps(_mm_set1_ps(1.f), w);
+        __m128 b1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.b1a), px), _mm_set1_ps(t.b1b * py + t.b1c)), inv_w);
+        __m128 b2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.b2a), px), _mm_set1_ps(t.b2b * py + t.b2c)), inv_w);
+
+        float* b1_ptr = &bary1_[y * stride_ + x];
+        float* b2_ptr = &bary2_[y * stride_ + x];
+        _mm_storeu_ps(b1_ptr, _mm_or_ps(_mm_and_ps(mask, b1), _mm_andnot_ps(mask, _mm_loadu_ps(b1_ptr))));
+        _mm_storeu_ps(b2_ptr, _mm_or_ps(_mm_and_ps(mask, b2), _mm_andnot_ps(mask, _mm_loadu_ps(b2_ptr))));
+      }
+
+      dirty_blocks |= 1u << block;
+    }
+  }
+
+  // Refresh the farthest depth of every block that was written to
+  for (int block = 0; dirty_blocks; ++block, dirty_blocks >>= 1)
+  {
+    if (!(dirty_blocks & 1))
+    {
+      continue;
+    }
+
+    int bx = tile_x + (block % BlocksPerTile) * BlockSize;
+    int by = tile_y + (block / BlocksPerTile) * BlockSize;
+    __m128 farthest = _mm_loadu_ps(&inv_depths_[by * stride_ + bx]);
+    for (int y = by; y < by + BlockSize; ++y)
+    {
+      for (int x = bx; x < bx + BlockSize; x += 4)
+      {
+        farthest = _mm_min_ps(farthest, _mm_loadu_ps(&inv_depths_[y * stride_ + x]));
+      }
+    }
+    farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+    farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+    hiz[block] = _mm_cvtss_f32(farthest);
+  }
+}
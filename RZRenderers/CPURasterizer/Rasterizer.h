@@ -0,0 +1,116 @@
+//=============================================================================
+// Rasterizer.h - Tile binning triangle rasterizer producing a visibility buffer
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class ThreadPool;
+
+class Rasterizer
+{
+public:
+  static const uint32_t NoTriangle = 0xFFFFFFFF;
+
+  Rasterizer() {}
+  ~Rasterizer() {}
+
+  // Same camera model as the raytracer: looking down +z from the viewer, with the
+  // image plane dist_to_plane pixels away. Barycentrics are only written if requested
+  bool Initialize(int width, int height, float dist_to_plane, ThreadPool* thread_pool, bool barycentrics);
+
+  // Rasterize triangles as seen from viewer_position. Triangle i uses the 3 vertex
+  // indices starting at (uint8_t*)indices + i * index_stride.
+  // Back facing triangles are culled, matching the raytracer
+  void Render(const RZVector3& viewer_position,
+    const RZVector3* positions, const uint32_t* indices, int index_stride, uint32_t num_triangles);
+
+  // Visibility buffer results, NoTriangle where nothing was drawn
+  uint32_t GetTriangle(int x, int y) const
+  {
+    return triangles_[y * stride_ + x];
+  }
+
+  // 1 / view space depth, 0 where nothing was drawn
+  float GetInvDepth(int x, int y) const
+  {
+    return inv_depths_[y * stride_ + x];
+  }
+
+  // Perspective correct barycentrics of vertices 1 & 2 of the visible triangle
+  void GetBarycentrics(int x, int y, float* out_b1, float* out_b2) const
+  {
+    assert(barycentrics_);
+    *out_b1 = bary1_[y * stride_ + x];
+    *out_b2 = bary2_[y * stride_ + x];
+  }
+
+  // Triangles that survived culling & clipping in the last Render
+  uint32_t GetVisibleTriangleCount() const
+  {
+    return visible_triangles_;
+  }
+
+private:
+  Rasterizer(const Rasterizer&) = delete;
+  Rasterizer& operator= (const Rasterizer&) = delete;
+
+  struct setup_triangle
+  {
+    float ea[3], eb[3], ec[3];  // Edge functions ea * x + eb * y + ec, all >= 0 inside
+    float wa, wb, wc;           // 1 / z = wa * x + wb * y + wc
+    float b1a, b1b, b1c;        // b1 / z, same form
+    float b2a, b2b, b2c;        // b2 / z, same form
+    float max_w;                // Nearest point of the triangle, for hierarchical depth rejection
+    int min_x, min_y, max_x, max_y; // Covered pixels, clamped to the screen
+    uint32_t triangle;          // Source triangle index
+  };
+
+  struct screen_vertex
+  {
+    float x, y, w;
+    float b1, b2;               // Barycentrics within the source triangle (changed by clipping)
+  };
+
+  // Cull, clip and project one triangle, adding the results to the thread's list & bins
+  void SetupTriangle(const RZVector3& v0, const RZVector3& v1, const RZVector3& v2,
+    uint32_t triangle, int thread_index);
+
+  void AddScreenTriangle(const screen_vertex& v0, const screen_vertex& v1, const screen_vertex& v2,
+    uint32_t triangle, int thread_index);
+
+  // Rasterize every triangle binned to the tile, in SIMD groups of 4 pixels
+  void RasterizeTile(int tile_index);
+
+  void RasterizeTriangle(const setup_triangle& t, int tile_x, int tile_y);
+
+private:
+  static const int TileSize = 32;     // Binning granularity
+  static const int BlockSize = 8;     // Hierarchical depth granularity
+  static const int BlocksPerTile = TileSize / BlockSize;
+  static const float NearPlane;
+
+  ThreadPool* thread_pool_ = nullptr;
+  int width_ = 0;
+  int height_ = 0;
+  float half_width_ = 0.f;
+  float half_height_ = 0.f;
+  float dist_to_plane_ = 0.f;
+  RZVector3 eye_{};
+
+  // Buffers are padded to whole tiles, so SIMD groups never need edge handling
+  int tiles_x_ = 0;
+  int tiles_y_ = 0;
+  int stride_ = 0;
+  std::vector<float> inv_depths_;
+  std::vector<uint32_t> triangles_;
+  std::vector<float> hiz_;            // Farthest (smallest) 1 / z in each block
+  bool barycentrics_ = false;
+  std::vector<float> bary1_;
+  std::vector<float> bary2_;
+
+  // Per thread setup results, and per thread, per tile bins of indices into them
+  std::vector<std::vector<setup_triangle>> setup_;
+  std::vector<std::vector<std::vector<uint32_t>>> bins_;
+  std::atomic<uint32_t> visible_count_ = ATOMIC_VAR_INIT(0);
+  uint32_t visible_triangles_ = 0;
+};
@@ -0,0 +1,177 @@
+//=============================================================================
+// Aovs.cpp - Auxiliary outputs (depth, normal, IDs...) of the CPU raytracer
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+#include "RenderTarget.h"
+
+static const uint32_t AllAovs = RZAov_Depth | RZAov_Normal | RZAov_PrimitiveID |
+  RZAov_MeshID | RZAov_Barycentrics | RZAov_Position;
+
+bool CPURaytracer::InitializeAovs(uint32_t aovs)
+{
+  if ((aovs & ~AllAovs) != 0)
+  {
+    assert(false);
+    return false;
+  }
+
+  // Planes are addressed like the accumulation buffers, so sized for the output resolution
+  aov_mask_ = aovs | RZAov_Depth | RZAov_PrimitiveID;
+  size_t size = (size_t)width_ * height_;
+
+  primary_depths_.resize(size, FLT_MAX);
+  primary_triangles_.resize(size, (uint32_t)NoHit);
+  if ((aov_mask_ & RZAov_MeshID) != 0)
+  {
+    primary_meshes_.resize(size, (uint32_t)NoHit);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    if ((aov_mask_ & RZAov_Normal) != 0)
+    {
+      primary_normals_[i].resize(size);
+    }
+    if ((aov_mask_ & RZAov_Position) != 0)
+    {
+      primary_positions_[i].resize(size);
+    }
+  }
+  for (int i = 0; i < 2 && (aov_mask_ & RZAov_Barycentrics) != 0; ++i)
+  {
+    primary_barycentrics_[i].resize(size);
+  }
+
+  return true;
+}
+
+void CPURaytracer::RecordPrimaryHit(const tile& tile, int block_x, int block_y,
+  const RZVector3& start, const RZVector3& dir, const hit* h)
+{
+  // View space depth, as the camera looks down +z
+  float depth = h ? h->dist * dir.z : FLT_MAX;
+  uint32_t triangle_index = h ? GetSourceTriangle(h->triangle) : NoHit;
+
+  // The optional AOVs are only worked out when enabled
+  uint32_t mesh_index = NoHit;
+  RZVector3 normal{};
+  RZVector3 position{};
+  float b1 = 0.f, b2 = 0.f;
+  if (h)
+  {
+    normal = h->normal;
+    if ((aov_mask_ & RZAov_MeshID) != 0)
+    {
+      mesh_index = GetTriangleMesh(h->triangle);
+    }
+    if ((aov_mask_ & (RZAov_Position | RZAov_Barycentrics)) != 0)
+    {
+      position = start + dir * h->dist;
+    }
+    if ((aov_mask_ & RZAov_Barycentrics) != 0 && triangle_index != h->triangle)
+    {
+      // A simplified triangle's hit is off the triangle reported, so it gets the
+      // weights of the reported triangle's closest point instead
+      const triangle& t = GetTriangle(triangle_index);
+      DistanceSqPointTriangle(position, positions_[t.i0], positions_[t.i1], positions_[t.i2], &b1, &b2);
+    }
+    else if ((aov_mask_ & RZAov_Barycentrics) != 0)
+    {
+      // Areas of the sub triangles opposite vertices 1 & 2, as in TestRayTriangle
+      const triangle& t = GetTriangle(h->triangle);
+      triangle_setup setup = GetTriangleSetup(h->triangle);
+      b1 = RZVector3::Dot(RZVector3::Cross(setup.e20, position - positions_[t.i2]), setup.normal) * setup.inv_2x_area;
+      b2 = RZVector3::Dot(RZVector3::Cross(setup.e01, position - positions_[t.i0]), setup.normal) * setup.inv_2x_area;
+    }
+  }
+
+  int x1 = std::min(block_x + tile.rate, tile.x1);
+  int y1 = std::min(block_y + tile.rate, tile.y1);
+  for (int y = block_y; y < y1; ++y)
+  {
+    for (int x = block_x; x < x1; ++x)
+    {
+      int i = y * width_ + x;
+      primary_depths_[i] = depth;
+      primary_triangles_[i] = triangle_index;
+
+      if ((aov_mask_ & RZAov_MeshID) != 0)
+      {
+        primary_meshes_[i] = mesh_index;
+      }
+      if ((aov_mask_ & RZAov_Normal) != 0)
+      {
+        primary_normals_[0][i] = normal.x;
+        primary_normals_[1][i] = normal.y;
+        primary_normals_[2][i] = normal.z;
+      }
+      if ((aov_mask_ & RZAov_Barycentrics) != 0)
+      {
+        primary_barycentrics_[0][i] = b1;
+        primary_barycentrics_[1][i] = b2;
+      }
+      if ((aov_mask_ & RZAov_Position) != 0)
+      {
+        primary_positions_[0][i] = position.x;
+        primary_positions_[1][i] = position.y;
+        primary_positions_[2][i] = position.z;
+      }
+    }
+  }
+}
+
+void CPURaytracer::GetAovs(const RZAovTarget& target)
+{
+  if ((target.Mask & ~aov_mask_) != 0 || !IsValidAovTarget(target, output_width_))
+  {
+    // Planes that weren't enabled at creation, or missing
+    assert(false);
+    return;
+  }
+
+  // Frames in flight are still writing the planes
+  pipeline_.Flush();
+
+  // Every plane is copied the same way, scaling up to the output size if needed
+  auto copy_plane = [&](auto* plane, const auto& values)
+  {
+    thread_pool_.ParallelFor(output_height_, [&](int y, int)
+    {
+      auto* row = (decltype(plane))((uint8_t*)plane + (size_t)y * target.RowPitch);
+      const auto* src_row = &values[(y * height_ / output_height_) * width_];
+      for (int x = 0; x < output_width_; ++x)
+      {
+        row[x] = src_row[x * width_ / output_width_];
+      }
+    });
+  };
+
+  if ((target.Mask & RZAov_Depth) != 0)
+  {
+    copy_plane(target.Depth, primary_depths_);
+  }
+  if ((target.Mask & RZAov_PrimitiveID) != 0)
+  {
+    copy_plane(target.PrimitiveID, primary_triangles_);
+  }
+  if ((target.Mask & RZAov_MeshID) != 0)
+  {
+    copy_plane(target.MeshID, primary_meshes_);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    if ((target.Mask & RZAov_Normal) != 0)
+    {
+      copy_plane(target.Normal[i], primary_normals_[i]);
+    }
+    if ((target.Mask & RZAov_Position) != 0)
+    {
+      copy_plane(target.Position[i], primary_positions_[i]);
+    }
+  }
+  for (int i = 0; i < 2 && (target.Mask & RZAov_Barycentrics) != 0; ++i)
+  {
+    copy_plane(target.Barycentrics[i], primary_barycentrics_[i]);
+  }
+}
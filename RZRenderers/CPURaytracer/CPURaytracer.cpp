@@ -4,218 +4,1449 @@
 //=============================================================================
 #include "Precomp.h"
 #include "CPURaytracer.h"
+#include "RenderTarget.h"
+
+const float CPURaytracer::DefaultAODistanceScale = 0.1f;
+const float CPURaytracer::DefaultMinResolutionScale = 0.25f;
+
+// Rows per work item when resolving
+static const int ResolveRows = 16;
 
 CPURaytracer::~CPURaytracer()
 {
-  framebuffer_ = nullptr;
+  pipeline_.Flush();
+}
+
+bool CPURaytracer::Create(const RZRendererCreateParams* params, IRZRenderer** out_renderer)
+{
+  CPURaytracer* renderer = new CPURaytracer();
+  if (!renderer->Initialize(params))
+  {
+    delete renderer;
+    renderer = nullptr;
+    return false;
+  }
+
+  *out_renderer = renderer;
+  return true;
+}
+
+bool CPURaytracer::Initialize(const RZRendererCreateParams* params)
+{
+  // Buffers are allocated at the output size. The render size is set at the end
+  output_width_ = width_ = params->RenderWidth;
+  output_height_ = height_ = params->RenderHeight;
+  tan_half_fov_ = tanf(params->HorizFOV * 0.5f);
+
+  // Without a window, only RZRenderTargets can be rendered to
+  int num_buffers = params->NumFrameBuffers > 0 ? (int)params->NumFrameBuffers : 2;
+  windowed_ = params->WindowHandle != nullptr;
+  if (windowed_)
+  {
+    if (!framebuffer_.Initialize((HWND)params->WindowHandle, width_, height_, num_buffers))
+    {
+      return false;
+    }
+    buffer_current_.resize(num_buffers);
+  }
+
+  if (!pipeline_.Initialize(num_buffers,
+    [this](FramePipeline::frame& frame) { RenderFrame(frame, nullptr); },
+    [this](const FramePipeline::frame& frame) { PresentFrame(frame); }))
+  {
+    return false;
+  }
+
+  progressive_ = (params->Flags & RZRenderFlag_Progressive) != 0;
+  max_samples_per_pixel_ = params->MaxSamplesPerPixel;
+  max_samples_per_frame_ = std::max(params->MaxSamplesPerFrame, 1u);
+  frame_time_budget_ = params->FrameTimeBudget;
+  adaptive_ = (params->Flags & RZRenderFlag_Adaptive) != 0;
+  if (params->AdaptiveThreshold > 0.f)
+  {
+    adaptive_threshold_ = params->AdaptiveThreshold;
+  }
+
+  accum_.resize(width_ * height_);
+  accum_lum_sq_.resize(width_ * height_);
+
+  if (!InitializeAovs(params->Aovs))
+  {
+    return false;
+  }
+
+  if (params->ToneMap > RZToneMap_ACES)
+  {
+    assert(false);
+    return false;
+  }
+  tone_map_ = params->ToneMap;
+  dither_ = (params->Flags & RZRenderFlag_Dither) != 0;
+
+  if (params->InstructionSet > RZInstructionSet_AVX2)
+  {
+    assert(false);
+    return false;
+  }
+  kernels_ = &GetKernels(params->InstructionSet);
+  stats_.InstructionSet = published_stats_.InstructionSet = kernels_->instruction_set;
+
+  // Only compact geometry is small enough per page to be worth paging
+  out_of_core_ = params->GeometryMemoryBudget > 0;
+  compact_ = out_of_core_ || (params->Flags & RZRenderFlag_CompactGeometry) != 0;
+  half_normals_ = compact_ && (params->Flags & RZRenderFlag_HalfNormals) != 0;
+  if (out_of_core_)
+  {
+    if (!page_cache_.Initialize(params->GeometryMemoryBudget))
+    {
+      return false;
+    }
+
+    positions_ = mapped_vector<RZVector3>(MappedAllocator<RZVector3>(true));
+    triangles_ = mapped_vector<triangle>(MappedAllocator<triangle>(true));
+    triangle_normals_ = mapped_vector<uint16_t>(MappedAllocator<uint16_t>(true));
+    cluster_triangles_ = mapped_vector<uint8_t>(MappedAllocator<uint8_t>(true));
+    cluster_quantized_ = mapped_vector<uint16_t>(MappedAllocator<uint16_t>(true));
+    cluster_floats_ = mapped_vector<RZVector3>(MappedAllocator<RZVector3>(true));
+
+    // Tree builds need scratch in proportion to the scene
+    scratch_.SetMapped(true);
+  }
+
+  integrator_ = params->Integrator;
+  if (params->MaxPathDepth > 0)
+  {
+    max_path_depth_ = params->MaxPathDepth;
+  }
+  if (params->AORayCount > 0)
+  {
+    ao_ray_count_ = params->AORayCount;
+  }
+  ao_distance_param_ = params->AODistance;
+
+  if (!thread_pool_.Initialize((int)params->NumThreads))
+  {
+    assert(false);
+    return false;
+  }
+
+  thread_contexts_.resize(thread_pool_.GetThreadCount());
+  for (thread_context& context : thread_contexts_)
+  {
+    // Room for a full rate tile, which is a multiple of the 8 lanes
+    shade_batch& batch = context.shading;
+    batch.count = 0;
+    batch.block_x.resize(TileSize * TileSize);
+    batch.block_y.resize(TileSize * TileSize);
+    batch.hit_mask.resize(TileSize * TileSize);
+    batch.nx.resize(TileSize * TileSize);
+    batch.ny.resize(TileSize * TileSize);
+    batch.nz.resize(TileSize * TileSize);
+    batch.r.resize(TileSize * TileSize);
+    batch.g.resize(TileSize * TileSize);
+    batch.b.resize(TileSize * TileSize);
+  }
+
+  hybrid_ = (params->Flags & RZRenderFlag_Hybrid) != 0;
+
+  // Secondary rays would have to agree with the full detail visibility buffer
+  level_of_detail_ = (params->Flags & RZRenderFlag_LevelOfDetail) != 0 && !hybrid_;
+
+  // The visibility buffer already makes primary hits cheap in hybrid mode
+  reproject_ = (params->Flags & RZRenderFlag_Reproject) != 0 && !hybrid_;
+  if (reproject_)
+  {
+    cache_triangles_.resize(width_ * height_, (uint32_t)NoHit);
+    cache_dists_.resize(width_ * height_);
+    reproject_keys_.resize(width_ * height_, UINT64_MAX);
+  }
+
+  wavefront_ = (params->Flags & RZRenderFlag_Wavefront) != 0 && integrator_ == RZIntegrator_PathTrace;
+  if (wavefront_)
+  {
+    path_radiance_.resize(width_ * height_);
+  }
+
+  target_frame_time_ = params->TargetFrameTime;
+  min_resolution_scale_ = params->MinResolutionScale > 0.f ?
+    std::min(params->MinResolutionScale, 1.f) : DefaultMinResolutionScale;
+  if (!SetResolutionScale(1.f))
+  {
+    return false;
+  }
+
+  // Default material, for meshes added before any SetMaterial
+  materials_.push_back(RZMaterial{ RZVector3{ 1.f, 1.f, 1.f }, 0.f });
+
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  inv_timer_freq_ = 1000. / (double)freq.QuadPart;
+
+  return true;
+}
+
+// Scene changes are copied and applied by the pipeline between frames, so frames
+// in flight don't see them
+
+uint32_t CPURaytracer::AddVertices(uint32_t num_vertices, const RZVector3* positions)
+{
+  uint32_t index = num_vertices_;
+  num_vertices_ += num_vertices;
+
+  pipeline_.Update([this, vertices = std::vector<RZVector3>(positions, positions + num_vertices)]()
+  {
+    positions_.insert(positions_.end(), vertices.begin(), vertices.end());
+  });
+  return index;
+}
+
+void CPURaytracer::SetMaterial(const RZMaterial& material)
+{
+  pipeline_.Update([this, material]()
+  {
+    materials_.push_back(material);
+  });
+}
+
+void CPURaytracer::AddMesh(uint32_t num_indices, const uint32_t* indices)
+{
+  pipeline_.Update([this, mesh_indices = std::vector<uint32_t>(indices, indices + num_indices)]()
+  {
+    uint32_t count = (uint32_t)mesh_indices.size();
+    meshes_.push_back(mesh{ (uint32_t)triangles_.size(), count / 3, (uint32_t)materials_.size() - 1, NoLod });
+
+    for (uint32_t i = 0; i < count; i += 3)
+    {
+      triangle t{ mesh_indices[i], mesh_indices[i + 1], mesh_indices[i + 2] };
+      triangles_.push_back(t);
+      if (compact_ && !half_normals_)
+      {
+        continue;
+      }
+
+      triangle_setup setup = ComputeTriangleSetup(positions_[t.i0], positions_[t.i1], positions_[t.i2]);
+      if (!compact_)
+      {
+        triangle_setups_.push_back(setup);
+        continue;
+      }
+
+      triangle_normals_.push_back(FloatToHalf(setup.normal.x));
+      triangle_normals_.push_back(FloatToHalf(setup.normal.y));
+      triangle_normals_.push_back(FloatToHalf(setup.normal.z));
+    }
+
+    if (level_of_detail_)
+    {
+      BuildMeshLods((uint32_t)meshes_.size() - 1);
+    }
+
+    tree_invalidated_ = true;
+  });
+}
+
+void CPURaytracer::SetRegionsOfInterest(uint32_t num_regions, const RZRegionOfInterest* regions)
+{
+  if (num_regions > 0 && !regions)
+  {
+    assert(false);
+    return;
+  }
+
+  pipeline_.Update([this, new_regions = std::vector<RZRegionOfInterest>(regions, regions + num_regions)]()
+  {
+    regions_ = new_regions;
+    UpdateTileRates();
+  });
+}
+
+void CPURaytracer::RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+{
+  if (!windowed_)
+  {
+    assert(false);
+    return;
+  }
+
+  // Finish any frames begun asynchronously (and the changes queued behind them) first
+  pipeline_.Flush();
+
+  FramePipeline::frame frame{ 0, viewer_position, viewer_orientation, 0, 0, 0 };
+  RenderFrame(frame, nullptr);
+  PresentFrame(frame);
+}
+
+void CPURaytracer::RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+  const RZRenderTarget& target)
+{
+  if (!IsValidRenderTarget(target, output_width_))
+  {
+    assert(false);
+    return;
+  }
+
+  pipeline_.Flush();
+
+  FramePipeline::frame frame{ 0, viewer_position, viewer_orientation, 0, 0, 0 };
+  RenderFrame(frame, &target);
+}
+
+uint64_t CPURaytracer::BeginRender(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+{
+  if (!windowed_)
+  {
+    assert(false);
+    return 0;
+  }
+
+  return pipeline_.Submit(viewer_position, viewer_orientation);
+}
+
+void CPURaytracer::WaitFrame(uint64_t frame)
+{
+  pipeline_.Wait(frame);
+}
+
+bool CPURaytracer::TryGetFrame(uint64_t frame)
+{
+  return pipeline_.IsComplete(frame);
+}
+
+void CPURaytracer::PresentFrame(const FramePipeline::frame& frame)
+{
+  framebuffer_.Present(frame.buffer, frame.present_width, frame.present_height);
+}
+
+void CPURaytracer::RenderFrame(FramePipeline::frame& frame, const RZRenderTarget* target)
+{
+  const RZVector3& viewer_position = frame.viewer_position;
+  const RZQuaternion& viewer_orientation = frame.viewer_orientation;
+
+  LARGE_INTEGER start, now;
+  QueryPerformanceCounter(&start);
+
+  // Nothing from the last frame's scratch is still in use
+  uint64_t heap_allocations = scratch_.GetHeapAllocations();
+  scratch_.Reset();
+
+  if (tree_invalidated_)
+  {
+    ApplyGeometryChanges();
+  }
+
+  // Ambient occlusion is expensive and view independent, so it is kept (and, once
+  // tiles reach their sample limit, reused as is) for as long as the camera is static
+  bool keep_samples = progressive_ || integrator_ == RZIntegrator_AmbientOcclusion;
+  bool moving = !keep_samples || CameraChanged(viewer_position, viewer_orientation);
+
+  // Moving frames render at whatever resolution holds the target. Once the camera
+  // stops, kept samples are refined at full resolution instead
+  if (target_frame_time_ > 0.f)
+  {
+    float scale = moving ? motion_scale_ : 1.f;
+    if (scale != resolution_scale_)
+    {
+      SetResolutionScale(scale);
+    }
+  }
+
+  if (moving)
+  {
+    ResetAccumulation();
+    if (reproject_)
+    {
+      Reproject(viewer_position);
+    }
+    last_position_ = viewer_position;
+    last_orientation_ = viewer_orientation;
+  }
+
+  // Only a stat, so the traversal is skipped while neither the camera nor the scene changes
+  if (!hybrid_ && (!visible_count_valid_ || viewer_position.x != counted_position_.x ||
+    viewer_position.y != counted_position_.y || viewer_position.z != counted_position_.z))
+  {
+    stats_.VisibleTriangles = CountVisibleTriangles(viewer_position);
+    counted_position_ = viewer_position;
+    visible_count_valid_ = true;
+  }
+
+  if (hybrid_ && !visibility_valid_)
+  {
+    rasterizer_.Render(viewer_position, positions_.data(), (const uint32_t*)triangles_.data(), sizeof(triangle),
+      (uint32_t)triangles_.size());
+    stats_.VisibleTriangles = rasterizer_.GetVisibleTriangleCount();
+    visibility_valid_ = true;
+  }
+
+  // Without progressive mode, the frame must be complete when we return.
+  // Adaptive mode can still take extra samples where they're needed.
+  uint32_t max_passes = progressive_ ? max_samples_per_frame_ : GetTileSampleLimit();
+
+  stats_.FrameSamples = 0;
+  stats_.PrimaryRays = 0;
+
+  for (auto& context : thread_contexts_)
+  {
+    context.primary_rays = context.secondary_rays = 0;
+    context.primary_ticks = context.secondary_ticks = 0;
+    context.reprojected_hits = context.retraced_hits = 0;
+    context.deferred_rays = 0;
+  }
+
+  // Progressive passes after the first are optional. They fill the budget, so they
+  // aren't part of what the frame costs
+  LARGE_INTEGER first_pass_end{};
+  for (uint32_t i = 0; i < max_passes; ++i)
+  {
+    uint64_t rays = RenderPass(viewer_position);
+    if (rays == 0)
+    {
+      // Every tile has converged or hit the sample limit
+      break;
+    }
+
+    ++stats_.FrameSamples;
+    stats_.PrimaryRays += rays;
+
+    // Stop if another pass, at the average cost so far, would blow the budget
+    QueryPerformanceCounter(&now);
+    if (i == 0)
+    {
+      first_pass_end = now;
+    }
+    double elapsed = (now.QuadPart - start.QuadPart) * inv_timer_freq_;
+    if (frame_time_budget_ > 0.f && elapsed * (i + 2) / (i + 1) > frame_time_budget_)
+    {
+      break;
+    }
+  }
+
+  LARGE_INTEGER passes_end;
+  QueryPerformanceCounter(&passes_end);
+
+  // Other buffers may still hold older frames, so those are resolved even without new samples
+  if (stats_.FrameSamples > 0)
+  {
+    std::fill(buffer_current_.begin(), buffer_current_.end(), (uint8_t)0);
+  }
+  if (target)
+  {
+    Resolve(*target, output_width_, output_height_);
+  }
+  else if (!buffer_current_[frame.buffer])
+  {
+    Resolve(RZRenderTarget{ framebuffer_.GetPixels(frame.buffer), output_width_ * 4u, RZPixelFormat_BGRA8 },
+      width_, height_);
+    buffer_current_[frame.buffer] = 1;
+  }
+  frame.present_width = width_;
+  frame.present_height = height_;
+
+  stats_.SamplesPerPixel = 0;
+  stats_.ActiveTiles = 0;
+  for (auto& t : tiles_)
+  {
+    stats_.SamplesPerPixel = std::max(stats_.SamplesPerPixel, t.sample_count);
+    if (!t.converged && t.sample_count < GetTileSampleLimit())
+    {
+      ++stats_.ActiveTiles;
+    }
+  }
+
+  // Secondary rays are incoherent, so their throughput is tracked separately from
+  // the primary rays
+  uint64_t primary_rays = 0, reprojected_hits = 0, retraced_hits = 0;
+  stats_.DeferredRays = 0;
+  int64_t primary_ticks = 0, secondary_ticks = 0;
+  stats_.SecondaryRays = 0;
+  for (auto& context : thread_contexts_)
+  {
+    primary_rays += context.primary_rays;
+    primary_ticks += context.primary_ticks;
+    stats_.SecondaryRays += context.secondary_rays;
+    secondary_ticks += context.secondary_ticks;
+    reprojected_hits += context.reprojected_hits;
+    retraced_hits += context.retraced_hits;
+    stats_.DeferredRays += context.deferred_rays;
+  }
+  stats_.PrimaryRayRate = primary_ticks > 0 ? (float)(primary_rays / (primary_ticks * inv_timer_freq_ * 1000.)) : 0.f;
+  stats_.SecondaryRayRate = secondary_ticks > 0 ? (float)(stats_.SecondaryRays / (secondary_ticks * inv_timer_freq_ * 1000.)) : 0.f;
+  stats_.RetraceFraction = (retraced_hits > 0) ? (float)((double)retraced_hits / (reprojected_hits + retraced_hits)) : 0.f;
+
+  QueryPerformanceCounter(&now);
+  stats_.FrameTime = (float)((now.QuadPart - start.QuadPart) * inv_timer_freq_);
+  stats_.ResolutionScale = resolution_scale_;
+  stats_.ScratchAllocations = (uint32_t)(scratch_.GetHeapAllocations() - heap_allocations);
+  stats_.GeometryBytesPerTriangle = triangles_.empty() ? 0.f : (float)((double)geometry_bytes_ / triangles_.size());
+  stats_.GeometryPagesLoaded = (uint32_t)(page_cache_.GetPagesLoaded() - pages_loaded_);
+  pages_loaded_ = page_cache_.GetPagesLoaded();
+
+  if (target_frame_time_ > 0.f && moving)
+  {
+    int64_t optional_ticks = (progressive_ && stats_.FrameSamples > 0) ? passes_end.QuadPart - first_pass_end.QuadPart : 0;
+    UpdateResolutionScale((float)((now.QuadPart - start.QuadPart - optional_ticks) * inv_timer_freq_));
+  }
+
+  std::lock_guard<std::mutex> lock(stats_lock_);
+  published_stats_ = stats_;
+}
+
+void CPURaytracer::GetStats(RZRenderStats* stats)
+{
+  if (!stats)
+  {
+    assert(false);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(stats_lock_);
+  *stats = published_stats_;
+}
+
+bool CPURaytracer::CameraChanged(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) const
+{
+  return viewer_position.x != last_position_.x ||
+    viewer_position.y != last_position_.y ||
+    viewer_position.z != last_position_.z ||
+    viewer_orientation.x != last_orientation_.x ||
+    viewer_orientation.y != last_orientation_.y ||
+    viewer_orientation.z != last_orientation_.z ||
+    viewer_orientation.w != last_orientation_.w;
+}
+
+bool CPURaytracer::SetResolutionScale(float scale)
+{
+  resolution_scale_ = scale;
+  width_ = std::max((int)(output_width_ * scale + 0.5f), 1);
+  height_ = std::max((int)(output_height_ * scale + 0.5f), 1);
+  half_width_ = width_ * 0.5f;
+  half_height_ = height_ * 0.5f;
+  dist_to_plane_ = half_width_ / tan_half_fov_;
+
+  tiles_.clear();
+  tiles_x_ = (width_ + TileSize - 1) / TileSize;
+  for (int y = 0; y < height_; y += TileSize)
+  {
+    for (int x = 0; x < width_; x += TileSize)
+    {
+      tiles_.push_back(tile{ x, y, std::min(x + TileSize, width_), std::min(y + TileSize, height_), 0, false, 1 });
+    }
+  }
+
+  UpdateTileRates();
+
+  if (hybrid_ && !rasterizer_.Initialize(width_, height_, dist_to_plane_, &thread_pool_, true))
+  {
+    assert(false);
+    return false;
+  }
+
+  // Cached hits are addressed by pixels of the old size
+  std::fill(cache_triangles_.begin(), cache_triangles_.end(), (uint32_t)NoHit);
+  std::fill(reproject_keys_.begin(), reproject_keys_.end(), UINT64_MAX);
+
+  ResetAccumulation();
+  return true;
+}
+
+void CPURaytracer::UpdateResolutionScale(float frame_cost)
+{
+  // Within 10% of the target is close enough. Every change drops the accumulated
+  // & cached samples, so the resolution shouldn't chase noise
+  float ratio = target_frame_time_ / std::max(frame_cost, 0.01f);
+  if (ratio > 0.9f && ratio < 1.1f)
+  {
+    return;
+  }
+
+  // Cost is roughly proportional to the pixel count, so each axis scales with the
+  // square root. Only go half way, to damp the jumps caused by a single frame
+  float scale = motion_scale_ * (1.f + (sqrtf(ratio) - 1.f) * 0.5f);
+
+  // In steps of 1/32 of the output size
+  scale = roundf(scale * 32.f) / 32.f;
+  motion_scale_ = std::min(std::max(scale, min_resolution_scale_), 1.f);
+}
+
+void CPURaytracer::UpdateTileRates()
+{
+  for (auto& t : tiles_)
+  {
+    int rate = regions_.empty() ? 1 : MaxTileRate;
+    for (auto& region : regions_)
+    {
+      // Distance from the region's center to the nearest point of the tile, in image widths
+      float cx = region.CenterX * width_;
+      float cy = region.CenterY * height_;
+      float dx = std::max(std::max(t.x0 - cx, cx - t.x1), 0.f);
+      float dy = std::max(std::max(t.y0 - cy, cy - t.y1), 0.f);
+      float dist = sqrtf(dx * dx + dy * dy) / width_;
+
+      int region_rate = 1;
+      if (dist > region.Radius)
+      {
+        int level = (region.Falloff > 0.f) ? 1 + (int)std::min((dist - region.Radius) / region.Falloff, 1.f) : 2;
+        region_rate = 1 << level;
+      }
+      rate = std::min(rate, region_rate);
+    }
+
+    if (rate == t.rate)
+    {
+      continue;
+    }
+
+    // Blocks of the old rate don't mix with the new samples
+    t.rate = rate;
+    t.sample_count = 0;
+    t.converged = false;
+    for (int y = t.y0; y < t.y1; ++y)
+    {
+      std::fill(&accum_[y * width_ + t.x0], &accum_[y * width_ + t.x1], RZVector3{});
+      std::fill(&accum_lum_sq_[y * width_ + t.x0], &accum_lum_sq_[y * width_ + t.x1], 0.f);
+
+      // Reduced rate tiles never take pixel center samples, so don't refresh the cache
+      if (!cache_triangles_.empty())
+      {
+        std::fill(&cache_triangles_[y * width_ + t.x0], &cache_triangles_[y * width_ + t.x1], (uint32_t)NoHit);
+      }
+    }
+  }
+}
+
+void CPURaytracer::GetBlockSample(const tile& tile, int block_x, int block_y,
+  int* out_x, int* out_y, float* out_jitter_x, float* out_jitter_y)
+{
+  float jitter_x, jitter_y;
+  GetSampleJitter(tile, &jitter_x, &jitter_y);
+
+  // Spread the jitter over the whole block (clipped by the tile edge)
+  float x = jitter_x * std::min(tile.rate, tile.x1 - block_x);
+  float y = jitter_y * std::min(tile.rate, tile.y1 - block_y);
+  int ix = (int)x;
+  int iy = (int)y;
+  *out_x = block_x + ix;
+  *out_y = block_y + iy;
+  *out_jitter_x = x - ix;
+  *out_jitter_y = y - iy;
+}
+
+uint64_t CPURaytracer::GetTileBlockCount(const tile& tile)
+{
+  uint64_t blocks_x = (tile.x1 - tile.x0 + tile.rate - 1) / tile.rate;
+  uint64_t blocks_y = (tile.y1 - tile.y0 + tile.rate - 1) / tile.rate;
+  return blocks_x * blocks_y;
+}
+
+uint32_t CPURaytracer::GetTileSampleLimit() const
+{
+  if (progressive_)
+  {
+    return max_samples_per_pixel_ > 0 ? max_samples_per_pixel_ : UINT32_MAX;
+  }
+  else if (adaptive_)
+  {
+    return max_samples_per_pixel_ > 0 ? max_samples_per_pixel_ : DefaultAdaptiveSamples;
+  }
+  return 1;
+}
+
+void CPURaytracer::ResetAccumulation()
+{
+  for (auto& t : tiles_)
+  {
+    t.sample_count = 0;
+    t.converged = false;
+  }
+
+  std::fill(accum_.begin(), accum_.end(), RZVector3{});
+  std::fill(accum_lum_sq_.begin(), accum_lum_sq_.end(), 0.f);
+
+  visibility_valid_ = false;
+  lod_passes_ = 0;
+}
+
+uint64_t CPURaytracer::RenderPass(const RZVector3& viewer_position)
+{
+  uint64_t rays = 0;
+
+  // Pages the last pass brought in over the budget go now
+  if (out_of_core_)
+  {
+    page_cache_.Trim();
+  }
+
+  if (!lod_meshes_.empty())
+  {
+    SelectLods(viewer_position);
+  }
+
+  int* active_tiles = scratch_.Allocate<int>(tiles_.size());
+  int num_active = 0;
+  for (int i = 0; i < (int)tiles_.size(); ++i)
+  {
+    const tile& t = tiles_[i];
+    if (t.converged || t.sample_count >= GetTileSampleLimit())
+    {
+      continue;
+    }
+
+    active_tiles[num_active++] = i;
+    rays += GetTileBlockCount(t);
+  }
+
+  if (wavefront_)
+  {
+    RenderPassWavefront(viewer_position, active_tiles, num_active);
+  }
+  else
+  {
+    thread_pool_.ParallelFor(num_active, [&](int index, int thread_index)
+    {
+      RenderTile(viewer_position, active_tiles[index], thread_contexts_[thread_index]);
+    });
+  }
+
+  // Convergence looks at neighboring pixels, so wait until the whole pass is done
+  if (adaptive_ && rays > 0)
+  {
+    thread_pool_.ParallelFor(num_active, [&](int index, int)
+    {
+      tile& t = tiles_[active_tiles[index]];
+      t.converged = IsTileConverged(t);
+    });
+  }
+
+  return rays;
+}
+
+void CPURaytracer::GetSampleJitter(const tile& tile, float* out_x, float* out_y)
+{
+  // First sample goes through the pixel center so a single sample image is unchanged
+  *out_x = 0.5f;
+  *out_y = 0.5f;
+  if (tile.sample_count > 0)
+  {
+    *out_x = Halton(tile.sample_count, 2);
+    *out_y = Halton(tile.sample_count, 3);
+  }
+}
+
+void CPURaytracer::RenderTile(const RZVector3& viewer_position, int tile_index, thread_context& context)
+{
+  tile& tile = tiles_[tile_index];
+
+  // Each thread has its own generator. Reseeding it from the tile & sample keeps the
+  // image independent of which thread picked up the tile
+  context.random.Seed(tile.sample_count, (uint64_t)tile_index);
+
+  for (int block_y = tile.y0; block_y < tile.y1; block_y += tile.rate)
+  {
+    for (int block_x = tile.x0; block_x < tile.x1; block_x += tile.rate)
+    {
+      int x, y;
+      float jitter_x, jitter_y;
+      GetBlockSample(tile, block_x, block_y, &x, &y, &jitter_x, &jitter_y);
+
+      RZVector3 dir{ x + jitter_x - half_width_, half_height_ - (y + jitter_y), dist_to_plane_ };
+      dir.Normalize();
+
+      LARGE_INTEGER t0, t1;
+      QueryPerformanceCounter(&t0);
+
+      hit h;
+      bool found_hit = FindPrimaryHit(x, y, jitter_x, jitter_y, viewer_position, dir, context, &h);
+
+      QueryPerformanceCounter(&t1);
+      ++context.primary_rays;
+      context.primary_ticks += t1.QuadPart - t0.QuadPart;
+
+      if (tile.sample_count == 0)
+      {
+        RecordPrimaryHit(tile, block_x, block_y, viewer_position, dir, found_hit ? &h : nullptr);
+      }
+
+      // Direct lighting is cheap next to finding the hit, so it's shaded for the whole
+      // tile at once in SIMD lanes rather than one sample at a time
+      if (integrator_ == RZIntegrator_Direct)
+      {
+        QueueDirectShading(block_x, block_y, found_hit ? &h : nullptr, &context.shading);
+        continue;
+      }
+
+      RZVector3 color = background;
+      if (integrator_ == RZIntegrator_PathTrace)
+      {
+        color = TracePath(viewer_position, dir, found_hit ? &h : nullptr, context);
+      }
+      else if (found_hit)
+      {
+        color = ShadeAmbientOcclusion(viewer_position, dir, h, context);
+      }
+
+      AccumulateBlock(tile, block_x, block_y, color);
+    }
+  }
 
-  if (framebuffer_hdc_)
+  if (integrator_ == RZIntegrator_Direct)
   {
-    DeleteDC(framebuffer_hdc_);
-    framebuffer_hdc_ = nullptr;
+    ShadeDirectBatch(tile, &context.shading);
   }
+
+  ++tile.sample_count;
 }
 
-bool CPURaytracer::Create(const RZRendererCreateParams* params, IRZRenderer** out_renderer)
+void CPURaytracer::AccumulateBlock(const tile& tile, int block_x, int block_y, const RZVector3& color)
 {
-  CPURaytracer* renderer = new CPURaytracer();
-  if (!renderer->Initialize(params))
+  // Reduced rate blocks are reconstructed by repeating the sample over the block.
+  // Jittering it over the whole block makes the accumulated result a box filter
+  float lum = Luminance(color);
+  int x1 = std::min(block_x + tile.rate, tile.x1);
+  int y1 = std::min(block_y + tile.rate, tile.y1);
+  for (int y = block_y; y < y1; ++y)
   {
-    delete renderer;
-    renderer = nullptr;
-    return false;
+    for (int x = block_x; x < x1; ++x)
+    {
+      accum_[y * width_ + x] += color;
+      accum_lum_sq_[y * width_ + x] += lum * lum;
+    }
   }
+}
 
-  *out_renderer = renderer;
+bool CPURaytracer::IsTileConverged(const tile& tile) const
+{
+  if (tile.sample_count < MinAdaptiveSamples)
+  {
+    // Too few samples for a meaningful variance. Look for edges instead: any large
+    // step to a neighboring pixel (including those just outside the tile) needs
+    // more samples. Flat background and smooth interiors stop here.
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      for (int x = tile.x0; x < tile.x1; ++x)
+      {
+        float lum = PixelLuminance(x, y);
+        for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height_ - 1); ++ny)
+        {
+          for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width_ - 1); ++nx)
+          {
+            if (fabsf(PixelLuminance(nx, ny) - lum) > adaptive_threshold_)
+            {
+              // An edge tile always gets the minimum sample count before variance decides
+              return false;
+            }
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  // Converged once the standard error of every pixel's mean is under the threshold
+  float n = (float)tile.sample_count;
+  float max_variance = adaptive_threshold_ * adaptive_threshold_ * n;
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    for (int x = tile.x0; x < tile.x1; ++x)
+    {
+      float mean = Luminance(accum_[y * width_ + x]) / n;
+      float variance = accum_lum_sq_[y * width_ + x] / n - mean * mean;
+      if (variance > max_variance)
+      {
+        return false;
+      }
+    }
+  }
   return true;
 }
 
-bool CPURaytracer::Initialize(const RZRendererCreateParams* params)
+float CPURaytracer::PixelLuminance(int x, int y) const
 {
-  window_ = (HWND)params->WindowHandle;
+  const tile& t = tiles_[(y / TileSize) * tiles_x_ + x / TileSize];
+  if (t.sample_count == 0)
+  {
+    return 0.f;
+  }
+  return Luminance(accum_[y * width_ + x]) / t.sample_count;
+}
 
-  HDC hdc = GetDC(window_);
-  if (!hdc)
+bool CPURaytracer::FindPrimaryHit(int x, int y, float jitter_x, float jitter_y,
+  const RZVector3& start, const RZVector3& dir, thread_context& context, hit* out_hit)
+{
+  bool pixel_center = (jitter_x == 0.5f && jitter_y == 0.5f);
+  if (reproject_ && pixel_center)
   {
-    assert(false);
-    return false;
+    return FindReprojectedHit(x, y, start, dir, context, out_hit);
   }
 
-  framebuffer_hdc_ = CreateCompatibleDC(hdc);
+  if (!hybrid_)
+  {
+    return Intersect(start, dir, out_hit);
+  }
+
+  uint32_t index = rasterizer_.GetTriangle(x, y);
+  if (pixel_center)
+  {
+    // Exactly the sample the rasterizer took, so the buffer is the answer
+    if (index == Rasterizer::NoTriangle)
+    {
+      return false;
+    }
 
-  // done with the hwnd's hdc.
-  ReleaseDC(window_, hdc);
+    float b1, b2;
+    rasterizer_.GetBarycentrics(x, y, &b1, &b2);
+    triangle_setup setup = GetTriangleSetup(index);
+    RZVector3 position = positions_[triangles_[index].i0] + setup.e01 * b1 - setup.e20 * b2;
+    out_hit->dist = (position - start).Length();
+    out_hit->normal = setup.normal;
+    out_hit->triangle = index;
+    return true;
+  }
 
-  if (!framebuffer_hdc_)
+  // A jittered sample lies between the 4 nearest pixel centers. When they all see
+  // the same triangle (or nothing), so does the sample, unless something smaller
+  // than a pixel falls between them. Anywhere else needs a full trace.
+  int nx = (jitter_x < 0.5f) ? std::max(x - 1, 0) : std::min(x + 1, width_ - 1);
+  int ny = (jitter_y < 0.5f) ? std::max(y - 1, 0) : std::min(y + 1, height_ - 1);
+  if (rasterizer_.GetTriangle(nx, y) == index &&
+    rasterizer_.GetTriangle(x, ny) == index &&
+    rasterizer_.GetTriangle(nx, ny) == index)
   {
-    assert(false);
-    return false;
+    if (index == Rasterizer::NoTriangle)
+    {
+      return false;
+    }
+
+    if (TestRayTriangle(start, dir, positions_.data(), triangles_[index], GetTriangleSetup(index),
+      &out_hit->dist, &out_hit->normal))
+    {
+      out_hit->triangle = index;
+      return true;
+    }
   }
 
-  width_ = params->RenderWidth;
-  height_ = params->RenderHeight;
-  half_width_ = width_ * 0.5f;
-  half_height_ = height_ * 0.5f;
-  dist_to_plane_ = half_width_ / tanf(params->HorizFOV * 0.5f);
+  return Intersect(start, dir, out_hit);
+}
+
+RZVector3 CPURaytracer::TracePath(const RZVector3& start, const RZVector3& dir, const hit* primary, thread_context& context) const
+{
+  RZVector3 radiance{};
+  RZVector3 throughput{ 1.f, 1.f, 1.f };
+  RZVector3 ray_start = start;
+  RZVector3 ray_dir = dir;
+
+  LARGE_INTEGER t0, t1;
+  QueryPerformanceCounter(&t0);
 
-  BITMAPINFO bmi{};
-  bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-  bmi.bmiHeader.biWidth = width_;
-  bmi.bmiHeader.biHeight = -height_; // Negative means top-down
-  bmi.bmiHeader.biPlanes = 1;
-  bmi.bmiHeader.biBitCount = 32;
-  bmi.bmiHeader.biCompression = BI_RGB;
+  uint64_t secondary_rays = 0;
 
-  HBITMAP bitmap = CreateDIBSection(framebuffer_hdc_, &bmi, DIB_RGB_COLORS, (PVOID*)&framebuffer_, nullptr, 0);
-  if (!bitmap)
+  for (uint32_t depth = 0; ; ++depth)
   {
-    assert(false);
-    return false;
-  }
+    hit h;
+    bool found_hit = false;
+    if (depth == 0)
+    {
+      found_hit = primary != nullptr;
+      if (found_hit)
+      {
+        h = *primary;
+      }
+    }
+    else
+    {
+      found_hit = Intersect(ray_start, ray_dir, &h);
+      ++secondary_rays;
+    }
 
-  // Select the bitmap (this takes a reference on it)
-  SelectObject(framebuffer_hdc_, bitmap);
+    if (!found_hit)
+    {
+      // Escaped to the sky. The directional light is a delta light, so it is
+      // only ever reached through next event estimation below.
+      radiance += Modulate(throughput, background);
+      break;
+    }
 
-  // Delete the object (the DC still has a reference)
-  DeleteObject(bitmap);
+    const RZMaterial& material = GetTriangleMaterial(h.triangle);
+    RZVector3 position = ray_start + ray_dir * h.dist + h.normal * (ray_epsilon * std::max(1.f, h.dist));
+    float diffuse = 1.f - material.Specular;
 
-  return true;
+    // Next event estimation: sample the light directly from every diffuse vertex
+    float n_dot_l = RZVector3::Dot(h.normal, light_dir);
+    if (diffuse > 0.f && n_dot_l > 0.f)
+    {
+      ++secondary_rays;
+      if (!Occluded(position, light_dir, FLT_MAX))
+      {
+        // Lambert BRDF is albedo / Pi
+        radiance += Modulate(throughput, material.Albedo) * (diffuse * n_dot_l * light_irradiance / Pi);
+      }
+    }
+
+    if (depth + 1 >= max_path_depth_)
+    {
+      break;
+    }
+
+    // Pick a lobe proportional to its weight, so the weight cancels out
+    if (context.random.NextFloat() < material.Specular)
+    {
+      ray_dir = Reflect(ray_dir, h.normal);
+    }
+    else
+    {
+      // Cosine sampling cancels the cosine & 1 / Pi of the BRDF, leaving only albedo
+      ray_dir = CosineSampleHemisphere(h.normal, context.random.NextFloat(), context.random.NextFloat());
+      throughput = Modulate(throughput, material.Albedo);
+    }
+    ray_start = position;
+
+    if (depth + 1 >= RouletteStartDepth)
+    {
+      float survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.95f);
+      if (context.random.NextFloat() >= survival)
+      {
+        break;
+      }
+      throughput /= survival;
+    }
+  }
+
+  QueryPerformanceCounter(&t1);
+  context.secondary_rays += secondary_rays;
+  context.secondary_ticks += t1.QuadPart - t0.QuadPart;
+
+  return radiance;
 }
 
-uint32_t CPURaytracer::AddVertices(uint32_t num_vertices, const RZVector3* positions)
+RZVector3 CPURaytracer::ShadeAmbientOcclusion(const RZVector3& start, const RZVector3& dir, const hit& h, thread_context& context) const
 {
-  uint32_t index = (uint32_t)positions_.size();
-  positions_.insert(positions_.end(), positions, positions + num_vertices);
-  return index;
+  LARGE_INTEGER t0, t1;
+  QueryPerformanceCounter(&t0);
+
+  RZVector3 position = start + dir * h.dist + h.normal * (ray_epsilon * std::max(1.f, h.dist));
+
+  uint32_t unoccluded = 0;
+  for (uint32_t i = 0; i < ao_ray_count_; ++i)
+  {
+    // Cosine distributed, so the unoccluded fraction is the cosine weighted visibility
+    RZVector3 ao_dir = CosineSampleHemisphere(h.normal, context.random.NextFloat(), context.random.NextFloat());
+    if (!Occluded(position, ao_dir, ao_distance_))
+    {
+      ++unoccluded;
+    }
+  }
+
+  QueryPerformanceCounter(&t1);
+  context.secondary_rays += ao_ray_count_;
+  context.secondary_ticks += t1.QuadPart - t0.QuadPart;
+
+  return GetTriangleMaterial(h.triangle).Albedo * ((float)unoccluded / ao_ray_count_);
 }
 
-void CPURaytracer::AddMesh(uint32_t num_indices, const uint32_t* indices)
+bool CPURaytracer::Intersect(const RZVector3& start, const RZVector3& dir, hit* out_hit, bool* out_deferred) const
 {
-  for (uint32_t i = 0; i < num_indices; i += 3)
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  int closest = -1;
+  out_hit->dist = FLT_MAX;
+  if (out_deferred)
+  {
+    *out_deferred = false;
+  }
+
+  RayQuery query(start, dir);
+  tree_.Traverse(query, [&](const uint32_t* run, int count)
+  {
+    // Packets are in tree order, so ties go the same way as testing one at a time
+    int first = (int)(run - order);
+    int found = FindClosestSelectedHit(start, dir, first, first + count, &out_hit->dist, out_deferred);
+    if (found >= 0)
+    {
+      closest = found;
+    }
+    return true;
+  });
+
+  // Simplified levels are in a tree of their own, only searched up to the hit so far
+  uint32_t lod_hit = NoHit;
+  if (any_simplified_)
+  {
+    lod_hit = FindClosestLodHit(start, dir, &out_hit->dist, false);
+  }
+
+  if (closest < 0 && lod_hit == NoHit)
   {
-    triangle t;
-    t.i0 = indices[i];
-    t.i1 = indices[i + 1];
-    t.i2 = indices[i + 2];
-    RZVector3 v0 = positions_[t.i0];
-    RZVector3 v1 = positions_[t.i1];
-    RZVector3 v2 = positions_[t.i2];
-    t.e01 = v1 - v0;
-    t.e12 = v2 - v1;
-    t.e20 = v0 - v2;
-    t.normal = RZVector3::Cross(t.e01, -t.e20);
-    t.inv_2x_area = 1.f / t.normal.Length();
-    t.normal *= t.inv_2x_area;  // normalize
-    triangles_.push_back(t);
+    return false;
   }
 
-  tree_invalidated_ = true;
+  uint32_t index = (lod_hit != NoHit) ? lod_hit : order[closest];
+  out_hit->normal = GetTriangleNormal(index);
+  out_hit->triangle = index;
+  return true;
 }
 
-void CPURaytracer::RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+bool CPURaytracer::Occluded(const RZVector3& start, const RZVector3& dir, float max_dist, bool* out_deferred) const
 {
-  UNREFERENCED_PARAMETER(viewer_orientation);
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  if (out_deferred)
+  {
+    *out_deferred = false;
+  }
 
-  if (tree_invalidated_)
+  bool occluded = false;
+  auto visitor = [&](const uint32_t* run, int count)
+  {
+    int first = (int)(run - order);
+    float dist = max_dist;
+    occluded = FindClosestSelectedHit(start, dir, first, first + count, &dist, out_deferred) >= 0;
+
+    // Any hit will do, so stop at the first
+    return !occluded;
+  };
+
+  // Short rays (ie. ambient occlusion) skip every node that starts past max_dist
+  if (max_dist < FLT_MAX)
+  {
+    SegmentQuery query(start, dir, max_dist);
+    tree_.Traverse(query, visitor);
+  }
+  else
   {
-    RebuildTree();
+    RayQuery query(start, dir);
+    tree_.Traverse(query, visitor);
   }
 
-  for (int y = 0; y < height_; ++y)
+  if (!occluded && any_simplified_)
   {
-    for (int x = 0; x < width_; ++x)
-    {
-      RZVector3 dir{ x - half_width_, half_height_ - y, dist_to_plane_ };
-      dir.Normalize();
+    float dist = max_dist;
+    occluded = FindClosestLodHit(start, dir, &dist, true) != NoHit;
+  }
 
-      uint32_t color = 0xFF000066; // background
+  // A hit settles it, whatever the pages that weren't in hold
+  if (occluded && out_deferred)
+  {
+    *out_deferred = false;
+  }
+  return occluded;
+}
 
-      bool hit = false;
-      float dist = 0.f, min_dist = FLT_MAX;
-      RZVector3 norm{}, min_norm{};
+int CPURaytracer::IntersectPacket(const RZVector3* starts, const RZVector3* dirs, int count, hit* out_hits,
+  bool* out_deferred) const
+{
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  int closest[RayPacketQuery::MaxRays];
+  for (int i = 0; i < count; ++i)
+  {
+    closest[i] = -1;
+    out_hits[i].dist = FLT_MAX;
+    if (out_deferred)
+    {
+      out_deferred[i] = false;
+    }
+  }
 
-      if (tree_.TraceRay(viewer_position, dir, &scratch_hits_))
+  // Each ray gets the leaves it passes in the same order as Intersect, so it ends
+  // up with the same hit
+  RayPacketQuery query(starts, dirs, count);
+  tree_.TraversePacket(query, (1 << count) - 1, [&](const uint32_t* run, int run_count, int ray_mask)
+  {
+    int first = (int)(run - order);
+    for (int i = 0; i < count; ++i)
+    {
+      if (ray_mask & (1 << i))
       {
-        for (int i = 0; i < (int)scratch_hits_.size(); ++i)
+        int found = FindClosestSelectedHit(starts[i], dirs[i], first, first + run_count, &out_hits[i].dist,
+          out_deferred ? &out_deferred[i] : nullptr);
+        if (found >= 0)
         {
-          if (TestRayTriangle(viewer_position, dir, positions_.data(), triangles_[scratch_hits_[i]], &dist, &norm))
-          {
-            if (dist < min_dist)
-            {
-              min_dist = dist;
-              min_norm = norm;
-            }
-            hit = true;
-          }
+          closest[i] = found;
         }
+      }
+    }
+    return ray_mask;
+  });
 
-        if (hit)
-        {
-          static const RZVector3 light_dir = RZVector3::Normalize(RZVector3{ 1.f, 1.f, -1.f });
-          float d = std::min(std::max(0.f, RZVector3::Dot(light_dir, min_norm)), 1.f);
-          uint32_t c = (uint32_t)(uint8_t)(255 * d);
-          color = 0xFF000000 | (c << 16) | (c << 8) | c;
-          //color = 0xFFFFFFFF;
-        }
+  int hit_mask = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    uint32_t lod_hit = NoHit;
+    if (any_simplified_)
+    {
+      lod_hit = FindClosestLodHit(starts[i], dirs[i], &out_hits[i].dist, false);
+    }
+
+    if (closest[i] < 0 && lod_hit == NoHit)
+    {
+      continue;
+    }
+
+    uint32_t index = (lod_hit != NoHit) ? lod_hit : order[closest[i]];
+    out_hits[i].normal = GetTriangleNormal(index);
+    out_hits[i].triangle = index;
+    hit_mask |= (1 << i);
+  }
+  return hit_mask;
+}
+
+int CPURaytracer::OccludedPacket(const RZVector3* starts, const RZVector3* dirs, int count, bool* out_deferred) const
+{
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  if (out_deferred)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      out_deferred[i] = false;
+    }
+  }
+
+  // Rays leave the packet at their first hit
+  int occluded = 0;
+  RayPacketQuery query(starts, dirs, count);
+  tree_.TraversePacket(query, (1 << count) - 1, [&](const uint32_t* run, int run_count, int ray_mask)
+  {
+    int first = (int)(run - order);
+    for (int i = 0; i < count; ++i)
+    {
+      float dist = FLT_MAX;
+      if ((ray_mask & (1 << i)) &&
+        FindClosestSelectedHit(starts[i], dirs[i], first, first + run_count, &dist,
+          out_deferred ? &out_deferred[i] : nullptr) >= 0)
+      {
+        occluded |= (1 << i);
+      }
+    }
+    return ray_mask & ~occluded;
+  });
+
+  for (int i = 0; i < count; ++i)
+  {
+    if (!(occluded & (1 << i)) && any_simplified_)
+    {
+      float dist = FLT_MAX;
+      if (FindClosestLodHit(starts[i], dirs[i], &dist, true) != NoHit)
+      {
+        occluded |= (1 << i);
       }
+    }
 
-      framebuffer_[y * width_ + x] = color;
+    if ((occluded & (1 << i)) && out_deferred)
+    {
+      out_deferred[i] = false;
     }
   }
+  return occluded;
+}
+
+int CPURaytracer::FindClosestHit(const RZVector3& start, const RZVector3& dir, int first, int end, float* io_dist,
+  bool* io_deferred) const
+{
+  if (compact_)
+  {
+    return FindClosestCompactHit(start, dir, first, end, io_dist, io_deferred);
+  }
+  return kernels_->find_closest_hit(start, dir, triangle_packets_.data(), first, end, io_dist);
+}
+
+CPURaytracer::triangle_setup CPURaytracer::ComputeTriangleSetup(const RZVector3& v0, const RZVector3& v1, const RZVector3& v2)
+{
+  triangle_setup setup;
+  setup.e01 = v1 - v0;
+  setup.e12 = v2 - v1;
+  setup.e20 = v0 - v2;
+  setup.normal = RZVector3::Cross(setup.e01, -setup.e20);
+  setup.inv_2x_area = 1.f / setup.normal.Length();
+  setup.normal *= setup.inv_2x_area;  // normalize
+  return setup;
+}
 
-  RECT client_rect{};
-  GetClientRect(window_, &client_rect);
+CPURaytracer::triangle_setup CPURaytracer::GetTriangleSetup(uint32_t triangle) const
+{
+  if (!compact_ && (triangle & LodTriangleFlag) == 0)
+  {
+    return triangle_setups_[triangle];
+  }
 
-  HDC hdc = GetDC(window_);
+  const CPURaytracer::triangle& t = GetTriangle(triangle);
+  return ComputeTriangleSetup(positions_[t.i0], positions_[t.i1], positions_[t.i2]);
+}
 
-  int client_width = client_rect.right - client_rect.left;
-  int client_height = client_rect.bottom - client_rect.top;
+RZVector3 CPURaytracer::GetTriangleNormal(uint32_t triangle) const
+{
+  if ((triangle & LodTriangleFlag) != 0)
+  {
+    return GetTriangleSetup(triangle).normal;
+  }
 
-  if (client_width != width_ || client_height != height_)
+  if (!half_normals_)
   {
-    StretchBlt(hdc, 0, 0, client_width, client_height, framebuffer_hdc_, 0, 0, width_, height_, SRCCOPY);
+    return compact_ ? GetTriangleSetup(triangle).normal : triangle_setups_[triangle].normal;
   }
-  else
+
+  // Renormalized, as the rounding leaves it slightly off
+  const uint16_t* n = &triangle_normals_[triangle * 3];
+  RZVector3 normal{ HalfToFloat(n[0]), HalfToFloat(n[1]), HalfToFloat(n[2]) };
+  float length = normal.Length();
+  return length > 0.f ? normal * (1.f / length) : normal;
+}
+
+size_t CPURaytracer::GetGeometryBytes() const
+{
+  size_t bytes = positions_.capacity() * sizeof(RZVector3) +
+    triangles_.capacity() * sizeof(triangle) +
+    triangle_setups_.capacity() * sizeof(triangle_setup) +
+    triangle_normals_.capacity() * sizeof(uint16_t) +
+    triangle_packets_.capacity() * sizeof(TrianglePacket) +
+    clusters_.capacity() * sizeof(cluster) +
+    cluster_triangles_.capacity() * sizeof(uint8_t) +
+    cluster_quantized_.capacity() * sizeof(uint16_t) +
+    cluster_floats_.capacity() * sizeof(RZVector3) +
+    tree_.GetMemorySize() +
+    lod_mesh_tree_.GetMemorySize() +
+    lod_triangles_.capacity() * (sizeof(triangle) + 2 * sizeof(uint32_t)) +
+    lod_packets_.capacity() * sizeof(TrianglePacket) +
+    tree_lods_.capacity() * sizeof(uint32_t);
+  for (const std::unique_ptr<triangle_tree>& tree : lod_trees_)
   {
-    BitBlt(hdc, 0, 0, width_, height_, framebuffer_hdc_, 0, 0, SRCCOPY);
+    bytes += tree->GetMemorySize();
   }
+  return bytes;
+}
+
+uint32_t CPURaytracer::GetTriangleMesh(uint32_t triangle) const
+{
+  triangle = GetSourceTriangle(triangle);
+
+  // Meshes are sorted by first triangle, find the last one starting at or before this triangle
+  auto it = std::upper_bound(meshes_.begin(), meshes_.end(), triangle,
+    [](uint32_t t, const mesh& m) { return t < m.first_triangle; });
+  assert(it != meshes_.begin());
+  return (uint32_t)(it - meshes_.begin() - 1);
+}
+
+const RZMaterial& CPURaytracer::GetTriangleMaterial(uint32_t triangle) const
+{
+  return materials_[meshes_[GetTriangleMesh(triangle)].material];
+}
+
+void CPURaytracer::Resolve(const RZRenderTarget& target, int width, int height)
+{
+  bool packed = (target.Format == RZPixelFormat_BGRA8 || target.Format == RZPixelFormat_RGBA8);
+  thread_pool_.ParallelFor((height + ResolveRows - 1) / ResolveRows, [&](int index, int)
+  {
+    uint32_t pixel_size = GetPixelSize(target.Format);
+    int y_end = std::min(height, (index + 1) * ResolveRows);
+    for (int y = index * ResolveRows; y < y_end; ++y)
+    {
+      if (packed)
+      {
+        ResolvePackedRow((uint8_t*)target.Pixels + (size_t)y * target.RowPitch, target.Format, y, width, height);
+        continue;
+      }
 
-  ReleaseDC(window_, hdc);
+      // Scaling up takes the nearest rendered pixel
+      int src_y = y * height_ / height;
+      const tile* tile_row = &tiles_[(src_y / TileSize) * tiles_x_];
+      uint8_t* row = (uint8_t*)target.Pixels + (size_t)y * target.RowPitch;
+
+      for (int x = 0; x < width; ++x)
+      {
+        int src_x = x * width_ / width;
+        int src = src_y * width_ + src_x;
+        uint8_t* pixel = row + x * pixel_size;
+
+        if (target.Format == RZPixelFormat_Depth32F)
+        {
+          *(float*)pixel = primary_depths_[src];
+        }
+        else if (target.Format == RZPixelFormat_PrimitiveID)
+        {
+          *(uint32_t*)pixel = primary_triangles_[src];
+        }
+        else
+        {
+          uint32_t sample_count = tile_row[src_x / TileSize].sample_count;
+          float inv_count = sample_count > 0 ? 1.f / sample_count : 0.f;
+          StoreColor(target.Format, pixel, accum_[src] * inv_count);
+        }
+      }
+    }
+
+    // The packed rows were written with streaming stores, which need to be ordered
+    // before whoever reads the target next
+    if (packed)
+    {
+      _mm_sfence();
+    }
+  });
 }
 
 void CPURaytracer::RebuildTree()
 {
-  std::vector<RZVector3> centroids(triangles_.size());
-  std::vector<RZVector3> mins(triangles_.size());
-  std::vector<RZVector3> maxes(triangles_.size());
+  int count = (int)triangles_.size();
+  tree_.RebuildFromBounds(count, [&](RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids)
+  {
+    kernels_->triangle_bounds(positions_.data(), (const uint32_t*)triangles_.data(), sizeof(triangle), count,
+      out_mins, out_maxes, out_centroids);
+  }, &scratch_);
+  tree_invalidated_ = false;
 
-  RZVector3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
-  RZVector3 max = -min;
+  scene_min_ = tree_.GetMin();
+  scene_max_ = tree_.GetMax();
 
-  for (uint32_t i = 0; i < triangles_.size(); ++i)
+  if (compact_)
   {
-    triangle& t = triangles_[i];
-    RZVector3& v0 = positions_[t.i0];
-    RZVector3& v1 = positions_[t.i1];
-    RZVector3& v2 = positions_[t.i2];
-    mins[i] = RZVector3::Min(RZVector3::Min(v0, v1), v2);
-    maxes[i] = RZVector3::Max(RZVector3::Max(v0, v1), v2);
-    centroids[i] = (v0 + v1 + v2) / 3.f;
+    BuildClusters();
+    if (out_of_core_)
+    {
+      SetClusterPages();
+    }
+  }
+  else
+  {
+    // Repack in tree order, so the runs of a leaf share packets. Spare lanes of the
+    // last packet are zeroed, which no ray hits
+    const uint32_t* order = tree_.GetPrimitiveOrder();
+    triangle_packets_.assign((count + 3) / 4, TrianglePacket{});
+    for (int i = 0; i < count; ++i)
+    {
+      const triangle& t = triangles_[order[i]];
+      const triangle_setup& setup = triangle_setups_[order[i]];
+      TrianglePacket& packet = triangle_packets_[i / 4];
+      SetLane(packet.v0, i % 4, positions_[t.i0]);
+      SetLane(packet.v1, i % 4, positions_[t.i1]);
+      SetLane(packet.v2, i % 4, positions_[t.i2]);
+      SetLane(packet.e01, i % 4, setup.e01);
+      SetLane(packet.e12, i % 4, setup.e12);
+      SetLane(packet.e20, i % 4, setup.e20);
+      SetLane(packet.normal, i % 4, setup.normal);
+    }
+  }
 
-    min = RZVector3::Min(min, mins[i]);
-    max = RZVector3::Max(max, maxes[i]);
+  if (!lod_meshes_.empty())
+  {
+    RebuildLodTrees();
   }
+  geometry_bytes_ = GetGeometryBytes();
 
-  tree_.Rebuild(centroids.data(), mins.data(), maxes.data(), 0, (int)triangles_.size(), min, max);
-  tree_invalidated_ = false;
+  // Without an explicit distance, ambient occlusion looks at a tenth of the scene
+  ao_distance_ = ao_distance_param_ > 0.f ? ao_distance_param_ : (scene_max_ - scene_min_).Length() * DefaultAODistanceScale;
+}
+
+void CPURaytracer::ApplyGeometryChanges()
+{
+  RebuildTree();
+  ResetAccumulation();
+  visible_count_valid_ = false;
+
+  // New geometry may hide cached hits
+  std::fill(cache_triangles_.begin(), cache_triangles_.end(), (uint32_t)NoHit);
+  std::fill(reproject_keys_.begin(), reproject_keys_.end(), UINT64_MAX);
 }
 
 bool CPURaytracer::TestRayTriangle(
   const RZVector3& start, const RZVector3& dir,
-  const RZVector3* positions, const triangle& triangle,
+  const RZVector3* positions, const triangle& triangle, const triangle_setup& setup,
   float* out_dist, RZVector3* out_normal)
 {
-  float cosA = RZVector3::Dot(-triangle.normal, dir);
+  float cosA = RZVector3::Dot(-setup.normal, dir);
   if (cosA <= 0)
     return false;
 
@@ -223,24 +1454,27 @@ bool CPURaytracer::TestRayTriangle(
   RZVector3 v1 = positions[triangle.i1];
   RZVector3 v2 = positions[triangle.i2];
 
-  float d = RZVector3::Dot(start - v0, triangle.normal);
+  float d = RZVector3::Dot(start - v0, setup.normal);
+  if (d < 0)
+    return false; // behind the ray start
+
   float h = d / cosA;
   RZVector3 p = start + dir * h;
 
   // is p inside triangle?
-  float r = RZVector3::Dot(RZVector3::Cross(triangle.e01, p - v0), triangle.normal);
+  float r = RZVector3::Dot(RZVector3::Cross(setup.e01, p - v0), setup.normal);
   if (r < 0)
     return false;
 
-  float s = RZVector3::Dot(RZVector3::Cross(triangle.e12, p - v1), triangle.normal);
+  float s = RZVector3::Dot(RZVector3::Cross(setup.e12, p - v1), setup.normal);
   if (s < 0)
     return false;
 
-  float t = RZVector3::Dot(RZVector3::Cross(triangle.e20, p - v2), triangle.normal);
+  float t = RZVector3::Dot(RZVector3::Cross(setup.e20, p - v2), setup.normal);
   if (t < 0)
     return false;
 
   *out_dist = h;
-  *out_normal = triangle.normal;
+  *out_normal = setup.normal;
   return true;
-}
\ No newline at end of file
+}
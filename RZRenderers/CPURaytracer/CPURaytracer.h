@@ -4,7 +4,18 @@
 //=============================================================================
 #pragma once
 
+#include "CPURasterizer/Rasterizer.h"
+#include "CPURaytracer/Kernels.h"
+#include "Util/Arena.h"
 #include "Util/AabbTree.h"
+#include "Util/Framebuffer.h"
+#include "Util/FramePipeline.h"
+#include "Util/MappedMemory.h"
+#include "Util/MeshOverlaps.h"
+#include "Util/NearestPoints.h"
+#include "Util/PageCache.h"
+#include "Util/Random.h"
+#include "Util/ThreadPool.h"
 
 class CPURaytracer : public BaseObject<IRZRenderer>
 {
@@ -13,19 +24,162 @@ public:
 
   virtual uint32_t AddVertices(uint32_t num_vertices, const RZVector3* positions) override;
 
+  virtual void SetMaterial(const RZMaterial& material) override;
+
   virtual void AddMesh(uint32_t num_indices, const uint32_t* indices) override;
 
+  virtual void SetRegionsOfInterest(uint32_t num_regions, const RZRegionOfInterest* regions) override;
+
   virtual void RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) override;
 
+  virtual void RenderScene(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+    const RZRenderTarget& target) override;
+
+  virtual uint64_t BeginRender(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) override;
+
+  virtual void WaitFrame(uint64_t frame) override;
+
+  virtual bool TryGetFrame(uint64_t frame) override;
+
+  virtual void GetStats(RZRenderStats* stats) override;
+
+  virtual void GetAovs(const RZAovTarget& target) override;
+
+  virtual uint32_t GetVisibleMeshes(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+    uint32_t max_meshes, uint32_t* out_meshes) override;
+
+  virtual bool FindNearestSurfacePoint(const RZVector3& point, float max_distance, RZSurfacePoint* out_result) override;
+
+  virtual void FindNearestSurfacePoints(uint32_t num_points, const RZVector3* points, float max_distance,
+    RZSurfacePoint* out_results) override;
+
+  virtual uint32_t FindMeshOverlaps(uint32_t mesh_a, uint32_t mesh_b, bool first_only,
+    uint32_t max_pairs, RZTrianglePair* out_pairs) override;
+
 private:
   struct triangle
   {
     uint32_t i0, i1, i2;
+  };
+
+  // Edges & unit normal, as the ray tests use them. Kept for every triangle, unless
+  // the geometry is compact and they're computed as needed
+  struct triangle_setup
+  {
     RZVector3 e01, e12, e20;
     RZVector3 normal;
     float inv_2x_area;
   };
 
+  // Compact geometry: ClusterSize triangles, consecutive in tree order, and the
+  // vertices they use (each stored once)
+  struct cluster
+  {
+    size_t first_vertex;      // In cluster_quantized_ (3 coordinates each), or cluster_floats_
+    RZVector3 origin;         // Position of quantized coordinates 0, 0, 0
+    uint8_t num_vertices;
+    bool quantized;           // Else the vertices spread too far for 16 bits, and are floats
+  };
+
+  typedef AabbTree<triangle, IndexedTriangleBounds<triangle>> triangle_tree;
+
+  struct mesh
+  {
+    uint32_t first_triangle;
+    uint32_t num_triangles;
+    uint32_t material;
+    uint32_t lod;             // In lod_meshes_, NoLod if the mesh has no simplified levels
+  };
+
+  // Level of detail: one of a mesh's simplified versions, each coarser than the last
+  struct lod_level
+  {
+    uint32_t first_triangle;  // In lod_triangles_
+    uint32_t num_triangles;
+    uint32_t first_packet;    // In lod_packets_
+    float error;              // Farthest any vertex moved from the full mesh
+  };
+
+  struct lod_mesh
+  {
+    uint32_t first_level;     // In lod_levels_. Level 0, the mesh itself, isn't stored
+    uint32_t num_levels;
+    RZVector3 min, max;
+  };
+
+  struct lod_mesh_bounds
+  {
+    void operator()(const lod_mesh& m, RZVector3* out_min, RZVector3* out_max, RZVector3* out_centroid) const
+    {
+      *out_min = m.min;
+      *out_max = m.max;
+      *out_centroid = (m.min + m.max) * 0.5f;
+    }
+  };
+
+  // Few primitives, each with a tree of its own below, so small leaves
+  typedef AabbTree<lod_mesh, lod_mesh_bounds, 4> lod_mesh_tree;
+
+  struct hit
+  {
+    float dist;
+    RZVector3 normal;
+    uint32_t triangle;
+  };
+
+  // Direct: a tile's primary hits waiting to be shaded together, as structure of
+  // arrays. Albedo goes in r, g, b and the shaded color comes out there
+  struct shade_batch
+  {
+    int count;
+    std::vector<int> block_x;
+    std::vector<int> block_y;
+    std::vector<uint32_t> hit_mask;  // All ones for hits, 0 for misses
+    std::vector<float> nx, ny, nz;
+    std::vector<float> r, g, b;
+  };
+
+  // Per render thread state. Only touched by the owning thread during a pass
+  struct thread_context
+  {
+    shade_batch shading;
+    Random random;
+    uint64_t primary_rays;
+    uint64_t secondary_rays;
+    int64_t primary_ticks;
+    int64_t secondary_ticks;
+    uint64_t reprojected_hits;
+    uint64_t retraced_hits;
+    uint64_t deferred_rays;
+  };
+
+  // Wavefront: rays traveling together through a stage, as structure of arrays
+  struct ray_queue
+  {
+    std::vector<float> ox, oy, oz;    // Origin
+    std::vector<float> dx, dy, dz;    // Direction
+    std::vector<float> wr, wg, wb;    // Path throughput, or light contribution for shadow rays
+    std::vector<uint32_t> pixel;
+    std::vector<float> dist;          // Extend output
+    std::vector<uint32_t> triangle;   // Extend output, NoHit if nothing was hit
+
+    int Size() const { return (int)pixel.size(); }
+    void Resize(int size);
+    void Set(int i, const RZVector3& origin, const RZVector3& dir, const RZVector3& weight, uint32_t pixel);
+    void Copy(int to, const ray_queue& src, int from);
+    RZVector3 Origin(int i) const { return RZVector3{ ox[i], oy[i], oz[i] }; }
+    RZVector3 Dir(int i) const { return RZVector3{ dx[i], dy[i], dz[i] }; }
+    RZVector3 Weight(int i) const { return RZVector3{ wr[i], wg[i], wb[i] }; }
+  };
+
+  struct tile
+  {
+    int x0, y0, x1, y1;     // Pixel bounds, [x0, x1) x [y0, y1)
+    uint32_t sample_count;  // Samples accumulated in every pixel of the tile
+    bool converged;         // Adaptive: no more samples needed
+    int rate;               // Size of the square blocks of pixels sharing each sample
+  };
+
 private:
   CPURaytracer() {}
   virtual ~CPURaytracer();
@@ -34,26 +188,427 @@ private:
 
   void RebuildTree();
 
+  // Rebuild the tree after geometry changes, and drop everything that depended on it
+  void ApplyGeometryChanges();
+
+  // Render stage: trace the frame and resolve it into target, or its framebuffer if null
+  void RenderFrame(FramePipeline::frame& frame, const RZRenderTarget* target);
+
+  // Present stage: show a rendered frame
+  void PresentFrame(const FramePipeline::frame& frame);
+
+  // Render at scale times the output resolution from now on. Drops all samples
+  bool SetResolutionScale(float scale);
+
+  // Pick the scale for the next moving frame from what this one cost
+  void UpdateResolutionScale(float frame_cost);
+
+  // Returns true if the camera differs from the one the accumulated samples were taken with
+  bool CameraChanged(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation) const;
+
+  // Number of samples after which a tile stops being refined
+  uint32_t GetTileSampleLimit() const;
+
+  // Drop all accumulated samples
+  void ResetAccumulation();
+
+  // Add one jittered sample to every pixel of each tile that still needs refinement.
+  // Returns the number of rays traced
+  uint64_t RenderPass(const RZVector3& viewer_position);
+
+  // Subpixel position of the tile's next sample
+  static void GetSampleJitter(const tile& tile, float* out_x, float* out_y);
+
+  // Pick each tile's rate from its distance to the regions of interest. Tiles whose
+  // rate changes start over
+  void UpdateTileRates();
+
+  // Position of the tile's next sample within the block starting at (block_x, block_y),
+  // as a pixel and subpixel offset
+  static void GetBlockSample(const tile& tile, int block_x, int block_y,
+    int* out_x, int* out_y, float* out_jitter_x, float* out_jitter_y);
+
+  // Number of samples a pass takes in the tile
+  static uint64_t GetTileBlockCount(const tile& tile);
+
+  // Add one jittered sample to every pixel (or block, at reduced rates) in the tile
+  void RenderTile(const RZVector3& viewer_position, int tile_index, thread_context& context);
+
+  // Add a sample's color to every pixel of its block
+  void AccumulateBlock(const tile& tile, int block_x, int block_y, const RZVector3& color);
+
+
+  // Adaptive: decide whether the tile needs more samples, based on contrast or variance
+  bool IsTileConverged(const tile& tile) const;
+
+  // Mean luminance accumulated so far at the pixel
+  float PixelLuminance(int x, int y) const;
+
+  // Find the surface seen by the camera ray through (x + jitter_x, y + jitter_y).
+  // Hybrid mode reads it from the visibility buffer instead of tracing, where possible
+  bool FindPrimaryHit(int x, int y, float jitter_x, float jitter_y,
+    const RZVector3& start, const RZVector3& dir, thread_context& context, hit* out_hit);
+
+  // Shading pass (ShadingPass.cpp). Queue a primary hit (h is nullptr if the camera
+  // ray missed) for shading with the direct light
+  void QueueDirectShading(int block_x, int block_y, const hit* h, shade_batch* batch) const;
+
+  // Shade the queued hits with the shading kernel and accumulate them into the tile
+  void ShadeDirectBatch(const tile& tile, shade_batch* batch);
+
+  // Tone map and pack one row of width pixels into an 8 bit color format
+  void ResolvePackedRow(uint8_t* row, RZPixelFormat format, int y, int width, int height) const;
+
+  // Continue a path from the primary hit (nullptr if the camera ray missed),
+  // returning the incoming radiance along the camera ray
+  RZVector3 TracePath(const RZVector3& start, const RZVector3& dir, const hit* primary, thread_context& context) const;
+
+  // Color of the primary hit shaded by its ambient occlusion
+  RZVector3 ShadeAmbientOcclusion(const RZVector3& start, const RZVector3& dir, const hit& h, thread_context& context) const;
+
+  // Find the closest triangle hit by the ray, if any. Out of core, with out_deferred
+  // given, geometry pages that aren't in memory are requested instead of waited for,
+  // and out_deferred is set if any were, as the ray has to be traced again
+  bool Intersect(const RZVector3& start, const RZVector3& dir, hit* out_hit, bool* out_deferred = nullptr) const;
+
+  // Returns true if anything is hit by the ray closer than max_dist. Pages are
+  // deferred as above, unless a hit is found in the ones in memory
+  bool Occluded(const RZVector3& start, const RZVector3& dir, float max_dist, bool* out_deferred = nullptr) const;
+
+  // Intersect for up to RayPacketQuery::MaxRays rays, which go down the tree together.
+  // Bit i of the result is set if ray i hit, with out_hits[i] filled in. Each ray gets
+  // what Intersect would give it
+  int IntersectPacket(const RZVector3* starts, const RZVector3* dirs, int count, hit* out_hits,
+    bool* out_deferred = nullptr) const;
+
+  // Occluded with no max distance, for up to RayPacketQuery::MaxRays rays. Bit i of
+  // the result is set if ray i is
+  int OccludedPacket(const RZVector3* starts, const RZVector3* dirs, int count, bool* out_deferred = nullptr) const;
+
+  // Ray vs the triangles at positions [first, end) of the tree order, with the
+  // kernel's results. io_deferred as out_deferred above, but only ever set
+  int FindClosestHit(const RZVector3& start, const RZVector3& dir, int first, int end, float* io_dist,
+    bool* io_deferred) const;
+
+  static triangle_setup ComputeTriangleSetup(const RZVector3& v0, const RZVector3& v1, const RZVector3& v2);
+
+  // Stored, or computed from the vertices if the geometry is compact (or the
+  // triangle is from a simplified level)
+  triangle_setup GetTriangleSetup(uint32_t triangle) const;
+
+  // Same, or decoded from the half normals
+  RZVector3 GetTriangleNormal(uint32_t triangle) const;
+
+  // Vertices, triangles & acceleration structures
+  size_t GetGeometryBytes() const;
+
+  // Index of the mesh the triangle was added with, or simplified from
+  uint32_t GetTriangleMesh(uint32_t triangle) const;
+
+  const RZMaterial& GetTriangleMaterial(uint32_t triangle) const;
+
+  // Wavefront path tracing (Wavefront.cpp). Instead of following one path at a time,
+  // all paths of a pass move through each stage together, and are regrouped by
+  // direction and origin between bounces so each stage works on coherent batches.
+  void RenderPassWavefront(const RZVector3& viewer_position, const int* active_tiles, int num_active);
+
+  // Create camera rays for every pixel of the active tiles
+  void WavefrontGenerate(const RZVector3& viewer_position, const int* active_tiles, int num_active);
+
+  // Reorder the queue by direction octant, then origin along a Morton curve
+  void WavefrontSort(ray_queue& queue);
+
+  // Find the closest hit of every ray in the queue
+  void WavefrontExtend(ray_queue& queue, bool primary);
+
+  // Store ray i's hit in the queue, or NoHit if h is null
+  static void SetQueueHit(ray_queue& queue, int i, const hit* h);
+
+  // Add emission on misses, queue shadow rays and continuation rays
+  void WavefrontShade(uint32_t depth);
+
+  // Trace shadow rays, adding their contribution when unoccluded
+  void WavefrontConnect();
+
+  // Drop rays whose alive flag is cleared, keeping the order
+  static void CompactQueue(ray_queue& queue, const std::vector<uint8_t>& alive);
+
+  // Out of core: trace the rays among count flagged in deferred_rays_ once the pages
+  // they asked for are in, until none are deferred again. trace(i, &deferred) traces ray i
+  template <typename Trace>
+  void RetryDeferredRays(int count, Trace&& trace);
+
+  // Temporal reprojection (Reprojection.cpp). Scatter the pixel center hits cached
+  // from the last reset into the new view, leaving a candidate triangle per pixel
+  void Reproject(const RZVector3& viewer_position);
+
+  // True if a neighboring candidate is missing or much nearer
+  bool NearDepthEdge(int x, int y) const;
+
+  // Pixel center hit from the reprojected candidate if it still holds up, else
+  // traced. Either way, cached for the next reprojection
+  bool FindReprojectedHit(int x, int y, const RZVector3& start, const RZVector3& dir,
+    thread_context& context, hit* out_hit);
+
+  // View culling (Culling.cpp). Frustum of the camera, which looks down +z like the
+  // camera rays
+  FrustumQuery GetViewFrustum(const RZVector3& viewer_position) const;
+
+  // Triangles in tree leaves (or larger subtrees) intersecting the view frustum
+  uint32_t CountVisibleTriangles(const RZVector3& viewer_position) const;
+
+  // Mesh overlaps (MeshOverlaps.cpp). Tree over just the mesh's triangles, built the
+  // first time it's needed. Meshes never change once added, so it's kept from then on
+  const triangle_tree& GetMeshTree(uint32_t mesh);
+
+  // Compact geometry (CompactGeometry.cpp). Group the triangles into clusters in
+  // tree order, with their vertices quantized
+  void BuildClusters();
+
+  // Packets [first / 4, (end + 3) / 4) of the cluster, with the triangles outside
+  // [first, end) zeroed
+  void DecodeCluster(int index, int first, int end, TrianglePacket* out_packets) const;
+
+  // FindClosestHit, decoding the clusters the run covers
+  int FindClosestCompactHit(const RZVector3& start, const RZVector3& dir, int first, int end, float* io_dist,
+    bool* io_deferred) const;
+
+  // Out of core: hand the page cache the parts of the cluster arrays each page covers
+  void SetClusterPages();
+
+  // Level of detail (LevelOfDetail.cpp). Simplify the mesh into a chain of coarser
+  // levels, if it's large enough to be worth it
+  void BuildMeshLods(uint32_t mesh);
+
+  // Trees & packets over each simplified level's triangles, and the simplified mesh
+  // (if any) of each position in the main tree
+  void RebuildLodTrees();
+
+  // Pick the level each mesh is traced at this pass, from the camera's pixel
+  // footprint at the mesh
+  void SelectLods(const RZVector3& viewer_position);
+
+  // FindClosestHit, skipping the triangles of meshes traced at a simplified level
+  int FindClosestSelectedHit(const RZVector3& start, const RZVector3& dir, int first, int end, float* io_dist,
+    bool* io_deferred) const;
+
+  // Ray vs the simplified levels traced this pass, closer than io_dist. Returns the
+  // triangle hit (LodTriangleFlag set), or NoHit. With any_hit, the first one found.
+  // Meshes are tested one by one, so this is for scenes of at most a few hundred
+  uint32_t FindClosestLodHit(const RZVector3& start, const RZVector3& dir, float* io_dist, bool any_hit) const;
+
+  // True if the triangle is from the level of its mesh traced this pass, ie. for cached hits
+  bool IsTriangleSelected(uint32_t triangle) const;
+
+  // Vertices of any triangle, including those of simplified levels
+  const triangle& GetTriangle(uint32_t triangle) const;
+
+  // The full detail triangle a simplified one was made from, or the triangle itself
+  uint32_t GetSourceTriangle(uint32_t triangle) const;
+
+  // Auxiliary outputs (Aovs.cpp). Allocate the planes for aovs, plus depth & primitive ID
+  bool InitializeAovs(uint32_t aovs);
+
+  // Keep the AOVs of a tile's first (pixel center) sample for its block. h is nullptr
+  // if the camera ray missed
+  void RecordPrimaryHit(const tile& tile, int block_x, int block_y,
+    const RZVector3& start, const RZVector3& dir, const hit* h);
+
+  // Average the accumulated samples into width x height pixels of target, scaling
+  // from the render size if different
+  void Resolve(const RZRenderTarget& target, int width, int height);
+
   static bool TestRayTriangle(
     const RZVector3& start, const RZVector3& dir,
-    const RZVector3* positions, const triangle& triangle,
+    const RZVector3* positions, const triangle& triangle, const triangle_setup& setup,
     float* out_dist, RZVector3* out_normal);
 
 private:
-  HWND window_ = nullptr;
-  HDC framebuffer_hdc_ = nullptr;
-  uint32_t* framebuffer_ = nullptr;
+  bool windowed_ = false;
+  Framebuffer framebuffer_;
+  std::vector<uint8_t> buffer_current_;  // Holds the latest resolve, so a frame without new samples can skip it
   int width_ = 0;
   int height_ = 0;
   float half_width_ = 0.f;
   float half_height_ = 0.f;
   float dist_to_plane_ = 0.f;
   bool tree_invalidated_ = true;
+  double inv_timer_freq_ = 0.;
+
+  // Dynamic resolution. width_ & height_ above are the current render size, the
+  // framebuffer & per pixel buffers are allocated at the output size
+  static const float DefaultMinResolutionScale;
+
+  int output_width_ = 0;
+  int output_height_ = 0;
+  float tan_half_fov_ = 0.f;
+  float target_frame_time_ = 0.f;
+  float min_resolution_scale_ = 0.f;
+  float resolution_scale_ = 1.f;
+  float motion_scale_ = 1.f;          // Scale used while the camera moves
+
+  // Regions of interest. Tiles away from them take one sample per 2x2 or 4x4 pixels
+  static const int MaxTileRate = 4;
+
+  std::vector<RZRegionOfInterest> regions_;
+
+  // Progressive & adaptive accumulation
+  static const int TileSize = 16;
+  static const uint32_t MinAdaptiveSamples = 4;
+  static const uint32_t DefaultAdaptiveSamples = 16;
+
+  bool progressive_ = false;
+  bool adaptive_ = false;
+  uint32_t max_samples_per_pixel_ = 0;
+  uint32_t max_samples_per_frame_ = 1;
+  float frame_time_budget_ = 0.f;
+  float adaptive_threshold_ = 0.05f;
+  int tiles_x_ = 0;
+  RZVector3 last_position_{};
+  RZQuaternion last_orientation_{};
+  RZVector3 counted_position_{};      // Camera VisibleTriangles was counted for
+  bool visible_count_valid_ = false;  // Until the camera moves or the geometry changes
+  std::vector<tile> tiles_;
+  std::vector<RZVector3> accum_;
+  std::vector<float> accum_lum_sq_;  // Sum of squared sample luminance, for variance
+
+  RZRenderStats stats_{};             // Written by the render stage
+  std::mutex stats_lock_;
+  RZRenderStats published_stats_{};   // Copy of stats_ from the last finished frame, for GetStats
+
+  // 8 bit color output
+  RZToneMap tone_map_ = RZToneMap_Linear;
+  bool dither_ = false;
+
+  // Integrator
+  static const uint32_t DefaultMaxPathDepth = 8;
+  static const uint32_t RouletteStartDepth = 3;
+
+  static const uint32_t DefaultAORayCount = 8;
+  static const float DefaultAODistanceScale;
+
+  RZIntegrator integrator_ = RZIntegrator_Direct;
+  uint32_t max_path_depth_ = DefaultMaxPathDepth;
+  uint32_t ao_ray_count_ = DefaultAORayCount;
+  float ao_distance_param_ = 0.f;
+  float ao_distance_ = 0.f;
+
+  // Wavefront
+  static const int WavefrontChunkSize = 256;
+  static const uint32_t NoHit = 0xFFFFFFFF;
+
+  bool wavefront_ = false;
+  uint64_t wavefront_pass_ = 0;
+  ray_queue path_queue_;
+  ray_queue next_queue_;
+  ray_queue shadow_queue_;
+  ray_queue sort_queue_;
+  std::vector<uint8_t> path_alive_;
+  std::vector<uint8_t> shadow_alive_;
+  std::vector<uint64_t> sort_keys_;
+  std::vector<uint8_t> deferred_rays_;    // Out of core: rays of the stage waiting for pages
+  std::vector<RZVector3> path_radiance_;
+  RZVector3 scene_min_{};
+  RZVector3 scene_max_{};
+
+  // AOVs, one plane per component. Depth & primitive ID are always kept, for render targets
+  uint32_t aov_mask_ = 0;
+  std::vector<float> primary_depths_;
+  std::vector<uint32_t> primary_triangles_;
+  std::vector<uint32_t> primary_meshes_;
+  std::vector<float> primary_normals_[3];
+  std::vector<float> primary_barycentrics_[2];
+  std::vector<float> primary_positions_[3];
+
+  // Hybrid: camera rays are replaced by a visibility buffer, rasterized once per camera
+  bool hybrid_ = false;
+  bool visibility_valid_ = false;
+  Rasterizer rasterizer_;
+
+  // Reprojection
+  bool reproject_ = false;
+  RZVector3 cache_position_{};
+  std::vector<uint32_t> cache_triangles_;   // NoHit where the camera ray missed
+  std::vector<float> cache_dists_;
+  std::vector<uint64_t> reproject_keys_;    // Depth bits << 32 | triangle, so the nearest is smallest
+
+  ThreadPool thread_pool_;
+  std::vector<thread_context> thread_contexts_;
+
+  // Render stage scratch (tree build inputs, per pass tile lists), released at the
+  // start of every frame
+  Arena scratch_;
+
+  // Out of core, these are file backed
+  uint32_t num_vertices_ = 0;         // Including vertices still queued behind frames in flight
+  mapped_vector<RZVector3> positions_;
+  mapped_vector<triangle> triangles_;
+  std::vector<triangle_setup> triangle_setups_;  // Empty if compact
+  std::vector<mesh> meshes_;
+  std::vector<RZMaterial> materials_;
+
+  // Intersection, tree build & shading kernels for the CPU's instruction set. Ray
+  // tests use the triangles repacked in tree order, four to a packet (unless compact)
+  const KernelTable* kernels_ = nullptr;
+  triangle_tree tree_;
+  std::vector<TrianglePacket> triangle_packets_;
+  std::vector<uint64_t> nearest_keys_;  // FindNearestSurfacePoints sort scratch
+  std::vector<std::unique_ptr<triangle_tree>> mesh_trees_;
+  size_t geometry_bytes_ = 0;
+
+  // Compact geometry. Rays are tested against the clusters, decoded into packets as
+  // the tree reaches them. Vertex positions are snapped to a lattice shared by all
+  // clusters, so a vertex decodes the same in every cluster using it
+  static const int ClusterSize = 32;
+  static const float ClusterLatticeSteps;
+
+  bool compact_ = false;
+  bool half_normals_ = false;
+  float lattice_step_ = 0.f;
+  std::vector<cluster> clusters_;
+  mapped_vector<uint8_t> cluster_triangles_;    // Vertices in their cluster, 3 per triangle in tree order
+  mapped_vector<uint16_t> cluster_quantized_;   // Lattice steps from the cluster's origin
+  mapped_vector<RZVector3> cluster_floats_;
+  mapped_vector<uint16_t> triangle_normals_;    // HalfNormals: 3 per triangle
+
+  // Out of core geometry. The tree & cluster headers stay in memory, while the rest
+  // is file backed. Rays go through the cluster data in pages of ClustersPerPage,
+  // whose residency the page cache keeps within budget. Other geometry (ie. vertices
+  // for shading) is only read per hit or by rebuilds, and is left to the OS
+  static const int ClustersPerPage = 256;
+
+  bool out_of_core_ = false;
+  mutable PageCache page_cache_;      // Tracing acquires pages
+  uint64_t pages_loaded_ = 0;         // By the frames before this one
+
+  // Level of detail. Simplified triangles are numbered from LodTriangleFlag, and each
+  // level has a tree of its own. Each pass traces every mesh at one of its levels,
+  // which all rays of the pass agree on (so shadow rays leave the surface they start
+  // on), with transitions blended over the passes accumulated
+  static const uint32_t LodTriangleFlag = 0x80000000;
+  static const uint32_t NoLod = 0xFFFFFFFF;
+  static const uint32_t MinLodTriangles = 1024;     // Smaller meshes aren't simplified
+  static const uint32_t MinLodLevelTriangles = 64;  // Nor made coarser than this
+  static const int MaxLodLevels = 8;
+  static const int LodLevelBits = 4;                // Of lod_tags_
+  static const uint32_t LodLevelMask = (1 << LodLevelBits) - 1;
 
-  std::vector<RZVector3> positions_;
-  std::vector<triangle> triangles_;
-  std::vector<uint32_t> scratch_hits_;
+  bool level_of_detail_ = false;
+  std::vector<lod_mesh> lod_meshes_;
+  std::vector<lod_level> lod_levels_;
+  std::vector<triangle> lod_triangles_;
+  std::vector<uint32_t> lod_sources_;       // Full detail triangle each was made from
+  std::vector<uint32_t> lod_tags_;          // Simplified mesh << LodLevelBits | level
+  std::vector<std::unique_ptr<triangle_tree>> lod_trees_;  // By level, as lod_levels_
+  lod_mesh_tree lod_mesh_tree_;             // Over the boxes of lod_meshes_
+  std::vector<TrianglePacket> lod_packets_;
+  std::vector<uint32_t> tree_lods_;         // Main tree order: simplified mesh + 1, or 0
+  std::vector<uint8_t> lod_selection_;      // Level traced this pass, 0 for full detail
+  bool any_simplified_ = false;             // Any mesh's selection isn't full detail
+  uint32_t lod_passes_ = 0;                 // Since accumulation was last reset
 
-  AabbTree tree_;
+  // Scene changes go through the pipeline, so it's last: destroyed (and its threads
+  // stopped) first
+  FramePipeline pipeline_;
 };
 
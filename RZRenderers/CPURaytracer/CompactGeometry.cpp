@@ -0,0 +1,272 @@
+//=============================================================================
+// CompactGeometry.cpp - Triangles in quantized clusters, for scenes too large to
+//                       keep every triangle's edges & normal
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+
+// Lattice steps across a typical (median) cluster. Clusters up to 16x as large
+// still fit in 16 bits, larger ones keep float vertices
+const float CPURaytracer::ClusterLatticeSteps = 4096.f;
+
+// A power of 2 greater than value (which is > 0), and at most twice it
+static float PowerOf2Above(float value)
+{
+  int exponent;
+  frexpf(value, &exponent);
+  return ldexpf(1.f, exponent);
+}
+
+void CPURaytracer::BuildClusters()
+{
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  size_t count = triangles_.size();
+  size_t num_clusters = (count + ClusterSize - 1) / ClusterSize;
+  clusters_.resize(num_clusters);
+  cluster_triangles_.resize(count * 3);
+  cluster_quantized_.clear();
+  cluster_floats_.clear();
+  if (count == 0)
+  {
+    return;
+  }
+
+  // Vertices each cluster uses, once each in order of first use. Clusters are small
+  // enough to just search
+  uint32_t* cluster_vertices = scratch_.Allocate<uint32_t>(num_clusters * ClusterSize * 3);
+  int* num_cluster_vertices = scratch_.Allocate<int>(num_clusters);
+  float* extents = scratch_.Allocate<float>(num_clusters);
+  for (size_t c = 0; c < num_clusters; ++c)
+  {
+    size_t base = c * ClusterSize;
+    int size = (int)std::min(count - base, (size_t)ClusterSize);
+    uint32_t* vertices = cluster_vertices + base * 3;
+    int num_vertices = 0;
+    RZVector3 lo{ FLT_MAX, FLT_MAX, FLT_MAX };
+    RZVector3 hi{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    for (int i = 0; i < size * 3; ++i)
+    {
+      const triangle& t = triangles_[order[base + i / 3]];
+      uint32_t vertex = (i % 3 == 0) ? t.i0 : (i % 3 == 1) ? t.i1 : t.i2;
+      int local = (int)(std::find(vertices, vertices + num_vertices, vertex) - vertices);
+      if (local == num_vertices)
+      {
+        vertices[num_vertices++] = vertex;
+        lo = RZVector3::Min(lo, positions_[vertex]);
+        hi = RZVector3::Max(hi, positions_[vertex]);
+      }
+      cluster_triangles_[base * 3 + i] = (uint8_t)local;
+    }
+
+    num_cluster_vertices[c] = num_vertices;
+    extents[c] = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+  }
+
+  // The lattice step is a power of 2, fine enough for a typical cluster. It's also
+  // coarse enough that the scene's lattice points are all floats, so cluster origins
+  // and the offsets from them are exact, and so is decoding
+  std::nth_element(extents, extents + num_clusters / 2, extents + num_clusters);
+  float median_extent = extents[num_clusters / 2];
+  float max_coordinate = std::max(
+    std::max(std::max(fabsf(scene_min_.x), fabsf(scene_max_.x)), std::max(fabsf(scene_min_.y), fabsf(scene_max_.y))),
+    std::max(fabsf(scene_min_.z), fabsf(scene_max_.z)));
+
+  lattice_step_ = 0.f;
+  if (median_extent > 0.f)
+  {
+    lattice_step_ = PowerOf2Above(median_extent / ClusterLatticeSteps);
+  }
+  if (max_coordinate > 0.f)
+  {
+    lattice_step_ = std::max(lattice_step_, PowerOf2Above(max_coordinate / 8388608.f));
+  }
+  if (lattice_step_ == 0.f)
+  {
+    lattice_step_ = 1.f;
+  }
+
+  // Nearly all clusters are quantized, so this is about what they'll need
+  size_t total_vertices = 0;
+  for (size_t c = 0; c < num_clusters; ++c)
+  {
+    total_vertices += num_cluster_vertices[c];
+  }
+  cluster_quantized_.reserve(total_vertices * 3);
+
+  for (size_t c = 0; c < num_clusters; ++c)
+  {
+    const uint32_t* vertices = cluster_vertices + c * ClusterSize * 3;
+    int num_vertices = num_cluster_vertices[c];
+
+    int64_t lattice[ClusterSize * 3][3];
+    int64_t lo[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+    int64_t hi[3] = { INT64_MIN, INT64_MIN, INT64_MIN };
+    for (int v = 0; v < num_vertices; ++v)
+    {
+      const RZVector3& p = positions_[vertices[v]];
+      float coordinates[3] = { p.x, p.y, p.z };
+      for (int k = 0; k < 3; ++k)
+      {
+        lattice[v][k] = (int64_t)floor((double)coordinates[k] / lattice_step_ + 0.5);
+        lo[k] = std::min(lo[k], lattice[v][k]);
+        hi[k] = std::max(hi[k], lattice[v][k]);
+      }
+    }
+
+    cluster& cl = clusters_[c];
+    cl.num_vertices = (uint8_t)num_vertices;
+    cl.quantized = (hi[0] - lo[0] <= UINT16_MAX && hi[1] - lo[1] <= UINT16_MAX && hi[2] - lo[2] <= UINT16_MAX);
+    if (cl.quantized)
+    {
+      cl.origin = RZVector3{ (float)(lo[0] * (double)lattice_step_),
+        (float)(lo[1] * (double)lattice_step_), (float)(lo[2] * (double)lattice_step_) };
+      cl.first_vertex = cluster_quantized_.size() / 3;
+      for (int v = 0; v < num_vertices; ++v)
+      {
+        for (int k = 0; k < 3; ++k)
+        {
+          cluster_quantized_.push_back((uint16_t)(lattice[v][k] - lo[k]));
+        }
+      }
+    }
+    else
+    {
+      // Still snapped, so the vertices match their copies in quantized clusters
+      cl.origin = RZVector3{};
+      cl.first_vertex = cluster_floats_.size();
+      for (int v = 0; v < num_vertices; ++v)
+      {
+        cluster_floats_.push_back(RZVector3{ (float)(lattice[v][0] * (double)lattice_step_),
+          (float)(lattice[v][1] * (double)lattice_step_), (float)(lattice[v][2] * (double)lattice_step_) });
+      }
+    }
+  }
+}
+
+void CPURaytracer::DecodeCluster(int index, int first, int end, TrianglePacket* out_packets) const
+{
+  // All the vertices first, as most are shared by several triangles
+  const cluster& c = clusters_[index];
+  RZVector3 vertices[ClusterSize * 3];
+  if (c.quantized)
+  {
+    const uint16_t* q = &cluster_quantized_[c.first_vertex * 3];
+    for (int v = 0; v < c.num_vertices; ++v, q += 3)
+    {
+      vertices[v] = RZVector3{ c.origin.x + (float)q[0] * lattice_step_,
+        c.origin.y + (float)q[1] * lattice_step_, c.origin.z + (float)q[2] * lattice_step_ };
+    }
+  }
+  else
+  {
+    std::copy(&cluster_floats_[c.first_vertex], &cluster_floats_[c.first_vertex] + c.num_vertices, vertices);
+  }
+
+  const uint8_t* locals = &cluster_triangles_[(size_t)index * ClusterSize * 3];
+  for (int i = first & ~3; i < ((end + 3) & ~3); ++i)
+  {
+    TrianglePacket& packet = out_packets[i / 4];
+    int lane = i % 4;
+    RZVector3 v0{}, v1{}, v2{}, e01{}, e12{}, e20{}, normal{};
+
+    // Zeroed lanes are never hit
+    if (i >= first && i < end)
+    {
+      v0 = vertices[locals[i * 3]];
+      v1 = vertices[locals[i * 3 + 1]];
+      v2 = vertices[locals[i * 3 + 2]];
+      e01 = v1 - v0;
+      e12 = v2 - v1;
+      e20 = v0 - v2;
+
+      // Not normalized. The tests only compare signs, and divide two dot products
+      // with it, so its length cancels out
+      normal = RZVector3::Cross(e01, -e20);
+    }
+
+    SetLane(packet.v0, lane, v0);
+    SetLane(packet.v1, lane, v1);
+    SetLane(packet.v2, lane, v2);
+    SetLane(packet.e01, lane, e01);
+    SetLane(packet.e12, lane, e12);
+    SetLane(packet.e20, lane, e20);
+    SetLane(packet.normal, lane, normal);
+  }
+}
+
+int CPURaytracer::FindClosestCompactHit(const RZVector3& start, const RZVector3& dir, int first, int end, float* io_dist,
+  bool* io_deferred) const
+{
+  // Each cluster the run overlaps goes through the kernel on its own, in order, so
+  // ties still keep the lowest position
+  TrianglePacket packets[ClusterSize / 4];
+  int closest = -1;
+  for (int base = first - first % ClusterSize; base < end; base += ClusterSize)
+  {
+    int cluster_first = std::max(first, base) - base;
+    int cluster_end = std::min(end, base + ClusterSize) - base;
+
+    // Clusters whose page isn't in are skipped when deferring, leaving the ray's
+    // result incomplete
+    if (out_of_core_)
+    {
+      int page = base / ClusterSize / ClustersPerPage;
+      if (!io_deferred)
+      {
+        page_cache_.Acquire(page);
+      }
+      else if (!page_cache_.TryAcquire(page))
+      {
+        *io_deferred = true;
+        continue;
+      }
+    }
+
+    DecodeCluster(base / ClusterSize, cluster_first, cluster_end, packets);
+
+    int found = kernels_->find_closest_hit(start, dir, packets, cluster_first, cluster_end, io_dist);
+    if (found >= 0)
+    {
+      closest = base + found;
+    }
+  }
+  return closest;
+}
+
+void CPURaytracer::SetClusterPages()
+{
+  // A page's clusters have their triangles, their quantized vertices and their float
+  // vertices in one run of each array
+  size_t num_clusters = clusters_.size();
+  size_t num_pages = (num_clusters + ClustersPerPage - 1) / ClustersPerPage;
+  PageCache::range* ranges = scratch_.Allocate<PageCache::range>(num_pages * 3);
+  for (size_t p = 0; p < num_pages; ++p)
+  {
+    size_t first = p * ClustersPerPage;
+    size_t end = std::min(num_clusters, first + ClustersPerPage);
+    size_t first_triangle = first * ClusterSize;
+    size_t end_triangle = std::min(triangles_.size(), end * ClusterSize);
+
+    size_t quantized_begin = SIZE_MAX, quantized_end = 0;
+    size_t floats_begin = SIZE_MAX, floats_end = 0;
+    for (size_t c = first; c < end; ++c)
+    {
+      const cluster& cl = clusters_[c];
+      size_t& begin = cl.quantized ? quantized_begin : floats_begin;
+      size_t& last = cl.quantized ? quantized_end : floats_end;
+      begin = std::min(begin, cl.first_vertex);
+      last = std::max(last, cl.first_vertex + cl.num_vertices);
+    }
+
+    ranges[p * 3] = PageCache::range{ &cluster_triangles_[first_triangle * 3], (end_triangle - first_triangle) * 3 };
+    ranges[p * 3 + 1] = (quantized_begin < quantized_end) ?
+      PageCache::range{ (const uint8_t*)&cluster_quantized_[quantized_begin * 3], (quantized_end - quantized_begin) * 3 * sizeof(uint16_t) } :
+      PageCache::range{ nullptr, 0 };
+    ranges[p * 3 + 2] = (floats_begin < floats_end) ?
+      PageCache::range{ (const uint8_t*)&cluster_floats_[floats_begin], (floats_end - floats_begin) * sizeof(RZVector3) } :
+      PageCache::range{ nullptr, 0 };
+  }
+  page_cache_.SetPages((int)num_pages, 3, ranges);
+}
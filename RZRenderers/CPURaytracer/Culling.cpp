@@ -0,0 +1,73 @@
+//=============================================================================
+// Culling.cpp - View frustum queries against the CPU raytracer's tree
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+
+FrustumQuery CPURaytracer::GetViewFrustum(const RZVector3& viewer_position) const
+{
+  // Through the edges of the image plane, as the camera rays
+  return FrustumQuery::FromCamera(viewer_position, half_width_ / dist_to_plane_, half_height_ / dist_to_plane_);
+}
+
+uint32_t CPURaytracer::CountVisibleTriangles(const RZVector3& viewer_position) const
+{
+  uint32_t count = 0;
+  tree_.TraverseFrustum(GetViewFrustum(viewer_position),
+    [&count](const uint32_t*, int num_triangles)
+  {
+    count += (uint32_t)num_triangles;
+    return true;
+  });
+  return count;
+}
+
+uint32_t CPURaytracer::GetVisibleMeshes(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation,
+  uint32_t max_meshes, uint32_t* out_meshes)
+{
+  // The camera rays don't rotate, so neither does the frustum
+  UNREFERENCED_PARAMETER(viewer_orientation);
+
+  if (max_meshes > 0 && !out_meshes)
+  {
+    assert(false);
+    return 0;
+  }
+
+  // Frames in flight may still be reading the tree, and queued meshes aren't in it yet
+  pipeline_.Flush();
+  if (tree_invalidated_)
+  {
+    ApplyGeometryChanges();
+  }
+
+  std::vector<uint8_t> visible(meshes_.size());
+  uint32_t num_visible = 0;
+  tree_.TraverseFrustum(GetViewFrustum(viewer_position),
+    [&](const uint32_t* triangles, int count)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      uint32_t mesh = GetTriangleMesh(triangles[i]);
+      if (!visible[mesh])
+      {
+        visible[mesh] = 1;
+        ++num_visible;
+      }
+    }
+
+    // Everything's been found visible, no need to look further
+    return num_visible < (uint32_t)meshes_.size();
+  });
+
+  uint32_t written = 0;
+  for (uint32_t i = 0; i < (uint32_t)visible.size() && written < max_meshes; ++i)
+  {
+    if (visible[i])
+    {
+      out_meshes[written++] = i;
+    }
+  }
+  return num_visible;
+}
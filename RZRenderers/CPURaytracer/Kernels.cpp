@@ -0,0 +1,79 @@
+//=============================================================================
+// Kernels.cpp - Picks the raytracer's kernels from the CPU's instruction sets
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Kernels.h"
+
+#include <intrin.h>
+
+// Best instruction set the CPU (and OS, for the AVX registers) supports, of those
+// with kernels
+static RZInstructionSet DetectInstructionSet()
+{
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+
+  __cpuid(info, 1);
+  bool avx = (info[2] & (1 << 28)) != 0;
+  bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+
+  if (avx && os_saves_ymm && max_leaf >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    if ((info[1] & (1 << 5)) != 0)
+    {
+      return RZInstructionSet_AVX2;
+    }
+  }
+  return RZInstructionSet_SSE2;
+}
+
+// RZ_INSTRUCTION_SET, or Auto if it's not set (or not recognized)
+static RZInstructionSet GetInstructionSetOverride()
+{
+  char value[16];
+  DWORD length = GetEnvironmentVariableA("RZ_INSTRUCTION_SET", value, sizeof(value));
+  if (length == 0 || length >= sizeof(value))
+  {
+    return RZInstructionSet_Auto;
+  }
+
+  if (_stricmp(value, "sse2") == 0)
+  {
+    return RZInstructionSet_SSE2;
+  }
+  if (_stricmp(value, "sse4.2") == 0 || _stricmp(value, "sse42") == 0)
+  {
+    return RZInstructionSet_SSE42;
+  }
+  if (_stricmp(value, "avx2") == 0)
+  {
+    return RZInstructionSet_AVX2;
+  }
+  return RZInstructionSet_Auto;
+}
+
+const KernelTable& GetKernels(RZInstructionSet requested)
+{
+  if (requested == RZInstructionSet_Auto)
+  {
+    requested = GetInstructionSetOverride();
+  }
+
+  // Sets are numbered in order, each including the ones before
+  RZInstructionSet supported = DetectInstructionSet();
+  if (requested == RZInstructionSet_Auto || requested > supported)
+  {
+    requested = supported;
+  }
+
+  switch (requested)
+  {
+  case RZInstructionSet_AVX2:
+    return AVX2Kernels;
+  default:
+    return SSE2Kernels;
+  }
+}
@@ -0,0 +1,62 @@
+//=============================================================================
+// Kernels.h - The raytracer's hot loops, one version per instruction set,
+//             picked at startup from what the CPU supports
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+// Four triangles as structure of arrays, [component][lane]. A ray is tested against
+// all of them at once (or two packets at a time, with 8 lanes)
+struct TrianglePacket
+{
+  float v0[3][4], v1[3][4], v2[3][4];
+  float e01[3][4], e12[3][4], e20[3][4];
+  float normal[3][4];
+};
+
+// Write v into one lane of a packet's vector
+inline void SetLane(float (&field)[3][4], int lane, const RZVector3& v)
+{
+  field[0][lane] = v.x;
+  field[1][lane] = v.y;
+  field[2][lane] = v.z;
+}
+
+// Ray vs the triangles at positions [first, end) of packets, keeping the closest
+// hit nearer than *io_dist. Returns its position, or -1 if none is. Ties keep the
+// lowest position, and NaN distances (from degenerate triangles) never count. Same
+// tests (and results) as CPURaytracer::TestRayTriangle
+typedef int(*FindClosestHitFunc)(const RZVector3& start, const RZVector3& dir,
+  const TrianglePacket* packets, int first, int end, float* io_dist);
+
+// Direct lighting of count queued hits, as structure of arrays padded to a multiple
+// of 8. Albedo comes in through r, g & b and the shaded color goes out there.
+// Misses (hit_mask 0) get the background
+typedef void(*ShadeDirectFunc)(int count, const uint32_t* hit_mask,
+  const float* nx, const float* ny, const float* nz, float* r, float* g, float* b,
+  const RZVector3& light_dir, const RZVector3& background);
+
+// Bounds & centroids of count triangles, whose i0, i1 & i2 indices into positions
+// start every stride bytes from indices
+typedef void(*TriangleBoundsFunc)(const RZVector3* positions, const uint32_t* indices, size_t stride, int count,
+  RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids);
+
+// Tree traversal isn't in the table. It's inlined per query & visitor, and a call
+// through a pointer per node would cost more than the node's box tests
+struct KernelTable
+{
+  RZInstructionSet instruction_set;
+  FindClosestHitFunc find_closest_hit;
+  ShadeDirectFunc shade_direct;
+  TriangleBoundsFunc triangle_bounds;
+};
+
+// The kernels for the requested instruction set. RZInstructionSet_Auto (or a set the
+// CPU can't run) picks the best the CPU supports. The RZ_INSTRUCTION_SET environment
+// variable (sse2, sse4.2 or avx2) overrides Auto, ie. for benchmarks. SSE4.2 has
+// nothing over SSE2 worth a table of its own, so it gets (and reports) SSE2
+const KernelTable& GetKernels(RZInstructionSet requested);
+
+// Per instruction set versions (KernelsSSE.cpp, KernelsAVX2.cpp)
+extern const KernelTable SSE2Kernels;
+extern const KernelTable AVX2Kernels;
@@ -0,0 +1,208 @@
+//=============================================================================
+// KernelsAVX2.cpp - The raytracer's kernels for AVX2, 8 lanes wide
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Kernels.h"
+
+#include <immintrin.h>
+
+// Only called after CPUID says AVX2 is there, so nothing in this file may be shared
+// with the rest of the build (ie. inline functions from headers). It sticks to
+// intrinsics and its own static helpers. No FMA, so results match the SSE kernels
+
+struct Vector3AVX2
+{
+  __m256 x, y, z;
+};
+
+static Vector3AVX2 Splat(const RZVector3& v)
+{
+  return Vector3AVX2{ _mm256_set1_ps(v.x), _mm256_set1_ps(v.y), _mm256_set1_ps(v.z) };
+}
+
+// Two packets' components, lo into lanes 0-3 and hi into 4-7
+static Vector3AVX2 LoadPackets(const float (&lo)[3][4], const float (&hi)[3][4])
+{
+  return Vector3AVX2{
+    _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo[0])), _mm_loadu_ps(hi[0]), 1),
+    _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo[1])), _mm_loadu_ps(hi[1]), 1),
+    _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo[2])), _mm_loadu_ps(hi[2]), 1) };
+}
+
+static Vector3AVX2 Sub(const Vector3AVX2& a, const Vector3AVX2& b)
+{
+  return Vector3AVX2{ _mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y), _mm256_sub_ps(a.z, b.z) };
+}
+
+static __m256 Dot(const Vector3AVX2& a, const Vector3AVX2& b)
+{
+  return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a.x, b.x), _mm256_mul_ps(a.y, b.y)), _mm256_mul_ps(a.z, b.z));
+}
+
+static Vector3AVX2 Cross(const Vector3AVX2& a, const Vector3AVX2& b)
+{
+  return Vector3AVX2{
+    _mm256_sub_ps(_mm256_mul_ps(a.y, b.z), _mm256_mul_ps(a.z, b.y)),
+    _mm256_sub_ps(_mm256_mul_ps(a.z, b.x), _mm256_mul_ps(a.x, b.z)),
+    _mm256_sub_ps(_mm256_mul_ps(a.x, b.y), _mm256_mul_ps(a.y, b.x)) };
+}
+
+// Two packets at a time, with the same steps as the SSE kernel
+static int FindClosestHit(const RZVector3& start, const RZVector3& dir,
+  const TrianglePacket* packets, int first, int end, float* io_dist)
+{
+  Vector3AVX2 start8 = Splat(start);
+  Vector3AVX2 dir8 = Splat(dir);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 sign = _mm256_set1_ps(-0.f);
+  __m256i first8 = _mm256_set1_epi32(first);
+  __m256i last8 = _mm256_set1_epi32(end - 1);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  __m256 best_dist = _mm256_set1_ps(*io_dist);
+  __m256i best_index = _mm256_set1_epi32(-1);
+
+  int last_packet = (end - 1) / 4;
+  for (int p = first / 4; p <= last_packet; p += 2)
+  {
+    // An odd packet out is paired with itself, its second copy all outside the run
+    const TrianglePacket& lo = packets[p];
+    const TrianglePacket& hi = packets[p < last_packet ? p + 1 : p];
+
+    Vector3AVX2 normal = LoadPackets(lo.normal, hi.normal);
+    Vector3AVX2 v0 = LoadPackets(lo.v0, hi.v0);
+    Vector3AVX2 neg_normal{ _mm256_xor_ps(normal.x, sign), _mm256_xor_ps(normal.y, sign), _mm256_xor_ps(normal.z, sign) };
+    __m256 cosA = Dot(neg_normal, dir8);
+    __m256 d = Dot(Sub(start8, v0), normal);
+    __m256 h = _mm256_div_ps(d, cosA);
+    Vector3AVX2 pos{
+      _mm256_add_ps(start8.x, _mm256_mul_ps(dir8.x, h)),
+      _mm256_add_ps(start8.y, _mm256_mul_ps(dir8.y, h)),
+      _mm256_add_ps(start8.z, _mm256_mul_ps(dir8.z, h)) };
+
+    __m256 r = Dot(Cross(LoadPackets(lo.e01, hi.e01), Sub(pos, v0)), normal);
+    __m256 s = Dot(Cross(LoadPackets(lo.e12, hi.e12), Sub(pos, LoadPackets(lo.v1, hi.v1))), normal);
+    __m256 t = Dot(Cross(LoadPackets(lo.e20, hi.e20), Sub(pos, LoadPackets(lo.v2, hi.v2))), normal);
+
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(p * 4), lanes);
+    __m256 outside = _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpgt_epi32(first8, index), _mm256_cmpgt_epi32(index, last8)));
+
+    __m256 rejected = _mm256_or_ps(_mm256_or_ps(
+      _mm256_or_ps(_mm256_cmp_ps(cosA, zero, _CMP_LE_OS), _mm256_cmp_ps(d, zero, _CMP_LT_OS)),
+      _mm256_or_ps(_mm256_cmp_ps(r, zero, _CMP_LT_OS), _mm256_cmp_ps(s, zero, _CMP_LT_OS))),
+      _mm256_or_ps(_mm256_cmp_ps(t, zero, _CMP_LT_OS), outside));
+    __m256 closer = _mm256_andnot_ps(rejected, _mm256_cmp_ps(h, best_dist, _CMP_LT_OS));
+    best_dist = _mm256_blendv_ps(best_dist, h, closer);
+    best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index), _mm256_castsi256_ps(index), closer));
+  }
+
+  float dists[8];
+  int indices[8];
+  _mm256_storeu_ps(dists, best_dist);
+  _mm256_storeu_si256((__m256i*)indices, best_index);
+  _mm256_zeroupper();
+
+  int closest = -1;
+  for (int i = 0; i < 8; ++i)
+  {
+    if (indices[i] >= 0 && (dists[i] < *io_dist || (dists[i] == *io_dist && indices[i] < closest)))
+    {
+      closest = indices[i];
+      *io_dist = dists[i];
+    }
+  }
+  return closest;
+}
+
+static void ShadeDirect(int count, const uint32_t* hit_mask,
+  const float* nx, const float* ny, const float* nz, float* r, float* g, float* b,
+  const RZVector3& light_dir, const RZVector3& background)
+{
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.f);
+  Vector3AVX2 light = Splat(light_dir);
+  Vector3AVX2 back = Splat(background);
+
+  for (int i = 0; i < count; i += 8)
+  {
+    __m256 d = _mm256_add_ps(_mm256_add_ps(
+      _mm256_mul_ps(light.x, _mm256_loadu_ps(nx + i)),
+      _mm256_mul_ps(light.y, _mm256_loadu_ps(ny + i))),
+      _mm256_mul_ps(light.z, _mm256_loadu_ps(nz + i)));
+    d = _mm256_min_ps(_mm256_max_ps(d, zero), one);
+
+    __m256 mask = _mm256_loadu_ps((const float*)(hit_mask + i));
+    _mm256_storeu_ps(r + i, _mm256_blendv_ps(back.x, _mm256_mul_ps(_mm256_loadu_ps(r + i), d), mask));
+    _mm256_storeu_ps(g + i, _mm256_blendv_ps(back.y, _mm256_mul_ps(_mm256_loadu_ps(g + i), d), mask));
+    _mm256_storeu_ps(b + i, _mm256_blendv_ps(back.z, _mm256_mul_ps(_mm256_loadu_ps(b + i), d), mask));
+  }
+  _mm256_zeroupper();
+}
+
+// Eight triangles at a time, gathering their indices, then their vertices
+// x, y or z of the eight vertices whose float offsets are in the four 64 bit lanes of
+// lo, then hi
+static __m256 GatherVertexComponent(const float* base, __m256i lo, __m256i hi)
+{
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_i64gather_ps(base, lo, 4)),
+    _mm256_i64gather_ps(base, hi, 4), 1);
+}
+
+static void TriangleBounds(const RZVector3* positions, const uint32_t* indices, size_t stride, int count,
+  RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids)
+{
+  const float* base = (const float*)positions;
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i stride8 = _mm256_set1_epi32((int)stride);
+  __m256i three = _mm256_set1_epi64x(3);
+  __m256 third = _mm256_set1_ps(3.f);
+
+  for (int i = 0; i < count; i += 8)
+  {
+    // A partial group repeats the last triangle
+    __m256i offsets = _mm256_mullo_epi32(_mm256_min_epi32(lanes, _mm256_set1_epi32(count - 1 - i)), stride8);
+    const int* group = (const int*)((const uint8_t*)indices + i * stride);
+
+    // Float offsets of the vertices are 64 bit, as vertex * 3 passes 2^31 from ~715M
+    // vertices on
+    __m256 x[3], y[3], z[3];
+    for (int v = 0; v < 3; ++v)
+    {
+      __m256i vertex = _mm256_i32gather_epi32(group + v, offsets, 1);
+      __m256i lo = _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(vertex)), three);
+      __m256i hi = _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(vertex, 1)), three);
+      x[v] = GatherVertexComponent(base, lo, hi);
+      y[v] = GatherVertexComponent(base + 1, lo, hi);
+      z[v] = GatherVertexComponent(base + 2, lo, hi);
+    }
+
+    float mins[3][8], maxes[3][8], centroids[3][8];
+    _mm256_storeu_ps(mins[0], _mm256_min_ps(_mm256_min_ps(x[0], x[1]), x[2]));
+    _mm256_storeu_ps(mins[1], _mm256_min_ps(_mm256_min_ps(y[0], y[1]), y[2]));
+    _mm256_storeu_ps(mins[2], _mm256_min_ps(_mm256_min_ps(z[0], z[1]), z[2]));
+    _mm256_storeu_ps(maxes[0], _mm256_max_ps(_mm256_max_ps(x[0], x[1]), x[2]));
+    _mm256_storeu_ps(maxes[1], _mm256_max_ps(_mm256_max_ps(y[0], y[1]), y[2]));
+    _mm256_storeu_ps(maxes[2], _mm256_max_ps(_mm256_max_ps(z[0], z[1]), z[2]));
+    _mm256_storeu_ps(centroids[0], _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(x[0], x[1]), x[2]), third));
+    _mm256_storeu_ps(centroids[1], _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(y[0], y[1]), y[2]), third));
+    _mm256_storeu_ps(centroids[2], _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(z[0], z[1]), z[2]), third));
+
+    int group_size = count - i < 8 ? count - i : 8;
+    for (int j = 0; j < group_size; ++j)
+    {
+      out_mins[i + j] = RZVector3{ mins[0][j], mins[1][j], mins[2][j] };
+      out_maxes[i + j] = RZVector3{ maxes[0][j], maxes[1][j], maxes[2][j] };
+      out_centroids[i + j] = RZVector3{ centroids[0][j], centroids[1][j], centroids[2][j] };
+    }
+  }
+  _mm256_zeroupper();
+}
+
+const KernelTable AVX2Kernels =
+{
+  RZInstructionSet_AVX2,
+  FindClosestHit,
+  ShadeDirect,
+  TriangleBounds,
+};
@@ -0,0 +1,114 @@
+//=============================================================================
+// KernelsSSE.cpp - The raytracer's kernels for SSE2, the baseline every x64 CPU has
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Kernels.h"
+#include "Math/Simd.h"
+
+static Vector3x4 LoadPacket(const float (&v)[3][4])
+{
+  return Vector3x4{ float4::Load(v[0]), float4::Load(v[1]), float4::Load(v[2]) };
+}
+
+static int FindClosestHit(const RZVector3& start, const RZVector3& dir,
+  const TrianglePacket* packets, int first, int end, float* io_dist)
+{
+  Vector3x4 start4 = Vector3x4::Splat(start);
+  Vector3x4 dir4 = Vector3x4::Splat(dir);
+  float4 zero = float4::Zero();
+  __m128i first4 = _mm_set1_epi32(first);
+  __m128i last4 = _mm_set1_epi32(end - 1);
+
+  // Each lane keeps the closest hit it has seen. Only strictly closer hits replace
+  // it, so a lane keeps the lowest position of equal distances
+  float4 best_dist(*io_dist);
+  __m128i best_index = _mm_set1_epi32(-1);
+
+  for (int p = first / 4; p * 4 < end; ++p)
+  {
+    // CPURaytracer::TestRayTriangle's steps, in the same order so the distances
+    // match. Its early outs become rejected lanes; like there, NaNs aren't rejected
+    const TrianglePacket& packet = packets[p];
+    Vector3x4 normal = LoadPacket(packet.normal);
+    Vector3x4 v0 = LoadPacket(packet.v0);
+    float4 cosA = Dot(-normal, dir4);
+    float4 d = Dot(start4 - v0, normal);
+    float4 h = d / cosA;
+    Vector3x4 pos = start4 + dir4 * h;
+
+    float4 r = Dot(Cross(LoadPacket(packet.e01), pos - v0), normal);
+    float4 s = Dot(Cross(LoadPacket(packet.e12), pos - LoadPacket(packet.v1)), normal);
+    float4 t = Dot(Cross(LoadPacket(packet.e20), pos - LoadPacket(packet.v2)), normal);
+
+    // Runs needn't start or end on a packet boundary
+    __m128i index = _mm_add_epi32(_mm_set1_epi32(p * 4), _mm_setr_epi32(0, 1, 2, 3));
+    float4 outside = _mm_castsi128_ps(_mm_or_si128(_mm_cmplt_epi32(index, first4), _mm_cmpgt_epi32(index, last4)));
+
+    float4 rejected = (cosA <= zero) | (d < zero) | (r < zero) | (s < zero) | (t < zero) | outside;
+    float4 closer = AndNot(h < best_dist, rejected);
+    best_dist = Select(closer, h, best_dist);
+    best_index = _mm_castps_si128(Select(closer, _mm_castsi128_ps(index), _mm_castsi128_ps(best_index)));
+  }
+
+  float dists[4];
+  int indices[4];
+  best_dist.Store(dists);
+  _mm_storeu_si128((__m128i*)indices, best_index);
+
+  int closest = -1;
+  for (int i = 0; i < 4; ++i)
+  {
+    if (indices[i] >= 0 && (dists[i] < *io_dist || (dists[i] == *io_dist && indices[i] < closest)))
+    {
+      closest = indices[i];
+      *io_dist = dists[i];
+    }
+  }
+  return closest;
+}
+
+static void ShadeDirect(int count, const uint32_t* hit_mask,
+  const float* nx, const float* ny, const float* nz, float* r, float* g, float* b,
+  const RZVector3& light_dir, const RZVector3& background)
+{
+  float4 zero = float4::Zero();
+  float4 one(1.f);
+  Vector3x4 light = Vector3x4::Splat(light_dir);
+  Vector3x4 back = Vector3x4::Splat(background);
+
+  for (int i = 0; i < count; i += 4)
+  {
+    float4 d = light.x * float4::Load(nx + i) + light.y * float4::Load(ny + i) + light.z * float4::Load(nz + i);
+    d = Min(Max(d, zero), one);
+
+    __m128 mask = _mm_loadu_ps((const float*)(hit_mask + i));
+    _mm_storeu_ps(r + i, Select(mask, float4::Load(r + i) * d, back.x));
+    _mm_storeu_ps(g + i, Select(mask, float4::Load(g + i) * d, back.y));
+    _mm_storeu_ps(b + i, Select(mask, float4::Load(b + i) * d, back.z));
+  }
+}
+
+static void TriangleBounds(const RZVector3* positions, const uint32_t* indices, size_t stride, int count,
+  RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids)
+{
+  const uint8_t* triangle = (const uint8_t*)indices;
+  for (int i = 0; i < count; ++i, triangle += stride)
+  {
+    const uint32_t* t = (const uint32_t*)triangle;
+    float4 v0 = Load3(positions[t[0]]);
+    float4 v1 = Load3(positions[t[1]]);
+    float4 v2 = Load3(positions[t[2]]);
+    out_mins[i] = Store3(Min(Min(v0, v1), v2));
+    out_maxes[i] = Store3(Max(Max(v0, v1), v2));
+    out_centroids[i] = Store3((v0 + v1 + v2) / float4(3.f));
+  }
+}
+
+const KernelTable SSE2Kernels =
+{
+  RZInstructionSet_SSE2,
+  FindClosestHit,
+  ShadeDirect,
+  TriangleBounds,
+};
@@ -0,0 +1,421 @@
+//=============================================================================
+// LevelOfDetail.cpp - Simplified versions of large meshes, traced where the
+//                     camera can't resolve their full detail
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+
+// Grid cells of a level of detail start at about this many edges across
+static const float LodFirstCellEdges = 2.f;
+
+// Largest grid coordinate in a cell key, 21 bits each
+static const uint64_t MaxCellCoordinate = 0x1FFFFF;
+
+// A simplified triangle, rotated to start at its lowest vertex so repeats (in the
+// same winding) sort together, and the full detail triangle it was made from
+struct simplified_triangle
+{
+  uint32_t v[3];
+  uint32_t source;
+};
+
+static bool SameVertices(const simplified_triangle& a, const simplified_triangle& b)
+{
+  return a.v[0] == b.v[0] && a.v[1] == b.v[1] && a.v[2] == b.v[2];
+}
+
+static bool VerticesBefore(const simplified_triangle& a, const simplified_triangle& b)
+{
+  for (int k = 0; k < 3; ++k)
+  {
+    if (a.v[k] != b.v[k])
+    {
+      return a.v[k] < b.v[k];
+    }
+  }
+  return a.source < b.source;
+}
+
+static uint64_t GetCellKey(const RZVector3& p, const RZVector3& min, float inv_cell)
+{
+  uint64_t x = std::min((uint64_t)((p.x - min.x) * inv_cell), MaxCellCoordinate);
+  uint64_t y = std::min((uint64_t)((p.y - min.y) * inv_cell), MaxCellCoordinate);
+  uint64_t z = std::min((uint64_t)((p.z - min.z) * inv_cell), MaxCellCoordinate);
+  return (x << 42) | (y << 21) | z;
+}
+
+// Scrambled bits of the index (murmur3's finalizer), so neighbouring meshes switch
+// levels at unrelated points
+static uint32_t HashMesh(uint32_t index)
+{
+  index ^= index >> 16;
+  index *= 0x85ebca6b;
+  index ^= index >> 13;
+  index *= 0xc2b2ae35;
+  index ^= index >> 16;
+  return index;
+}
+
+void CPURaytracer::BuildMeshLods(uint32_t mesh_index)
+{
+  mesh& m = meshes_[mesh_index];
+  if (m.num_triangles < MinLodTriangles)
+  {
+    return;
+  }
+
+  // The mesh's vertices, once each, and its triangles' corners in terms of them
+  std::vector<uint32_t> vertices(m.num_triangles * 3);
+  for (uint32_t i = 0; i < m.num_triangles; ++i)
+  {
+    const triangle& t = triangles_[m.first_triangle + i];
+    vertices[i * 3] = t.i0;
+    vertices[i * 3 + 1] = t.i1;
+    vertices[i * 3 + 2] = t.i2;
+  }
+  std::vector<uint32_t> corners(vertices);
+  std::sort(vertices.begin(), vertices.end());
+  vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+  for (uint32_t& c : corners)
+  {
+    c = (uint32_t)(std::lower_bound(vertices.begin(), vertices.end(), c) - vertices.begin());
+  }
+  int num_vertices = (int)vertices.size();
+
+  lod_mesh lm{ (uint32_t)lod_levels_.size(), 0,
+    RZVector3{ FLT_MAX, FLT_MAX, FLT_MAX }, RZVector3{ -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+  for (uint32_t v : vertices)
+  {
+    lm.min = RZVector3::Min(lm.min, positions_[v]);
+    lm.max = RZVector3::Max(lm.max, positions_[v]);
+  }
+
+  double edge_sum = 0.;
+  for (uint32_t i = 0; i < m.num_triangles * 3; ++i)
+  {
+    uint32_t next = (i % 3 == 2) ? i - 2 : i + 1;
+    edge_sum += (positions_[vertices[corners[next]]] - positions_[vertices[corners[i]]]).Length();
+  }
+  float cell = (float)(edge_sum / (m.num_triangles * 3)) * LodFirstCellEdges;
+
+  // Vertex clustering: every vertex moves to the one nearest the middle of its grid
+  // cell, and triangles left without three distinct vertices (or repeating another)
+  // go. Each level doubles the cell size, so has about a quarter of the triangles of
+  // the one before. Vertices are only ever moved onto others, so levels add no new ones
+  uint32_t lod_index = (uint32_t)lod_meshes_.size();
+  std::vector<uint64_t> keys(num_vertices);
+  std::vector<int> by_cell(num_vertices);
+  std::vector<uint32_t> moved_to(num_vertices);
+  std::vector<simplified_triangle> kept;
+  uint32_t previous_count = m.num_triangles;
+
+  for (int step = 0; step < MaxLodLevels * 2 && lm.num_levels < MaxLodLevels && cell > 0.f; ++step, cell *= 2.f)
+  {
+    float inv_cell = 1.f / cell;
+    for (int v = 0; v < num_vertices; ++v)
+    {
+      keys[v] = GetCellKey(positions_[vertices[v]], lm.min, inv_cell);
+      by_cell[v] = v;
+    }
+    std::sort(by_cell.begin(), by_cell.end(), [&](int a, int b) { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); });
+
+    float error = 0.f;
+    for (int first = 0; first < num_vertices;)
+    {
+      int end = first + 1;
+      RZVector3 sum = positions_[vertices[by_cell[first]]];
+      for (; end < num_vertices && keys[by_cell[end]] == keys[by_cell[first]]; ++end)
+      {
+        sum += positions_[vertices[by_cell[end]]];
+      }
+
+      RZVector3 middle = sum * (1.f / (end - first));
+      int nearest = by_cell[first];
+      float nearest_dist = FLT_MAX;
+      for (int i = first; i < end; ++i)
+      {
+        RZVector3 offset = positions_[vertices[by_cell[i]]] - middle;
+        float dist = RZVector3::Dot(offset, offset);
+        if (dist < nearest_dist)
+        {
+          nearest = by_cell[i];
+          nearest_dist = dist;
+        }
+      }
+
+      for (int i = first; i < end; ++i)
+      {
+        moved_to[by_cell[i]] = vertices[nearest];
+        error = std::max(error, (positions_[vertices[by_cell[i]]] - positions_[vertices[nearest]]).Length());
+      }
+      first = end;
+    }
+
+    kept.clear();
+    for (uint32_t i = 0; i < m.num_triangles; ++i)
+    {
+      uint32_t a = moved_to[corners[i * 3]];
+      uint32_t b = moved_to[corners[i * 3 + 1]];
+      uint32_t c = moved_to[corners[i * 3 + 2]];
+      if (a == b || b == c || c == a)
+      {
+        continue;
+      }
+
+      if (b < a && b < c)
+      {
+        kept.push_back(simplified_triangle{ { b, c, a }, i });
+      }
+      else if (c < a && c < b)
+      {
+        kept.push_back(simplified_triangle{ { c, a, b }, i });
+      }
+      else
+      {
+        kept.push_back(simplified_triangle{ { a, b, c }, i });
+      }
+    }
+    std::sort(kept.begin(), kept.end(), VerticesBefore);
+    kept.erase(std::unique(kept.begin(), kept.end(), SameVertices), kept.end());
+
+    uint32_t count = (uint32_t)kept.size();
+    if (count < MinLodLevelTriangles)
+    {
+      break;
+    }
+
+    // Cells too small to merge much make a level not worth keeping, but larger ones may
+    if (count > previous_count * 3 / 4)
+    {
+      continue;
+    }
+
+    ++lm.num_levels;
+    lod_levels_.push_back(lod_level{ (uint32_t)lod_triangles_.size(), count, 0, error });
+    for (const simplified_triangle& t : kept)
+    {
+      lod_triangles_.push_back(triangle{ t.v[0], t.v[1], t.v[2] });
+      lod_sources_.push_back(m.first_triangle + t.source);
+      lod_tags_.push_back((lod_index << LodLevelBits) | lm.num_levels);
+    }
+    previous_count = count;
+  }
+
+  if (lm.num_levels > 0)
+  {
+    m.lod = lod_index;
+    lod_meshes_.push_back(lm);
+    lod_selection_.push_back(0);
+  }
+}
+
+void CPURaytracer::RebuildLodTrees()
+{
+  // Simplified mesh of every position in the main tree
+  int count = (int)triangles_.size();
+  uint32_t* triangle_lods = scratch_.Allocate<uint32_t>(count);
+  for (const mesh& m : meshes_)
+  {
+    std::fill(triangle_lods + m.first_triangle, triangle_lods + m.first_triangle + m.num_triangles,
+      m.lod == NoLod ? 0 : m.lod + 1);
+  }
+
+  const uint32_t* order = tree_.GetPrimitiveOrder();
+  tree_lods_.resize(count);
+  for (int i = 0; i < count; ++i)
+  {
+    tree_lods_[i] = triangle_lods[order[i]];
+  }
+
+  // Levels start on a new packet, so each is traced like a tree of its own. Always
+  // full packets, even with compact geometry, as they're a fraction of the scene
+  uint32_t num_packets = 0;
+  for (lod_level& level : lod_levels_)
+  {
+    level.first_packet = num_packets;
+    num_packets += (level.num_triangles + 3) / 4;
+  }
+  lod_packets_.assign(num_packets, TrianglePacket{});
+  lod_trees_.resize(lod_levels_.size());
+  lod_mesh_tree_.Rebuild(lod_meshes_.data(), (int)lod_meshes_.size(), lod_mesh_bounds(), &scratch_);
+
+  for (size_t l = 0; l < lod_levels_.size(); ++l)
+  {
+    const lod_level& level = lod_levels_[l];
+    const triangle* level_triangles = lod_triangles_.data() + level.first_triangle;
+    int level_count = (int)level.num_triangles;
+    if (!lod_trees_[l])
+    {
+      lod_trees_[l].reset(new triangle_tree());
+    }
+    lod_trees_[l]->RebuildFromBounds(level_count, [&](RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids)
+    {
+      kernels_->triangle_bounds(positions_.data(), (const uint32_t*)level_triangles, sizeof(triangle), level_count,
+        out_mins, out_maxes, out_centroids);
+    }, &scratch_);
+
+    const uint32_t* level_order = lod_trees_[l]->GetPrimitiveOrder();
+    TrianglePacket* packets = lod_packets_.data() + level.first_packet;
+    for (int i = 0; i < level_count; ++i)
+    {
+      const triangle& t = level_triangles[level_order[i]];
+      triangle_setup setup = ComputeTriangleSetup(positions_[t.i0], positions_[t.i1], positions_[t.i2]);
+      TrianglePacket& packet = packets[i / 4];
+      SetLane(packet.v0, i % 4, positions_[t.i0]);
+      SetLane(packet.v1, i % 4, positions_[t.i1]);
+      SetLane(packet.v2, i % 4, positions_[t.i2]);
+      SetLane(packet.e01, i % 4, setup.e01);
+      SetLane(packet.e12, i % 4, setup.e12);
+      SetLane(packet.e20, i % 4, setup.e20);
+      SetLane(packet.normal, i % 4, setup.normal);
+    }
+  }
+}
+
+void CPURaytracer::SelectLods(const RZVector3& viewer_position)
+{
+  stats_.SimplifiedMeshes = 0;
+  for (size_t i = 0; i < lod_meshes_.size(); ++i)
+  {
+    // Width of a pixel at the nearest point of the mesh's box
+    const lod_mesh& lm = lod_meshes_[i];
+    RZVector3 nearest = RZVector3::Min(RZVector3::Max(viewer_position, lm.min), lm.max);
+    float footprint = (nearest - viewer_position).Length() / dist_to_plane_;
+
+    // Each level fades in as the footprint grows from its error to twice that, about
+    // where the next one starts. Past that, its error is under half a pixel. Where in
+    // that band the mesh switches is fixed per mesh, so frames that aren't accumulated
+    // don't flicker, and steps by the golden ratio each pass, so accumulated ones blend
+    float blend = ((HashMesh((uint32_t)i) + lod_passes_ * 2654435769u) >> 8) * (1.f / 16777216.f);
+    uint8_t level = 0;
+    for (uint32_t k = 0; k < lm.num_levels; ++k)
+    {
+      float error = lod_levels_[lm.first_level + k].error;
+      if (footprint >= 2.f * error)
+      {
+        level = (uint8_t)(k + 1);
+        continue;
+      }
+      if (footprint > error && blend < log2f(footprint / error))
+      {
+        level = (uint8_t)(k + 1);
+      }
+      break;
+    }
+
+    lod_selection_[i] = level;
+    if (level > 0)
+    {
+      ++stats_.SimplifiedMeshes;
+    }
+  }
+  any_simplified_ = stats_.SimplifiedMeshes > 0;
+  ++lod_passes_;
+}
+
+int CPURaytracer::FindClosestSelectedHit(const RZVector3& start, const RZVector3& dir, int first, int end,
+  float* io_dist, bool* io_deferred) const
+{
+  if (!any_simplified_)
+  {
+    return FindClosestHit(start, dir, first, end, io_dist, io_deferred);
+  }
+
+  // Runs of triangles traced at full detail
+  int closest = -1;
+  for (int i = first; i < end;)
+  {
+    if (tree_lods_[i] != 0 && lod_selection_[tree_lods_[i] - 1] != 0)
+    {
+      ++i;
+      continue;
+    }
+
+    int run_end = i + 1;
+    while (run_end < end && (tree_lods_[run_end] == 0 || lod_selection_[tree_lods_[run_end] - 1] == 0))
+    {
+      ++run_end;
+    }
+
+    int found = FindClosestHit(start, dir, i, run_end, io_dist, io_deferred);
+    if (found >= 0)
+    {
+      closest = found;
+    }
+    i = run_end;
+  }
+  return closest;
+}
+
+uint32_t CPURaytracer::FindClosestLodHit(const RZVector3& start, const RZVector3& dir, float* io_dist, bool any_hit) const
+{
+  // Meshes nearest first, then their selected level's boxes the same way. The query
+  // shrinks to the closest hit so far, which skips the meshes past it
+  SegmentQuery query(start, dir, *io_dist);
+  uint32_t closest = NoHit;
+  lod_mesh_tree_.Traverse(query, [&](const uint32_t* meshes, int num_meshes)
+  {
+    for (int m = 0; m < num_meshes && !(any_hit && closest != NoHit); ++m)
+    {
+      uint32_t i = meshes[m];
+      const lod_mesh& lm = lod_meshes_[i];
+      float key;
+      if (lod_selection_[i] == 0 || !query.TestBox(lm.min, lm.max, &key))
+      {
+        continue;
+      }
+
+      uint32_t level_index = lm.first_level + lod_selection_[i] - 1;
+      const lod_level& level = lod_levels_[level_index];
+      const triangle_tree& tree = *lod_trees_[level_index];
+      const uint32_t* order = tree.GetPrimitiveOrder();
+      const TrianglePacket* packets = lod_packets_.data() + level.first_packet;
+      tree.Traverse(query, [&](const uint32_t* run, int count)
+      {
+        int first = (int)(run - order);
+        int found = kernels_->find_closest_hit(start, dir, packets, first, first + count, io_dist);
+        if (found >= 0)
+        {
+          closest = LodTriangleFlag | (level.first_triangle + order[found]);
+        }
+
+        query.max_dist = *io_dist;
+        return !(any_hit && closest != NoHit);
+      });
+    }
+    return !(any_hit && closest != NoHit);
+  });
+  return closest;
+}
+
+bool CPURaytracer::IsTriangleSelected(uint32_t triangle) const
+{
+  if (lod_meshes_.empty())
+  {
+    return true;
+  }
+
+  if ((triangle & LodTriangleFlag) != 0)
+  {
+    uint32_t tag = lod_tags_[triangle & ~LodTriangleFlag];
+    return lod_selection_[tag >> LodLevelBits] == (tag & LodLevelMask);
+  }
+
+  uint32_t lod = meshes_[GetTriangleMesh(triangle)].lod;
+  return lod == NoLod || lod_selection_[lod] == 0;
+}
+
+const CPURaytracer::triangle& CPURaytracer::GetTriangle(uint32_t triangle) const
+{
+  return ((triangle & LodTriangleFlag) != 0) ? lod_triangles_[triangle & ~LodTriangleFlag] : triangles_[triangle];
+}
+
+uint32_t CPURaytracer::GetSourceTriangle(uint32_t triangle) const
+{
+  if (triangle == NoHit || (triangle & LodTriangleFlag) == 0)
+  {
+    return triangle;
+  }
+  return lod_sources_[triangle & ~LodTriangleFlag];
+}
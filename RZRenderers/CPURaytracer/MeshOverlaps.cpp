@@ -0,0 +1,44 @@
+//=============================================================================
+// MeshOverlaps.cpp - Intersecting triangles between meshes of the CPU raytracer
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+
+uint32_t CPURaytracer::FindMeshOverlaps(uint32_t mesh_a, uint32_t mesh_b, bool first_only,
+  uint32_t max_pairs, RZTrianglePair* out_pairs)
+{
+  if ((max_pairs > 0 && !out_pairs) || mesh_a == mesh_b)
+  {
+    assert(false);
+    return 0;
+  }
+
+  // Queued meshes aren't added until applied, and frames in flight may be using the threads
+  pipeline_.Flush();
+  if (mesh_a >= meshes_.size() || mesh_b >= meshes_.size())
+  {
+    assert(false);
+    return 0;
+  }
+
+  std::vector<RZTrianglePair> pairs;
+  MeshOverlapSearch<triangle_tree, triangle> search(triangles_.data(), positions_.data());
+  search.FindOverlaps(thread_pool_, GetMeshTree(mesh_a), meshes_[mesh_a].first_triangle,
+    GetMeshTree(mesh_b), meshes_[mesh_b].first_triangle, first_only, &pairs);
+
+  std::copy_n(pairs.begin(), std::min((uint32_t)pairs.size(), max_pairs), out_pairs);
+  return (uint32_t)pairs.size();
+}
+
+const CPURaytracer::triangle_tree& CPURaytracer::GetMeshTree(uint32_t mesh)
+{
+  mesh_trees_.resize(meshes_.size());
+  if (!mesh_trees_[mesh])
+  {
+    mesh_trees_[mesh].reset(new triangle_tree());
+    mesh_trees_[mesh]->Rebuild(triangles_.data() + meshes_[mesh].first_triangle, (int)meshes_[mesh].num_triangles,
+      IndexedTriangleBounds<triangle>{ positions_.data() });
+  }
+  return *mesh_trees_[mesh];
+}
@@ -0,0 +1,53 @@
+//=============================================================================
+// NearestPoints.cpp - Closest surface point queries against the CPU raytracer's tree
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+
+bool CPURaytracer::FindNearestSurfacePoint(const RZVector3& point, float max_distance, RZSurfacePoint* out_result)
+{
+  if (!out_result)
+  {
+    assert(false);
+    return false;
+  }
+
+  FindNearestSurfacePoints(1, &point, max_distance, out_result);
+  return out_result->PrimitiveID != NoHit;
+}
+
+void CPURaytracer::FindNearestSurfacePoints(uint32_t num_points, const RZVector3* points, float max_distance,
+  RZSurfacePoint* out_results)
+{
+  if (num_points > 0 && (!points || !out_results))
+  {
+    assert(false);
+    return;
+  }
+
+  // Frames in flight may still be using the tree & threads, and queued meshes aren't in it yet
+  pipeline_.Flush();
+  if (tree_invalidated_)
+  {
+    ApplyGeometryChanges();
+  }
+
+  NearestPointSearch<decltype(tree_), triangle> search(tree_, triangles_.data(), positions_.data());
+  if (num_points == 1)
+  {
+    search.FindNearest(points[0], max_distance, NoHit, out_results);
+  }
+  else
+  {
+    search.FindNearestBatch(thread_pool_, num_points, points, max_distance, out_results, &nearest_keys_);
+  }
+
+  for (uint32_t i = 0; i < num_points; ++i)
+  {
+    if (out_results[i].PrimitiveID != NoHit)
+    {
+      out_results[i].MeshID = GetTriangleMesh(out_results[i].PrimitiveID);
+    }
+  }
+}
@@ -0,0 +1,144 @@
+//=============================================================================
+// RenderTarget.h - Pixel format conversion for caller provided render targets
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "Shading.h"
+
+// Bytes per pixel, 0 for unknown formats
+inline uint32_t GetPixelSize(RZPixelFormat format)
+{
+  switch (format)
+  {
+  case RZPixelFormat_BGRA8:
+  case RZPixelFormat_RGBA8:
+  case RZPixelFormat_Depth32F:
+  case RZPixelFormat_PrimitiveID:
+    return 4;
+  case RZPixelFormat_RGBA16F:
+    return 8;
+  case RZPixelFormat_RGBA32F:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+inline bool IsValidRenderTarget(const RZRenderTarget& target, int width)
+{
+  uint32_t pixel_size = GetPixelSize(target.Format);
+  return target.Pixels && pixel_size > 0 && target.RowPitch >= pixel_size * (uint32_t)width;
+}
+
+// Every plane asked for is present, and rows are long enough (every AOV component is 4 bytes)
+inline bool IsValidAovTarget(const RZAovTarget& target, int width)
+{
+  uint32_t mask = target.Mask;
+  return target.RowPitch >= sizeof(float) * (uint32_t)width &&
+    ((mask & RZAov_Depth) == 0 || target.Depth) &&
+    ((mask & RZAov_Normal) == 0 || (target.Normal[0] && target.Normal[1] && target.Normal[2])) &&
+    ((mask & RZAov_PrimitiveID) == 0 || target.PrimitiveID) &&
+    ((mask & RZAov_MeshID) == 0 || target.MeshID) &&
+    ((mask & RZAov_Barycentrics) == 0 || (target.Barycentrics[0] && target.Barycentrics[1])) &&
+    ((mask & RZAov_Position) == 0 || (target.Position[0] && target.Position[1] && target.Position[2]));
+}
+
+// Round to nearest half, overflowing to infinity
+inline uint16_t FloatToHalf(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7FFFFFFF;
+
+  if (bits >= 0x47800000)
+  {
+    // Too large (or inf/NaN)
+    return (uint16_t)(sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00));
+  }
+
+  if (bits < 0x38800000)
+  {
+    // Denormal result. Adding 0.5 lines the mantissa up with a half's, and the FPU rounds
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    f += 0.5f;
+    memcpy(&bits, &f, sizeof(bits));
+    return (uint16_t)(sign | (bits - 0x3F000000));
+  }
+
+  // Rebias the exponent and round to nearest even
+  bits += ((uint32_t)(15 - 127) << 23) + 0xFFF + ((bits >> 13) & 1);
+  return (uint16_t)(sign | (bits >> 13));
+}
+
+// Exact, every half is a float
+inline float HalfToFloat(uint16_t value)
+{
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  uint32_t bits = value & 0x7FFF;
+  float f;
+
+  if (bits < 0x400)
+  {
+    // Denormal, the mantissa counts 2^-24s
+    f = (float)bits * (1.f / 16777216.f);
+    memcpy(&bits, &f, sizeof(bits));
+  }
+  else if (bits >= 0x7C00)
+  {
+    // Inf/NaN
+    bits = 0x7F800000 | ((bits & 0x3FF) << 13);
+  }
+  else
+  {
+    bits = (bits << 13) + ((uint32_t)(127 - 15) << 23);
+  }
+
+  bits |= sign;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Write a linear color to a pixel of one of the color formats
+inline void StoreColor(RZPixelFormat format, uint8_t* pixel, const RZVector3& color)
+{
+  switch (format)
+  {
+  case RZPixelFormat_BGRA8:
+    *(uint32_t*)pixel = PackColor(color);
+    break;
+
+  case RZPixelFormat_RGBA8:
+  {
+    uint32_t c = PackColor(color);
+    *(uint32_t*)pixel = (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+    break;
+  }
+
+  case RZPixelFormat_RGBA16F:
+  {
+    uint16_t* p = (uint16_t*)pixel;
+    p[0] = FloatToHalf(color.x);
+    p[1] = FloatToHalf(color.y);
+    p[2] = FloatToHalf(color.z);
+    p[3] = 0x3C00;  // 1.0
+    break;
+  }
+
+  case RZPixelFormat_RGBA32F:
+  {
+    float* p = (float*)pixel;
+    p[0] = color.x;
+    p[1] = color.y;
+    p[2] = color.z;
+    p[3] = 1.f;
+    break;
+  }
+
+  default:
+    assert(false);
+    break;
+  }
+}
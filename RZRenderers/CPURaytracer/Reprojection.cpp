@@ -0,0 +1,122 @@
+//=============================================================================
+// Reprojection.cpp - Reuse of last frame's primary hits for the CPU raytracer
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+#include "Math/PrimitiveTests.h"
+
+// A neighbor nearer than this fraction of a pixel's depth marks an occluding edge
+static const float DepthEdgeRatio = 0.9f;
+
+static float KeyDepth(uint64_t key)
+{
+  uint32_t depth_bits = (uint32_t)(key >> 32);
+  float depth;
+  memcpy(&depth, &depth_bits, sizeof(depth));
+  return depth;
+}
+
+void CPURaytracer::Reproject(const RZVector3& viewer_position)
+{
+  std::fill(reproject_keys_.begin(), reproject_keys_.end(), UINT64_MAX);
+
+  // Move every cached hit point into the new view, and keep the nearest one landing
+  // in each pixel. Serial, since the scattered writes would race, and it's cheap
+  // next to the traces it saves. Pixels nothing lands in are disoccluded.
+  for (int y = 0; y < height_; ++y)
+  {
+    for (int x = 0; x < width_; ++x)
+    {
+      uint32_t triangle = cache_triangles_[y * width_ + x];
+      if (triangle == NoHit)
+      {
+        continue;
+      }
+
+      RZVector3 dir{ x + 0.5f - half_width_, half_height_ - (y + 0.5f), dist_to_plane_ };
+      dir.Normalize();
+      RZVector3 p = cache_position_ + dir * cache_dists_[y * width_ + x] - viewer_position;
+      if (p.z <= 0.f)
+      {
+        continue;
+      }
+
+      float scale = dist_to_plane_ / p.z;
+      float sx = half_width_ + p.x * scale;
+      float sy = half_height_ - p.y * scale;
+      if (!(sx >= 0.f && sx < (float)width_ && sy >= 0.f && sy < (float)height_))
+      {
+        continue;
+      }
+
+      // Positive floats order the same as their bits
+      uint32_t depth_bits;
+      memcpy(&depth_bits, &p.z, sizeof(depth_bits));
+      uint64_t& key = reproject_keys_[(int)sy * width_ + (int)sx];
+      key = std::min(key, ((uint64_t)depth_bits << 32) | triangle);
+    }
+  }
+
+  // The coming pass refills the cache from this view
+  cache_position_ = viewer_position;
+}
+
+bool CPURaytracer::NearDepthEdge(int x, int y) const
+{
+  float depth = KeyDepth(reproject_keys_[y * width_ + x]);
+
+  static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+  for (int i = 0; i < 4; ++i)
+  {
+    int nx = x + offsets[i][0];
+    int ny = y + offsets[i][1];
+    if (nx < 0 || nx >= width_ || ny < 0 || ny >= height_)
+    {
+      continue;
+    }
+
+    uint64_t neighbor = reproject_keys_[ny * width_ + nx];
+    if (neighbor == UINT64_MAX || KeyDepth(neighbor) < depth * DepthEdgeRatio)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool CPURaytracer::FindReprojectedHit(int x, int y, const RZVector3& start, const RZVector3& dir,
+  thread_context& context, hit* out_hit)
+{
+  int pixel = y * width_ + x;
+
+  // A single triangle test confirms the candidate is still under the pixel center.
+  // Reprojected pixels skip the tree entirely; disoccluded ones, those whose
+  // candidate slid off, and those next to a hole or a nearer surface (which may
+  // have moved over them without landing a sample here) are traced
+  bool found_hit = false;
+  uint32_t candidate = (uint32_t)reproject_keys_[pixel];
+  if (candidate != NoHit && !NearDepthEdge(x, y) && IsTriangleSelected(candidate) &&
+    TestRayTriangle(start, dir, positions_.data(), GetTriangle(candidate), GetTriangleSetup(candidate),
+      &out_hit->dist, &out_hit->normal))
+  {
+    out_hit->triangle = candidate;
+    found_hit = true;
+    ++context.reprojected_hits;
+  }
+  else if (!TestRayBox(start, dir, scene_min_, scene_max_))
+  {
+    // Sky can't be reprojected, but needs no candidate either
+    ++context.reprojected_hits;
+  }
+  else
+  {
+    found_hit = Intersect(start, dir, out_hit);
+    ++context.retraced_hits;
+  }
+
+  cache_triangles_[pixel] = found_hit ? out_hit->triangle : NoHit;
+  cache_dists_[pixel] = out_hit->dist;
+  return found_hit;
+}
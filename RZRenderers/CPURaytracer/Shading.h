@@ -0,0 +1,34 @@
+//=============================================================================
+// Shading.h - Lighting environment and color helpers shared by the raytracer
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "Math/Sampling.h"
+
+static const RZVector3 background{ 0.f, 0.f, 0.4f };  // 0xFF000066
+
+// Directional light. Irradiance of Pi makes a white diffuse surface reflect N.L
+static const RZVector3 light_dir = RZVector3::Normalize(RZVector3{ 1.f, 1.f, -1.f });
+static const float light_irradiance = Pi;
+
+// Secondary rays start this far off the surface (scaled by hit distance) to avoid self hits
+static const float ray_epsilon = 1e-4f;
+
+inline RZVector3 Modulate(const RZVector3& v1, const RZVector3& v2)
+{
+  return RZVector3{ v1.x * v2.x, v1.y * v2.y, v1.z * v2.z };
+}
+
+inline float Luminance(const RZVector3& color)
+{
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+inline uint32_t PackColor(const RZVector3& color)
+{
+  uint32_t r = (uint32_t)(255.f * std::min(std::max(0.f, color.x), 1.f) + 0.5f);
+  uint32_t g = (uint32_t)(255.f * std::min(std::max(0.f, color.y), 1.f) + 0.5f);
+  uint32_t b = (uint32_t)(255.f * std::min(std::max(0.f, color.z), 1.f) + 0.5f);
+  return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
@@ -0,0 +1,94 @@
+//=============================================================================
+// ShadingPass.cpp - SIMD direct lighting over a tile's hits, and 8 bit resolve
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+#include "ToneMapping.h"
+
+void CPURaytracer::QueueDirectShading(int block_x, int block_y, const hit* h, shade_batch* batch) const
+{
+  int i = batch->count++;
+  batch->block_x[i] = block_x;
+  batch->block_y[i] = block_y;
+
+  if (!h)
+  {
+    batch->hit_mask[i] = 0;
+    batch->nx[i] = batch->ny[i] = batch->nz[i] = 0.f;
+    batch->r[i] = batch->g[i] = batch->b[i] = 0.f;
+    return;
+  }
+
+  const RZVector3& albedo = GetTriangleMaterial(h->triangle).Albedo;
+  batch->hit_mask[i] = 0xFFFFFFFF;
+  batch->nx[i] = h->normal.x;
+  batch->ny[i] = h->normal.y;
+  batch->nz[i] = h->normal.z;
+  batch->r[i] = albedo.x;
+  batch->g[i] = albedo.y;
+  batch->b[i] = albedo.z;
+}
+
+void CPURaytracer::ShadeDirectBatch(const tile& tile, shade_batch* batch)
+{
+  // The last group may run past count into stale entries. They're never accumulated
+  kernels_->shade_direct(batch->count, batch->hit_mask.data(), batch->nx.data(), batch->ny.data(), batch->nz.data(),
+    batch->r.data(), batch->g.data(), batch->b.data(), light_dir, background);
+
+  for (int i = 0; i < batch->count; ++i)
+  {
+    AccumulateBlock(tile, batch->block_x[i], batch->block_y[i], RZVector3{ batch->r[i], batch->g[i], batch->b[i] });
+  }
+  batch->count = 0;
+}
+
+void CPURaytracer::ResolvePackedRow(uint8_t* row, RZPixelFormat format, int y, int width, int height) const
+{
+  // Scaling up takes the nearest rendered pixel
+  int src_y = y * height_ / height;
+  const tile* tile_row = &tiles_[(src_y / TileSize) * tiles_x_];
+  const RZVector3* src_row = &accum_[src_y * width_];
+  __m128 dither = dither_ ? GetDitherOffsets(y) : _mm_setzero_ps();
+
+  // Whole groups of 4 bypass the cache when the row allows aligned stores. Nothing
+  // reads the target back before it's presented or handed to the caller
+  uint32_t* out = (uint32_t*)row;
+  bool aligned = ((uintptr_t)row & 15) == 0;
+
+  for (int x = 0; x < width; x += 4)
+  {
+    // Gather into lanes, averaging the samples. A partial group repeats the last pixel
+    float r[4], g[4], b[4];
+    for (int i = 0; i < 4; ++i)
+    {
+      int src_x = std::min(x + i, width - 1) * width_ / width;
+      uint32_t sample_count = tile_row[src_x / TileSize].sample_count;
+      float inv_count = sample_count > 0 ? 1.f / sample_count : 0.f;
+      r[i] = src_row[src_x].x * inv_count;
+      g[i] = src_row[src_x].y * inv_count;
+      b[i] = src_row[src_x].z * inv_count;
+    }
+
+    __m128i c = PackColors(_mm_loadu_ps(r), _mm_loadu_ps(g), _mm_loadu_ps(b), tone_map_, dither);
+    if (format == RZPixelFormat_RGBA8)
+    {
+      c = SwapRedBlue(c);
+    }
+
+    if (x + 4 > width)
+    {
+      uint32_t tail[4];
+      _mm_storeu_si128((__m128i*)tail, c);
+      memcpy(out + x, tail, (width - x) * sizeof(uint32_t));
+    }
+    else if (aligned)
+    {
+      _mm_stream_si128((__m128i*)(out + x), c);
+    }
+    else
+    {
+      _mm_storeu_si128((__m128i*)(out + x), c);
+    }
+  }
+}
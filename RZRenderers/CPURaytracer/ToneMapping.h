@@ -0,0 +1,120 @@
+//=============================================================================
+// ToneMapping.h - SSE2 tone mapping and 8 bit packing, four colors at a time
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "Shading.h"
+#include "Math/Simd.h"
+
+// log2 of x > 0. Exponent from the bits, plus a polynomial in the mantissa
+// (Fonseca's fit, error around 5e-5)
+inline __m128 Log2(__m128 x)
+{
+  __m128i bits = _mm_castps_si128(x);
+  __m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+  __m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF))), _mm_set1_ps(1.f));
+
+  __m128 p = _mm_set1_ps(0.0596515482674574969533f);
+  p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-0.465725644288844778798f));
+  p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.48116647521213171641f));
+  p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.52074962577807006663f));
+  p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.8882704548164776201f));
+
+  // Multiplying by (m - 1) keeps log2(1) exactly 0
+  return _mm_add_ps(_mm_mul_ps(p, _mm_sub_ps(m, _mm_set1_ps(1.f))), exponent);
+}
+
+// 2^x for x <= 0. Integer part into the exponent, polynomial for the fraction
+inline __m128 Exp2(__m128 x)
+{
+  x = _mm_max_ps(x, _mm_set1_ps(-126.f));
+  __m128i ipart = _mm_cvtps_epi32(_mm_sub_ps(x, _mm_set1_ps(0.5f)));  // floor
+  __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(ipart));
+  __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ipart, _mm_set1_epi32(127)), 23));
+
+  __m128 p = _mm_set1_ps(1.8775767e-3f);
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+  p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+  return _mm_mul_ps(p, scale);
+}
+
+// Linear [0, 1] to sRGB
+inline __m128 EncodeSRGB(__m128 x)
+{
+  __m128 power = Exp2(_mm_mul_ps(Log2(_mm_max_ps(x, _mm_set1_ps(1e-10f))), _mm_set1_ps(1.f / 2.4f)));
+  __m128 curve = _mm_sub_ps(_mm_mul_ps(power, _mm_set1_ps(1.055f)), _mm_set1_ps(0.055f));
+  __m128 linear = _mm_mul_ps(x, _mm_set1_ps(12.92f));
+  return Select(_mm_cmple_ps(x, _mm_set1_ps(0.0031308f)), linear, curve);
+}
+
+// (x (2.51 x + 0.03)) / (x (2.43 x + 0.59) + 0.14), for x >= 0
+inline __m128 ToneMapACES(__m128 x)
+{
+  __m128 n = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+  __m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+  return _mm_div_ps(n, d);
+}
+
+// Map linear colors into [0, 1] display values
+inline __m128 ToneMap(__m128 x, RZToneMap tone_map)
+{
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.f);
+  x = _mm_max_ps(x, zero);
+  if (tone_map == RZToneMap_ACES)
+  {
+    x = ToneMapACES(x);
+  }
+  x = _mm_min_ps(x, one);
+  return (tone_map == RZToneMap_Linear) ? x : EncodeSRGB(x);
+}
+
+// Ordered dithering: offsets (in 8 bit steps) from a 4x4 Bayer matrix, for the four
+// pixels of row y starting at a multiple of 4
+inline __m128 GetDitherOffsets(int y)
+{
+  static const float bayer[4][4] =
+  {
+    { 0.f, 8.f, 2.f, 10.f },
+    { 12.f, 4.f, 14.f, 6.f },
+    { 3.f, 11.f, 1.f, 9.f },
+    { 15.f, 7.f, 13.f, 5.f },
+  };
+
+  __m128 b = _mm_loadu_ps(bayer[y & 3]);
+  return _mm_sub_ps(_mm_mul_ps(_mm_add_ps(b, _mm_set1_ps(0.5f)), _mm_set1_ps(1.f / 16.f)), _mm_set1_ps(0.5f));
+}
+
+// Tone map and pack linear colors to 0xAARRGGBB, rounding to nearest (plus dither)
+inline __m128i PackColors(__m128 r, __m128 g, __m128 b, RZToneMap tone_map, __m128 dither)
+{
+  __m128 scale = _mm_set1_ps(255.f);
+  __m128 bias = _mm_add_ps(_mm_set1_ps(0.5f), dither);
+  __m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(ToneMap(r, tone_map), scale), bias));
+  __m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(ToneMap(g, tone_map), scale), bias));
+  __m128i bi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(ToneMap(b, tone_map), scale), bias));
+
+  __m128i c = _mm_or_si128(_mm_slli_epi32(ri, 16), _mm_slli_epi32(gi, 8));
+  return _mm_or_si128(_mm_or_si128(c, bi), _mm_set1_epi32((int)0xFF000000));
+}
+
+// 0xAARRGGBB to 0xAABBGGRR
+inline __m128i SwapRedBlue(__m128i c)
+{
+  __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i ag = _mm_andnot_si128(_mm_or_si128(mask, _mm_slli_epi32(mask, 16)), c);
+  __m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), mask);
+  __m128i b = _mm_slli_epi32(_mm_and_si128(c, mask), 16);
+  return _mm_or_si128(ag, _mm_or_si128(r, b));
+}
+
+// A single color, for flat shaded outputs
+inline uint32_t ToneMapColor(const RZVector3& color, RZToneMap tone_map)
+{
+  __m128i c = PackColors(_mm_set1_ps(color.x), _mm_set1_ps(color.y), _mm_set1_ps(color.z), tone_map, _mm_setzero_ps());
+  return (uint32_t)_mm_cvtsi128_si32(c);
+}
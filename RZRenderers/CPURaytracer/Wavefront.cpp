@@ -0,0 +1,479 @@
+//=============================================================================
+// Wavefront.cpp - Wavefront (ray stream) path tracing for the CPU raytracer
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "CPURaytracer.h"
+#include "Shading.h"
+
+// Spread the low 5 bits of v so there are 2 zero bits between each
+static uint32_t SpreadBits(uint32_t v)
+{
+  v &= 0x1F;
+  v = (v | (v << 8)) & 0x100F;
+  v = (v | (v << 4)) & 0x10C3;
+  v = (v | (v << 2)) & 0x1249;
+  return v;
+}
+
+void CPURaytracer::ray_queue::Resize(int size)
+{
+  ox.resize(size); oy.resize(size); oz.resize(size);
+  dx.resize(size); dy.resize(size); dz.resize(size);
+  wr.resize(size); wg.resize(size); wb.resize(size);
+  pixel.resize(size);
+  dist.resize(size);
+  triangle.resize(size);
+}
+
+void CPURaytracer::ray_queue::Set(int i, const RZVector3& origin, const RZVector3& dir, const RZVector3& weight, uint32_t pixel_index)
+{
+  ox[i] = origin.x; oy[i] = origin.y; oz[i] = origin.z;
+  dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+  wr[i] = weight.x; wg[i] = weight.y; wb[i] = weight.z;
+  pixel[i] = pixel_index;
+}
+
+void CPURaytracer::ray_queue::Copy(int to, const ray_queue& src, int from)
+{
+  ox[to] = src.ox[from]; oy[to] = src.oy[from]; oz[to] = src.oz[from];
+  dx[to] = src.dx[from]; dy[to] = src.dy[from]; dz[to] = src.dz[from];
+  wr[to] = src.wr[from]; wg[to] = src.wg[from]; wb[to] = src.wb[from];
+  pixel[to] = src.pixel[from];
+  dist[to] = src.dist[from];
+  triangle[to] = src.triangle[from];
+}
+
+void CPURaytracer::RenderPassWavefront(const RZVector3& viewer_position, const int* active_tiles, int num_active)
+{
+  ++wavefront_pass_;
+
+  WavefrontGenerate(viewer_position, active_tiles, num_active);
+
+  for (uint32_t depth = 0; path_queue_.Size() > 0; ++depth)
+  {
+    // Camera rays share an origin and are generated in tile order, so they're
+    // already coherent. Bounced rays are scattered and need regrouping.
+    if (depth > 0)
+    {
+      WavefrontSort(path_queue_);
+    }
+
+    WavefrontExtend(path_queue_, depth == 0);
+    WavefrontShade(depth);
+    WavefrontConnect();
+
+    std::swap(path_queue_, next_queue_);
+  }
+
+  // Every block got exactly one path. Add them to the accumulation buffers
+  thread_pool_.ParallelFor(num_active, [&](int index, int)
+  {
+    tile& t = tiles_[active_tiles[index]];
+    for (int block_y = t.y0; block_y < t.y1; block_y += t.rate)
+    {
+      for (int block_x = t.x0; block_x < t.x1; block_x += t.rate)
+      {
+        int x, y;
+        float jitter_x, jitter_y;
+        GetBlockSample(t, block_x, block_y, &x, &y, &jitter_x, &jitter_y);
+        AccumulateBlock(t, block_x, block_y, path_radiance_[y * width_ + x]);
+      }
+    }
+    ++t.sample_count;
+  });
+}
+
+void CPURaytracer::WavefrontGenerate(const RZVector3& viewer_position, const int* active_tiles, int num_active)
+{
+  // Find where each tile's rays go in the queue
+  int* tile_ray_offsets = scratch_.Allocate<int>(num_active);
+  int count = 0;
+  for (int i = 0; i < num_active; ++i)
+  {
+    const tile& t = tiles_[active_tiles[i]];
+    tile_ray_offsets[i] = count;
+    count += (int)GetTileBlockCount(t);
+  }
+
+  path_queue_.Resize(count);
+
+  thread_pool_.ParallelFor(num_active, [&](int index, int)
+  {
+    const tile& t = tiles_[active_tiles[index]];
+
+    // Rays are tagged with the pixel their sample falls in, one per block
+    int i = tile_ray_offsets[index];
+    for (int block_y = t.y0; block_y < t.y1; block_y += t.rate)
+    {
+      for (int block_x = t.x0; block_x < t.x1; block_x += t.rate, ++i)
+      {
+        int x, y;
+        float jitter_x, jitter_y;
+        GetBlockSample(t, block_x, block_y, &x, &y, &jitter_x, &jitter_y);
+
+        RZVector3 dir{ x + jitter_x - half_width_, half_height_ - (y + jitter_y), dist_to_plane_ };
+        dir.Normalize();
+
+        uint32_t pixel = y * width_ + x;
+        path_queue_.Set(i, viewer_position, dir, RZVector3{ 1.f, 1.f, 1.f }, pixel);
+        path_radiance_[pixel] = RZVector3{};
+      }
+    }
+  });
+}
+
+void CPURaytracer::WavefrontSort(ray_queue& queue)
+{
+  int count = queue.Size();
+  sort_keys_.resize(count);
+
+  RZVector3 extent = scene_max_ - scene_min_;
+  RZVector3 scale{
+    extent.x > 0.f ? 31.f / extent.x : 0.f,
+    extent.y > 0.f ? 31.f / extent.y : 0.f,
+    extent.z > 0.f ? 31.f / extent.z : 0.f };
+
+  // Key is octant (3 bits), then 15 bit Morton code of the origin within the scene
+  // bounds, then the ray's current index so the order is deterministic
+  thread_pool_.ParallelFor((count + WavefrontChunkSize - 1) / WavefrontChunkSize, [&](int chunk, int)
+  {
+    int end = std::min(count, (chunk + 1) * WavefrontChunkSize);
+    for (int i = chunk * WavefrontChunkSize; i < end; ++i)
+    {
+      uint32_t octant = (queue.dx[i] < 0.f ? 1 : 0) | (queue.dy[i] < 0.f ? 2 : 0) | (queue.dz[i] < 0.f ? 4 : 0);
+      uint32_t qx = (uint32_t)std::min(std::max((queue.ox[i] - scene_min_.x) * scale.x, 0.f), 31.f);
+      uint32_t qy = (uint32_t)std::min(std::max((queue.oy[i] - scene_min_.y) * scale.y, 0.f), 31.f);
+      uint32_t qz = (uint32_t)std::min(std::max((queue.oz[i] - scene_min_.z) * scale.z, 0.f), 31.f);
+      uint32_t morton = SpreadBits(qx) | (SpreadBits(qy) << 1) | (SpreadBits(qz) << 2);
+      sort_keys_[i] = ((uint64_t)((octant << 15) | morton) << 32) | (uint32_t)i;
+    }
+  });
+
+  std::sort(sort_keys_.begin(), sort_keys_.end());
+
+  sort_queue_.Resize(count);
+  for (int i = 0; i < count; ++i)
+  {
+    sort_queue_.Copy(i, queue, (int)(sort_keys_[i] & 0xFFFFFFFF));
+  }
+
+  std::swap(queue, sort_queue_);
+}
+
+template<typename Trace>
+void CPURaytracer::RetryDeferredRays(int count, Trace&& trace)
+{
+  int* deferred = scratch_.Allocate<int>(count);
+  for (;;)
+  {
+    int num_deferred = 0;
+    for (int i = 0; i < count; ++i)
+    {
+      if (deferred_rays_[i])
+      {
+        deferred[num_deferred++] = i;
+      }
+    }
+    if (num_deferred == 0)
+    {
+      break;
+    }
+
+    // Every page they missed was requested as they were traced. They stay in until
+    // the next pass, and a retrace only visits leaves the first one did
+    page_cache_.WaitForRequests();
+
+    thread_pool_.ParallelFor((num_deferred + WavefrontChunkSize - 1) / WavefrontChunkSize, [&](int chunk, int thread_index)
+    {
+      thread_context& context = thread_contexts_[thread_index];
+      LARGE_INTEGER start, end;
+      QueryPerformanceCounter(&start);
+
+      int chunk_end = std::min(num_deferred, (chunk + 1) * WavefrontChunkSize);
+      for (int j = chunk * WavefrontChunkSize; j < chunk_end; ++j)
+      {
+        bool again;
+        trace(deferred[j], &again);
+        deferred_rays_[deferred[j]] = again;
+      }
+
+      QueryPerformanceCounter(&end);
+      context.deferred_rays += chunk_end - chunk * WavefrontChunkSize;
+      context.secondary_ticks += end.QuadPart - start.QuadPart;
+    });
+  }
+}
+
+void CPURaytracer::WavefrontExtend(ray_queue& queue, bool primary)
+{
+  int count = queue.Size();
+
+  // Out of core, bounce rays don't wait for pages. Camera rays are coherent enough
+  // that they'd all wait on the same few anyway
+  bool defer = !primary && out_of_core_;
+  if (defer)
+  {
+    deferred_rays_.assign(count, 0);
+  }
+
+  thread_pool_.ParallelFor((count + WavefrontChunkSize - 1) / WavefrontChunkSize, [&](int chunk, int thread_index)
+  {
+    thread_context& context = thread_contexts_[thread_index];
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    int chunk_end = std::min(count, (chunk + 1) * WavefrontChunkSize);
+    if (primary)
+    {
+      for (int i = chunk * WavefrontChunkSize; i < chunk_end; ++i)
+      {
+        // The sample's pixel identifies its block, which gives back the subpixel offset
+        int x = queue.pixel[i] % width_;
+        int y = queue.pixel[i] / width_;
+        const tile& t = tiles_[(y / TileSize) * tiles_x_ + x / TileSize];
+        int block_x = t.x0 + (x - t.x0) / t.rate * t.rate;
+        int block_y = t.y0 + (y - t.y0) / t.rate * t.rate;
+        float jitter_x, jitter_y;
+        GetBlockSample(t, block_x, block_y, &x, &y, &jitter_x, &jitter_y);
+
+        hit h;
+        bool found_hit = FindPrimaryHit(x, y, jitter_x, jitter_y, queue.Origin(i), queue.Dir(i), context, &h);
+        if (t.sample_count == 0)
+        {
+          RecordPrimaryHit(t, block_x, block_y, queue.Origin(i), queue.Dir(i), found_hit ? &h : nullptr);
+        }
+        SetQueueHit(queue, i, found_hit ? &h : nullptr);
+      }
+    }
+    else
+    {
+      // Sorted neighbours mostly take the same way down the tree, so they go down it
+      // together
+      for (int i = chunk * WavefrontChunkSize; i < chunk_end; i += RayPacketQuery::MaxRays)
+      {
+        int num_rays = std::min(RayPacketQuery::MaxRays, chunk_end - i);
+        RZVector3 starts[RayPacketQuery::MaxRays], dirs[RayPacketQuery::MaxRays];
+        for (int j = 0; j < num_rays; ++j)
+        {
+          starts[j] = queue.Origin(i + j);
+          dirs[j] = queue.Dir(i + j);
+        }
+
+        hit hits[RayPacketQuery::MaxRays];
+        bool deferred[RayPacketQuery::MaxRays];
+        int found = IntersectPacket(starts, dirs, num_rays, hits, defer ? deferred : nullptr);
+        for (int j = 0; j < num_rays; ++j)
+        {
+          if (defer)
+          {
+            deferred_rays_[i + j] = deferred[j];
+            if (deferred[j])
+            {
+              continue;
+            }
+          }
+          SetQueueHit(queue, i + j, (found & (1 << j)) ? &hits[j] : nullptr);
+        }
+      }
+    }
+
+    QueryPerformanceCounter(&end);
+    int rays = chunk_end - chunk * WavefrontChunkSize;
+    if (primary)
+    {
+      context.primary_rays += rays;
+      context.primary_ticks += end.QuadPart - start.QuadPart;
+    }
+    else
+    {
+      context.secondary_rays += rays;
+      context.secondary_ticks += end.QuadPart - start.QuadPart;
+    }
+  });
+
+  if (defer)
+  {
+    RetryDeferredRays(count, [&](int i, bool* out_deferred)
+    {
+      hit h;
+      bool found_hit = Intersect(queue.Origin(i), queue.Dir(i), &h, out_deferred);
+      SetQueueHit(queue, i, found_hit ? &h : nullptr);
+    });
+  }
+}
+
+void CPURaytracer::SetQueueHit(ray_queue& queue, int i, const hit* h)
+{
+  if (h)
+  {
+    queue.dist[i] = h->dist;
+    queue.triangle[i] = h->triangle;
+  }
+  else
+  {
+    queue.triangle[i] = NoHit;
+  }
+}
+
+void CPURaytracer::WavefrontShade(uint32_t depth)
+{
+  int count = path_queue_.Size();
+  next_queue_.Resize(count);
+  shadow_queue_.Resize(count);
+  path_alive_.resize(count);
+  shadow_alive_.resize(count);
+
+  thread_pool_.ParallelFor((count + WavefrontChunkSize - 1) / WavefrontChunkSize, [&](int chunk, int thread_index)
+  {
+    Random& random = thread_contexts_[thread_index].random;
+    // A stream per chunk & depth. chunk is positive, so the stream's top bit (which
+    // Seed drops) is never set
+    random.Seed(wavefront_pass_, ((uint64_t)chunk << 32) | depth);
+
+    int chunk_end = std::min(count, (chunk + 1) * WavefrontChunkSize);
+    for (int i = chunk * WavefrontChunkSize; i < chunk_end; ++i)
+    {
+      path_alive_[i] = 0;
+      shadow_alive_[i] = 0;
+
+      uint32_t pixel = path_queue_.pixel[i];
+      RZVector3 throughput = path_queue_.Weight(i);
+
+      if (path_queue_.triangle[i] == NoHit)
+      {
+        // Escaped to the sky. The directional light is only reached through shadow rays
+        path_radiance_[pixel] += Modulate(throughput, background);
+        continue;
+      }
+
+      RZVector3 normal = GetTriangleNormal(path_queue_.triangle[i]);
+      const RZMaterial& material = GetTriangleMaterial(path_queue_.triangle[i]);
+      float dist = path_queue_.dist[i];
+      RZVector3 dir = path_queue_.Dir(i);
+      RZVector3 position = path_queue_.Origin(i) + dir * dist + normal * (ray_epsilon * std::max(1.f, dist));
+      float diffuse = 1.f - material.Specular;
+
+      // Next event estimation, resolved in the connect stage
+      float n_dot_l = RZVector3::Dot(normal, light_dir);
+      if (diffuse > 0.f && n_dot_l > 0.f)
+      {
+        RZVector3 contribution = Modulate(throughput, material.Albedo) * (diffuse * n_dot_l * light_irradiance / Pi);
+        shadow_queue_.Set(i, position, light_dir, contribution, pixel);
+        shadow_alive_[i] = 1;
+      }
+
+      if (depth + 1 >= max_path_depth_)
+      {
+        continue;
+      }
+
+      if (random.NextFloat() < material.Specular)
+      {
+        dir = Reflect(dir, normal);
+      }
+      else
+      {
+        dir = CosineSampleHemisphere(normal, random.NextFloat(), random.NextFloat());
+        throughput = Modulate(throughput, material.Albedo);
+      }
+
+      if (depth + 1 >= RouletteStartDepth)
+      {
+        float survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.95f);
+        if (random.NextFloat() >= survival)
+        {
+          continue;
+        }
+        throughput /= survival;
+      }
+
+      next_queue_.Set(i, position, dir, throughput, pixel);
+      path_alive_[i] = 1;
+    }
+  });
+
+  CompactQueue(next_queue_, path_alive_);
+  CompactQueue(shadow_queue_, shadow_alive_);
+}
+
+void CPURaytracer::WavefrontConnect()
+{
+  int count = shadow_queue_.Size();
+  if (out_of_core_)
+  {
+    deferred_rays_.assign(count, 0);
+  }
+
+  thread_pool_.ParallelFor((count + WavefrontChunkSize - 1) / WavefrontChunkSize, [&](int chunk, int thread_index)
+  {
+    thread_context& context = thread_contexts_[thread_index];
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    // A pixel has at most one shadow ray per bounce, so there are no conflicting writes.
+    // The rays share the light's direction, and go down the tree in packets
+    int chunk_end = std::min(count, (chunk + 1) * WavefrontChunkSize);
+    for (int i = chunk * WavefrontChunkSize; i < chunk_end; i += RayPacketQuery::MaxRays)
+    {
+      int num_rays = std::min(RayPacketQuery::MaxRays, chunk_end - i);
+      RZVector3 starts[RayPacketQuery::MaxRays], dirs[RayPacketQuery::MaxRays];
+      for (int j = 0; j < num_rays; ++j)
+      {
+        starts[j] = shadow_queue_.Origin(i + j);
+        dirs[j] = shadow_queue_.Dir(i + j);
+      }
+
+      bool deferred[RayPacketQuery::MaxRays];
+      int occluded = OccludedPacket(starts, dirs, num_rays, out_of_core_ ? deferred : nullptr);
+      for (int j = 0; j < num_rays; ++j)
+      {
+        if (occluded & (1 << j))
+        {
+          continue;
+        }
+
+        if (out_of_core_ && deferred[j])
+        {
+          deferred_rays_[i + j] = 1;
+        }
+        else
+        {
+          path_radiance_[shadow_queue_.pixel[i + j]] += shadow_queue_.Weight(i + j);
+        }
+      }
+    }
+
+    QueryPerformanceCounter(&end);
+    context.secondary_rays += chunk_end - chunk * WavefrontChunkSize;
+    context.secondary_ticks += end.QuadPart - start.QuadPart;
+  });
+
+  if (out_of_core_)
+  {
+    RetryDeferredRays(count, [&](int i, bool* out_deferred)
+    {
+      if (!Occluded(shadow_queue_.Origin(i), shadow_queue_.Dir(i), FLT_MAX, out_deferred) && !*out_deferred)
+      {
+        path_radiance_[shadow_queue_.pixel[i]] += shadow_queue_.Weight(i);
+      }
+    });
+  }
+}
+
+void CPURaytracer::CompactQueue(ray_queue& queue, const std::vector<uint8_t>& alive)
+{
+  int count = 0;
+  for (int i = 0; i < queue.Size(); ++i)
+  {
+    if (alive[i])
+    {
+      if (count != i)
+      {
+        queue.Copy(count, queue, i);
+      }
+      ++count;
+    }
+  }
+  queue.Resize(count);
+}
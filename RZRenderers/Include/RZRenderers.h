@@ -22,17 +22,174 @@ typedef struct
 typedef enum
 {
   RZRenderer_CPURaytracer = 0,
+  RZRenderer_CPURasterizer = 1,
   RZRenderer_Force32Bits = 0xFFFFFFFF,
 } RZRendererType;
 
+typedef enum
+{
+  RZIntegrator_Direct = 0,            // Primary visibility, shaded by a single directional light
+  RZIntegrator_PathTrace = 1,         // Monte Carlo path tracing with next event estimation
+  RZIntegrator_AmbientOcclusion = 2,  // Primary visibility, shaded by short range occlusion
+  RZIntegrator_Force32Bits = 0xFFFFFFFF,
+} RZIntegrator;
+
+typedef enum
+{
+  RZRenderFlag_None = 0x0,
+  RZRenderFlag_Progressive = 0x1, // Accumulate jittered samples while the camera is static
+  RZRenderFlag_Adaptive = 0x2,    // Only spend extra samples on tiles with edges or noise
+  RZRenderFlag_Wavefront = 0x4,   // PathTrace: trace in coherent, sorted batches of rays
+  RZRenderFlag_Hybrid = 0x8,      // CPURaytracer: rasterize primary visibility, trace only the secondary rays
+  RZRenderFlag_Reproject = 0x10,  // CPURaytracer: reuse last frame's primary hits when the camera moves
+  RZRenderFlag_Dither = 0x20,     // CPURaytracer: ordered dithering when quantizing to 8 bit colors
+  RZRenderFlag_CompactGeometry = 0x40, // CPURaytracer: 16 bit positions, no per triangle edges or normals. Less memory, slower tracing
+  RZRenderFlag_HalfNormals = 0x80,     // CompactGeometry: keep 16 bit float normals rather than recomputing them when shading
+  RZRenderFlag_LevelOfDetail = 0x100,  // CPURaytracer: trace distant meshes against simplified versions, made as they're added. Not with Hybrid
+} RZRenderFlags;
+
+// How linear colors become 8 bit colors. Floating point outputs are always linear
+typedef enum
+{
+  RZToneMap_Linear = 0,   // Clamp to [0, 1]
+  RZToneMap_sRGB = 1,     // Clamp to [0, 1], then sRGB encode
+  RZToneMap_ACES = 2,     // ACES filmic curve (Narkowicz's fit), then sRGB encode
+  RZToneMap_Force32Bits = 0xFFFFFFFF,
+} RZToneMap;
+
+// CPU instruction sets the CPURaytracer has kernels for. A set the CPU can't run
+// falls back to the best one it can
+typedef enum
+{
+  RZInstructionSet_Auto = 0,    // Best the CPU supports, unless the RZ_INSTRUCTION_SET environment variable
+                                // (sse2, sse4.2 or avx2) says otherwise
+  RZInstructionSet_SSE2 = 1,
+  RZInstructionSet_SSE42 = 2,   // Runs (and reports) the SSE2 kernels, which it has nothing over
+  RZInstructionSet_AVX2 = 3,
+  RZInstructionSet_Force32Bits = 0xFFFFFFFF,
+} RZInstructionSet;
+
+typedef enum
+{
+  RZPixelFormat_BGRA8 = 0,            // 0xAARRGGBB, same as the window's framebuffer
+  RZPixelFormat_RGBA8 = 1,            // 0xAABBGGRR
+  RZPixelFormat_RGBA16F = 2,          // Linear, unclamped color, alpha 1
+  RZPixelFormat_RGBA32F = 3,          // Linear, unclamped color, alpha 1
+  RZPixelFormat_Depth32F = 4,         // View space depth of the surface at the pixel center, FLT_MAX if none
+  RZPixelFormat_PrimitiveID = 5,      // uint32_t index of that surface's triangle (in the order added), 0xFFFFFFFF if none
+  RZPixelFormat_Force32Bits = 0xFFFFFFFF,
+} RZPixelFormat;
+
 typedef struct
 {
-  void* WindowHandle;
-  int32_t RenderWidth;  // Can be different than window's client area
-  int32_t RenderHeight; // Can be different than window's client area
-  float HorizFOV;       // Horizontal field of view angle, in radians
+  void* Pixels;                 // RenderWidth x RenderHeight pixels, top row first
+  uint32_t RowPitch;            // Bytes from the start of one row to the next
+  RZPixelFormat Format;
+} RZRenderTarget;
+
+typedef enum
+{
+  RZAov_None = 0x0,
+  RZAov_Depth = 0x1,            // View space depth, FLT_MAX where nothing was hit
+  RZAov_Normal = 0x2,           // World space geometric normal, 0 where nothing was hit
+  RZAov_PrimitiveID = 0x4,      // Triangle index, in the order added, 0xFFFFFFFF where nothing was hit
+  RZAov_MeshID = 0x8,           // Index of the AddMesh call, 0xFFFFFFFF where nothing was hit
+  RZAov_Barycentrics = 0x10,    // Weights of the triangle's 2nd & 3rd vertices, 0 where nothing was hit.
+                                // Hits on simplified meshes (LevelOfDetail) get the triangle's closest point
+  RZAov_Position = 0x20,        // World space hit position, 0 where nothing was hit
+} RZAovFlags;
+
+// Auxiliary outputs for the surface at each pixel center, one plane per component.
+// Every plane is RenderWidth x RenderHeight values, top row first
+typedef struct
+{
+  uint32_t Mask;                // Combination of RZAovFlags to write. Planes of the others can be null
+  uint32_t RowPitch;            // Bytes from the start of one row to the next, in every plane
+  float* Depth;
+  float* Normal[3];             // x, y, z
+  uint32_t* PrimitiveID;
+  uint32_t* MeshID;
+  float* Barycentrics[2];
+  float* Position[3];           // x, y, z
+} RZAovTarget;
+
+typedef struct
+{
+  void* WindowHandle;           // Can be null if only rendering to RZRenderTargets
+  int32_t RenderWidth;          // Can be different than window's client area
+  int32_t RenderHeight;         // Can be different than window's client area
+  float HorizFOV;               // Horizontal field of view angle, in radians
+  uint32_t Flags;               // Combination of RZRenderFlags
+  uint32_t MaxSamplesPerPixel;  // Progressive: stop refining after this many, 0 means no limit
+  uint32_t MaxSamplesPerFrame;  // Progressive: samples per pixel added per RenderScene, 0 means 1
+  float FrameTimeBudget;        // Progressive: milliseconds per RenderScene, 0 means no limit
+  float AdaptiveThreshold;      // Adaptive: tolerated luminance contrast/error, 0 means default
+  RZIntegrator Integrator;
+  uint32_t MaxPathDepth;        // PathTrace: maximum number of bounces, 0 means default
+  uint32_t NumThreads;          // Render threads, 0 means one per hardware thread
+  uint32_t AORayCount;          // AmbientOcclusion: occlusion rays per hit, 0 means default
+  float AODistance;             // AmbientOcclusion: occlusion range, 0 means a tenth of the scene size
+  float TargetFrameTime;        // CPURaytracer: lower the resolution while moving to hold this many milliseconds, 0 disables
+  float MinResolutionScale;     // TargetFrameTime: smallest fraction of RenderWidth/Height to use, 0 means default
+  uint32_t NumFrameBuffers;     // BeginRender: frames in flight, 2 for double & 3 for triple buffering, 0 means 2
+  uint32_t Aovs;                // RZAovFlags that GetAovs can return, besides depth & primitive ID which always can
+  RZToneMap ToneMap;
+  RZInstructionSet InstructionSet;  // CPURaytracer: kernels to use, Auto picks from the CPU
+  uint64_t GeometryMemoryBudget;  // CPURaytracer: bytes of geometry pages to keep in memory. Nonzero keeps the
+                                  // geometry in temporary files and implies CompactGeometry, 0 keeps it all in memory
 } RZRendererCreateParams;
 
+typedef struct
+{
+  RZVector3 Albedo;             // Diffuse reflectance
+  float Specular;               // Fraction of light reflected as a perfect mirror, [0, 1]
+} RZMaterial;
+
+typedef struct
+{
+  uint32_t SamplesPerPixel;     // Samples accumulated in the presented image
+  uint32_t FrameSamples;        // Sample passes made by the last RenderScene
+                                // (last frame finished rendering, when using BeginRender)
+  uint64_t PrimaryRays;         // Primary rays (samples) traced by the last RenderScene
+  uint32_t ActiveTiles;         // Tiles still being refined after the last RenderScene
+  uint64_t SecondaryRays;       // Bounce and shadow rays traced by the last RenderScene
+  float PrimaryRayRate;         // Millions of primary rays per second, per thread
+  float SecondaryRayRate;       // Millions of secondary rays per second, per thread
+  uint32_t VisibleTriangles;    // Rasterizer & hybrid: triangles left after culling & clipping,
+                                // else triangles in boxes that intersect the view frustum
+  float FrameTime;              // Milliseconds spent rendering the last frame, not including presenting it
+  float RetraceFraction;        // Reproject: fraction of pixel center hits that had to be traced
+  float ResolutionScale;        // TargetFrameTime: fraction of RenderWidth/Height rendered in the last frame
+  RZInstructionSet InstructionSet;  // Kernels in use. The rasterizer only uses SSE2
+  uint32_t ScratchAllocations;  // Heap allocations for scratch memory by the last frame, 0 once warmed up
+  float GeometryBytesPerTriangle;  // Vertices, triangles & acceleration structures, per triangle
+  uint32_t GeometryPagesLoaded; // GeometryMemoryBudget: geometry pages read in by the last frame
+  uint64_t DeferredRays;        // GeometryMemoryBudget: wavefront rays put off until their pages were read in
+  uint32_t SimplifiedMeshes;    // LevelOfDetail: meshes the last pass traced at a simplified level
+} RZRenderStats;
+
+typedef struct
+{
+  float CenterX;                // Normalized image position, [0, 1] left to right
+  float CenterY;                // Normalized image position, [0, 1] top to bottom
+  float Radius;                 // Full sample density within this distance, as a fraction of the image width
+  float Falloff;                // Density drops a level (to 1 ray per 2x2, then 4x4 pixels) every Falloff further out
+} RZRegionOfInterest;
+
+typedef struct
+{
+  float Distance;               // FLT_MAX if no triangle is within range
+  uint32_t PrimitiveID;         // Triangle index, in the order added, 0xFFFFFFFF if none
+  uint32_t MeshID;              // Mesh index, in the order added, 0xFFFFFFFF if none
+  float Barycentrics[2];        // Weights of the triangle's 2nd & 3rd vertices at Position
+  RZVector3 Position;           // Closest point on the triangle
+} RZSurfacePoint;
+
+typedef struct
+{
+  uint32_t PrimitiveID[2];      // Triangle indices, in the order added, from the first & second mesh
+} RZTrianglePair;
+
 struct __declspec(novtable) IRZRenderer
 {
   virtual void AddRef() = 0;
@@ -42,15 +199,149 @@ struct __declspec(novtable) IRZRenderer
     uint32_t num_vertices,
     const RZVector3* positions) = 0;
 
+  // Material used by meshes added after this call
+  virtual void SetMaterial(
+    const RZMaterial& material) = 0;
+
   virtual void AddMesh(
     uint32_t num_indices,
     const uint32_t* indices) = 0;
 
+  // Trace at full density only near these regions, and at reduced density (filled
+  // in from fewer rays) elsewhere. No regions means full density everywhere
+  virtual void SetRegionsOfInterest(
+    uint32_t num_regions,
+    const RZRegionOfInterest* regions) = 0;
+
+  virtual void RenderScene(
+    const RZVector3& viewer_position,
+    const RZQuaternion& viewer_orientation) = 0;
+
+  // Same, but written straight into the caller's buffer instead of presented to the
+  // window. Progressive accumulation is shared with the window output
   virtual void RenderScene(
+    const RZVector3& viewer_position,
+    const RZQuaternion& viewer_orientation,
+    const RZRenderTarget& target) = 0;
+
+  // Queue a frame to be rendered & presented on background threads, and return a
+  // token for it. Rendering overlaps presenting the previous frame, and this blocks
+  // only while NumFrameBuffers frames are already in flight. Scene & region changes
+  // made afterwards apply from the next frame begun, not to frames in flight
+  virtual uint64_t BeginRender(
     const RZVector3& viewer_position,
     const RZQuaternion& viewer_orientation) = 0;
+
+  // Block until the frame has been presented
+  virtual void WaitFrame(
+    uint64_t frame) = 0;
+
+  // True once the frame has been presented
+  virtual bool TryGetFrame(
+    uint64_t frame) = 0;
+
+  virtual void GetStats(RZRenderStats* stats) = 0;
+
+  // Copy out the auxiliary outputs of the last frame rendered, as of the hits found
+  // by its samples (so unaffected by accumulation). Waits for frames in flight
+  virtual void GetAovs(const RZAovTarget& target) = 0;
+
+  // Meshes (numbered in the order they were added) with triangles possibly in view
+  // of a camera placed as for RenderScene. Writes up to max_meshes of them, in order,
+  // and returns how many there are in all. Waits for frames in flight. Like the
+  // renderers, this looks down +z and doesn't apply viewer_orientation yet
+  virtual uint32_t GetVisibleMeshes(
+    const RZVector3& viewer_position,
+    const RZQuaternion& viewer_orientation,
+    uint32_t max_meshes,
+    uint32_t* out_meshes) = 0;
+
+  // Closest point of any triangle to point, no further than max_distance (0 means no
+  // limit). Returns false if there's none. Waits for frames in flight
+  virtual bool FindNearestSurfacePoint(
+    const RZVector3& point,
+    float max_distance,
+    RZSurfacePoint* out_result) = 0;
+
+  // Same for many points, ie. a point cloud. Nearby points are searched one after
+  // another, each starting from the last one's answer, spread over the render threads
+  virtual void FindNearestSurfacePoints(
+    uint32_t num_points,
+    const RZVector3* points,
+    float max_distance,
+    RZSurfacePoint* out_results) = 0;
+
+  // Pairs of triangles, one from each of two different meshes (numbered in the order
+  // added), that intersect or touch, ie. for clash detection. Writes up to max_pairs
+  // of them and returns how many there are in all. With first_only, stops at the
+  // first pair found, which is any one of them. Waits for frames in flight
+  virtual uint32_t FindMeshOverlaps(
+    uint32_t mesh_a,
+    uint32_t mesh_b,
+    bool first_only,
+    uint32_t max_pairs,
+    RZTrianglePair* out_pairs) = 0;
 };
 
 bool __stdcall RZRendererCreate(RZRendererType type,
   const RZRendererCreateParams* params,
   IRZRenderer** out_renderer);
+
+typedef enum
+{
+  RZStreamFormat_PPM = 0,       // Binary 8 bit RGB PPM (P6) per frame, one after another
+  RZStreamFormat_PFM = 1,       // Linear float RGB PFM per frame, one after another
+  RZStreamFormat_Y4M = 2,       // YUV4MPEG2 video (4:2:0, full range), as read by most video encoders
+  RZStreamFormat_RawRGBA = 3,   // Tightly packed 8 bit RGBA frames, no headers
+  RZStreamFormat_Force32Bits = 0xFFFFFFFF,
+} RZStreamFormat;
+
+typedef enum
+{
+  RZStreamFlag_None = 0x0,
+  RZStreamFlag_DropWhenFull = 0x1,  // Drop frames rather than wait when the queue is full
+} RZStreamFlags;
+
+typedef struct
+{
+  const char* Path;             // File to create, or a named pipe (FIFO) an encoder reads from
+  RZStreamFormat Format;
+  int32_t Width;
+  int32_t Height;
+  uint32_t FrameRate;           // Y4M: frames per second, 0 means 30
+  uint32_t QueueLength;         // Frames waiting to be written before BeginFrame waits (or drops), 0 means 4
+  uint32_t Flags;               // Combination of RZStreamFlags
+} RZFrameStreamCreateParams;
+
+typedef struct
+{
+  uint64_t FramesWritten;
+  uint64_t FramesDropped;       // DropWhenFull: frames BeginFrame turned away
+  uint32_t QueuedFrames;        // Waiting to be written, or being written
+  bool WriteFailed;             // A write failed, the stream has stopped
+} RZFrameStreamStats;
+
+// Writes frames to a file or pipe from a background thread, so rendering doesn't
+// wait on the disk (or the encoder) until the queue fills up
+struct __declspec(novtable) IRZFrameStream
+{
+  virtual void AddRef() = 0;
+  virtual void Release() = 0;
+
+  // Get the next queue slot as a render target, for RenderScene to write straight
+  // into. Waits while the queue is full, or returns false if dropping frames
+  virtual bool BeginFrame(
+    RZRenderTarget* out_target) = 0;
+
+  // Queue the frame rendered since BeginFrame for writing
+  virtual void EndFrame() = 0;
+
+  // Wait for every queued frame to be written. Returns false if a write failed
+  virtual bool Flush() = 0;
+
+  virtual void GetStats(RZFrameStreamStats* stats) = 0;
+};
+
+bool __stdcall RZFrameStreamCreate(
+  const RZFrameStreamCreateParams* params,
+  IRZFrameStream** out_stream);
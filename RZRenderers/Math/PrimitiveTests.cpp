@@ -62,3 +62,348 @@ bool TestRayBox(const RZVector3& start, const RZVector3& dir, const RZVector3& m
     ry >= min.y && ry <= max.y &&
     rz >= min.z && rz <= max.z);
 }
+
+bool TestSegmentBox(const RZVector3& start, const RZVector3& inv_dir, float max_dist,
+  const RZVector3& min, const RZVector3& max, float* out_entry)
+{
+  // Slab test. Clipping against [0, max_dist] up front means a box that starts
+  // past the end of a short ray is rejected without further work
+  float t0 = (min.x - start.x) * inv_dir.x;
+  float t1 = (max.x - start.x) * inv_dir.x;
+  float tmin = std::min(t0, t1);
+  float tmax = std::max(t0, t1);
+
+  t0 = (min.y - start.y) * inv_dir.y;
+  t1 = (max.y - start.y) * inv_dir.y;
+  tmin = std::max(tmin, std::min(t0, t1));
+  tmax = std::min(tmax, std::max(t0, t1));
+
+  t0 = (min.z - start.z) * inv_dir.z;
+  t1 = (max.z - start.z) * inv_dir.z;
+  tmin = std::max(tmin, std::min(t0, t1));
+  tmax = std::min(tmax, std::max(t0, t1));
+
+  *out_entry = std::max(tmin, 0.f);
+  return tmax >= *out_entry && tmin <= max_dist;
+}
+
+bool TestBoxBox(const RZVector3& min1, const RZVector3& max1, const RZVector3& min2, const RZVector3& max2)
+{
+  return (min1.x <= max2.x && max1.x >= min2.x &&
+    min1.y <= max2.y && max1.y >= min2.y &&
+    min1.z <= max2.z && max1.z >= min2.z);
+}
+
+float DistanceSqPointBox(const RZVector3& point, const RZVector3& min, const RZVector3& max)
+{
+  // Per axis distance outside the slab, 0 within it
+  float dx = std::max(std::max(min.x - point.x, point.x - max.x), 0.f);
+  float dy = std::max(std::max(min.y - point.y, point.y - max.y), 0.f);
+  float dz = std::max(std::max(min.z - point.z, point.z - max.z), 0.f);
+  return dx * dx + dy * dy + dz * dz;
+}
+
+// Closest point of segment ab to p, as the weight of b
+static float ClosestOnSegment(const RZVector3& p, const RZVector3& a, const RZVector3& b)
+{
+  RZVector3 ab = b - a;
+  float len_sq = RZVector3::Dot(ab, ab);
+  if (len_sq <= 0.f)
+  {
+    return 0.f;
+  }
+  return std::min(std::max(RZVector3::Dot(p - a, ab) / len_sq, 0.f), 1.f);
+}
+
+float DistanceSqPointTriangle(const RZVector3& point, const RZVector3& a, const RZVector3& b, const RZVector3& c,
+  float* out_b, float* out_c)
+{
+  // Find the Voronoi region of the triangle the point projects into, as in Ericson's
+  // Real-Time Collision Detection (5.1.5). Vertex regions first
+  RZVector3 ab = b - a;
+  RZVector3 ac = c - a;
+  RZVector3 ap = point - a;
+  float d1 = RZVector3::Dot(ab, ap);
+  float d2 = RZVector3::Dot(ac, ap);
+
+  float wb, wc;
+  if (d1 <= 0.f && d2 <= 0.f)
+  {
+    wb = 0.f;
+    wc = 0.f;
+  }
+  else
+  {
+    RZVector3 bp = point - b;
+    float d3 = RZVector3::Dot(ab, bp);
+    float d4 = RZVector3::Dot(ac, bp);
+    RZVector3 cp = point - c;
+    float d5 = RZVector3::Dot(ab, cp);
+    float d6 = RZVector3::Dot(ac, cp);
+
+    // Twice the signed areas of the sub triangles, projected onto the plane
+    float va = d3 * d6 - d5 * d4;
+    float vb = d5 * d2 - d1 * d6;
+    float vc = d1 * d4 - d3 * d2;
+
+    if (d3 >= 0.f && d4 <= d3)
+    {
+      wb = 1.f;
+      wc = 0.f;
+    }
+    else if (d6 >= 0.f && d5 <= d6)
+    {
+      wb = 0.f;
+      wc = 1.f;
+    }
+    else if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+    {
+      wb = d1 / (d1 - d3);
+      wc = 0.f;
+    }
+    else if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+    {
+      wb = 0.f;
+      wc = d2 / (d2 - d6);
+    }
+    else if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+    {
+      wc = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+      wb = 1.f - wc;
+    }
+    else if (va + vb + vc > 0.f)
+    {
+      // Inside the face
+      float inv_area = 1.f / (va + vb + vc);
+      wb = vb * inv_area;
+      wc = vc * inv_area;
+    }
+    else
+    {
+      // Degenerate (no area). Take the nearest of the three edges
+      float t_ab = ClosestOnSegment(point, a, b);
+      float t_ac = ClosestOnSegment(point, a, c);
+      float t_bc = ClosestOnSegment(point, b, c);
+      RZVector3 on_ab = point - (a + ab * t_ab);
+      RZVector3 on_ac = point - (a + ac * t_ac);
+      RZVector3 on_bc = point - (b + (c - b) * t_bc);
+      float dist_ab = RZVector3::Dot(on_ab, on_ab);
+      float dist_ac = RZVector3::Dot(on_ac, on_ac);
+      float dist_bc = RZVector3::Dot(on_bc, on_bc);
+
+      wb = t_ab;
+      wc = 0.f;
+      if (dist_ac < dist_ab && dist_ac <= dist_bc)
+      {
+        wb = 0.f;
+        wc = t_ac;
+      }
+      else if (dist_bc < dist_ab)
+      {
+        wb = 1.f - t_bc;
+        wc = t_bc;
+      }
+    }
+  }
+
+  *out_b = wb;
+  *out_c = wc;
+  RZVector3 offset = ap - ab * wb - ac * wc;
+  return RZVector3::Dot(offset, offset);
+}
+
+// Twice the signed area of the 2D triangle (pa, pb, pc)
+static float Orient2D(float ax, float ay, float bx, float by, float cx, float cy)
+{
+  return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+}
+
+// 2D segment test, including collinear overlap and touching at the ends
+static bool TestSegments2D(const float* p0, const float* p1, const float* q0, const float* q1)
+{
+  float d0 = Orient2D(p0[0], p0[1], p1[0], p1[1], q0[0], q0[1]);
+  float d1 = Orient2D(p0[0], p0[1], p1[0], p1[1], q1[0], q1[1]);
+  float d2 = Orient2D(q0[0], q0[1], q1[0], q1[1], p0[0], p0[1]);
+  float d3 = Orient2D(q0[0], q0[1], q1[0], q1[1], p1[0], p1[1]);
+
+  if (((d0 > 0.f && d1 < 0.f) || (d0 < 0.f && d1 > 0.f)) &&
+    ((d2 > 0.f && d3 < 0.f) || (d2 < 0.f && d3 > 0.f)))
+  {
+    return true;
+  }
+
+  // Collinear or touching: some end lies on the other segment
+  auto on_segment = [](const float* a, const float* b, const float* p)
+  {
+    return p[0] >= std::min(a[0], b[0]) && p[0] <= std::max(a[0], b[0]) &&
+      p[1] >= std::min(a[1], b[1]) && p[1] <= std::max(a[1], b[1]);
+  };
+  return (d0 == 0.f && on_segment(p0, p1, q0)) || (d1 == 0.f && on_segment(p0, p1, q1)) ||
+    (d2 == 0.f && on_segment(q0, q1, p0)) || (d3 == 0.f && on_segment(q0, q1, p1));
+}
+
+// 2D point in triangle, including the edges, for either winding
+static bool TestPointTriangle2D(const float* p, const float (*t)[2])
+{
+  float d0 = Orient2D(t[0][0], t[0][1], t[1][0], t[1][1], p[0], p[1]);
+  float d1 = Orient2D(t[1][0], t[1][1], t[2][0], t[2][1], p[0], p[1]);
+  float d2 = Orient2D(t[2][0], t[2][1], t[0][0], t[0][1], p[0], p[1]);
+  return (d0 >= 0.f && d1 >= 0.f && d2 >= 0.f) || (d0 <= 0.f && d1 <= 0.f && d2 <= 0.f);
+}
+
+// Both triangles in one plane with the given normal. Drop its largest axis and test in 2D
+static bool TestCoplanarTriangles(const RZVector3& normal, const RZVector3* a, const RZVector3* b)
+{
+  float nx = fabsf(normal.x), ny = fabsf(normal.y), nz = fabsf(normal.z);
+  int u = 1, v = 2;
+  if (ny >= nx && ny >= nz)
+  {
+    u = 0;
+  }
+  else if (nz >= nx && nz >= ny)
+  {
+    u = 0;
+    v = 1;
+  }
+
+  float pa[3][2], pb[3][2];
+  for (int i = 0; i < 3; ++i)
+  {
+    pa[i][0] = (&a[i].x)[u];
+    pa[i][1] = (&a[i].x)[v];
+    pb[i][0] = (&b[i].x)[u];
+    pb[i][1] = (&b[i].x)[v];
+  }
+
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 3; ++j)
+    {
+      if (TestSegments2D(pa[i], pa[(i + 1) % 3], pb[j], pb[(j + 1) % 3]))
+      {
+        return true;
+      }
+    }
+  }
+
+  // No edges cross, so either one is inside the other or they're apart
+  return TestPointTriangle2D(pa[0], pb) || TestPointTriangle2D(pb[0], pa);
+}
+
+// Signed distances of t's vertices from the plane through p with unit normal n,
+// snapped to 0 within eps. False if they're all on one side
+static bool GetPlaneDistances(const RZVector3& n, const RZVector3& p, const RZVector3* t, float eps, float* out_dists)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    out_dists[i] = RZVector3::Dot(n, t[i] - p);
+    if (fabsf(out_dists[i]) < eps)
+    {
+      out_dists[i] = 0.f;
+    }
+  }
+
+  return !((out_dists[0] > 0.f && out_dists[1] > 0.f && out_dists[2] > 0.f) ||
+    (out_dists[0] < 0.f && out_dists[1] < 0.f && out_dists[2] < 0.f));
+}
+
+// Where the triangle crosses the other's plane, as an interval of the projections
+// onto the line both planes share. False if it only lies in the plane
+static bool GetLineInterval(const float* proj, const float* dists, float* out_t0, float* out_t1)
+{
+  // Find the vertex alone on its side of the plane
+  int lone;
+  if (dists[0] * dists[1] > 0.f)
+  {
+    lone = 2;
+  }
+  else if (dists[0] * dists[2] > 0.f)
+  {
+    lone = 1;
+  }
+  else if (dists[1] * dists[2] > 0.f || dists[0] != 0.f)
+  {
+    lone = 0;
+  }
+  else if (dists[1] != 0.f)
+  {
+    lone = 1;
+  }
+  else if (dists[2] != 0.f)
+  {
+    lone = 2;
+  }
+  else
+  {
+    return false;
+  }
+
+  int i1 = (lone + 1) % 3;
+  int i2 = (lone + 2) % 3;
+  float t0 = proj[lone] + (proj[i1] - proj[lone]) * dists[lone] / (dists[lone] - dists[i1]);
+  float t1 = proj[lone] + (proj[i2] - proj[lone]) * dists[lone] / (dists[lone] - dists[i2]);
+  *out_t0 = std::min(t0, t1);
+  *out_t1 = std::max(t0, t1);
+  return true;
+}
+
+bool TestTriangleTriangle(const RZVector3& a0, const RZVector3& a1, const RZVector3& a2,
+  const RZVector3& b0, const RZVector3& b1, const RZVector3& b2)
+{
+  // Moller's interval overlap test ("A Fast Triangle-Triangle Intersection Test"),
+  // with unit normals and a tolerance scaled to the coordinates, so nearly touching
+  // or nearly coplanar triangles get consistent answers
+  RZVector3 a[3] = { a0, a1, a2 };
+  RZVector3 b[3] = { b0, b1, b2 };
+
+  RZVector3 na = RZVector3::Cross(a1 - a0, a2 - a0);
+  RZVector3 nb = RZVector3::Cross(b1 - b0, b2 - b0);
+  float len_a = na.Length();
+  float len_b = nb.Length();
+  if (len_a <= 0.f || len_b <= 0.f)
+  {
+    return false;
+  }
+  na /= len_a;
+  nb /= len_b;
+
+  float scale = 0.f;
+  for (int i = 0; i < 3; ++i)
+  {
+    scale = std::max(scale, std::max(fabsf(a[i].x), std::max(fabsf(a[i].y), fabsf(a[i].z))));
+    scale = std::max(scale, std::max(fabsf(b[i].x), std::max(fabsf(b[i].y), fabsf(b[i].z))));
+  }
+  float eps = scale * 4.f * FLT_EPSILON;
+
+  float dists_a[3], dists_b[3];
+  if (!GetPlaneDistances(nb, b0, a, eps, dists_a) || !GetPlaneDistances(na, a0, b, eps, dists_b))
+  {
+    return false;
+  }
+
+  if (dists_a[0] == 0.f && dists_a[1] == 0.f && dists_a[2] == 0.f)
+  {
+    return TestCoplanarTriangles(na, a, b);
+  }
+
+  // Project onto the largest axis of the line, which keeps the order along it
+  RZVector3 line = RZVector3::Cross(na, nb);
+  float lx = fabsf(line.x), ly = fabsf(line.y), lz = fabsf(line.z);
+  int axis = (lx >= ly && lx >= lz) ? 0 : (ly >= lz ? 1 : 2);
+
+  float proj_a[3], proj_b[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    proj_a[i] = (&a[i].x)[axis];
+    proj_b[i] = (&b[i].x)[axis];
+  }
+
+  float a_t0, a_t1, b_t0, b_t1;
+  if (!GetLineInterval(proj_a, dists_a, &a_t0, &a_t1) || !GetLineInterval(proj_b, dists_b, &b_t0, &b_t1))
+  {
+    // One lies in the other's plane but not vice versa, which only the tolerance allows
+    return TestCoplanarTriangles(na, a, b);
+  }
+
+  return a_t0 <= b_t1 && b_t0 <= a_t1;
+}
@@ -6,3 +6,25 @@
 
 // Simple boolean test of ray and aabb
 bool TestRayBox(const RZVector3& start, const RZVector3& dir, const RZVector3& min, const RZVector3& max);
+
+// Boolean test of the segment [start, start + dir * max_dist] and aabb.
+// inv_dir is the per component reciprocal of dir, computed once per ray.
+// out_entry gets the distance along the ray where it enters the box (0 if inside)
+bool TestSegmentBox(const RZVector3& start, const RZVector3& inv_dir, float max_dist,
+  const RZVector3& min, const RZVector3& max, float* out_entry);
+
+// Boolean test of two aabbs, touching counts as overlapping
+bool TestBoxBox(const RZVector3& min1, const RZVector3& max1, const RZVector3& min2, const RZVector3& max2);
+
+// Squared distance from the point to the closest point of the aabb, 0 if inside
+float DistanceSqPointBox(const RZVector3& point, const RZVector3& min, const RZVector3& max);
+
+// Squared distance from the point to the closest point of the triangle abc. out_b &
+// out_c get the weights of b & c at that point (a's is 1 - b - c)
+float DistanceSqPointTriangle(const RZVector3& point, const RZVector3& a, const RZVector3& b, const RZVector3& c,
+  float* out_b, float* out_c);
+
+// Boolean test of two triangles, touching counts as intersecting. Degenerate
+// triangles (no area) never intersect
+bool TestTriangleTriangle(const RZVector3& a0, const RZVector3& a1, const RZVector3& a2,
+  const RZVector3& b0, const RZVector3& b1, const RZVector3& b2);
@@ -0,0 +1,48 @@
+//=============================================================================
+// Sampling.h - Sample sequences and warping functions
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+static const float Pi = 3.14159265f;
+
+// Radical inverse in the given base. Used to pick well distributed subpixel offsets
+inline float Halton(uint32_t index, uint32_t base)
+{
+  float result = 0.f;
+  float f = 1.f / base;
+  while (index > 0)
+  {
+    result += f * (index % base);
+    index /= base;
+    f /= base;
+  }
+  return result;
+}
+
+// Build tangent & bitangent so that (tangent, bitangent, normal) is orthonormal
+inline void BuildBasis(const RZVector3& normal, RZVector3* out_tangent, RZVector3* out_bitangent)
+{
+  float sign = normal.z >= 0.f ? 1.f : -1.f;
+  float a = -1.f / (sign + normal.z);
+  float b = normal.x * normal.y * a;
+  *out_tangent = RZVector3{ 1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x };
+  *out_bitangent = RZVector3{ b, sign + normal.y * normal.y * a, -normal.y };
+}
+
+// Map 2 uniform numbers in [0, 1) to a direction about normal, with pdf cos(theta) / pi
+inline RZVector3 CosineSampleHemisphere(const RZVector3& normal, float u1, float u2)
+{
+  RZVector3 tangent, bitangent;
+  BuildBasis(normal, &tangent, &bitangent);
+
+  float r = sqrtf(u1);
+  float phi = 2.f * Pi * u2;
+  float z = sqrtf(std::max(0.f, 1.f - u1));
+  return tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + normal * z;
+}
+
+inline RZVector3 Reflect(const RZVector3& dir, const RZVector3& normal)
+{
+  return dir - normal * (2.f * RZVector3::Dot(dir, normal));
+}
@@ -0,0 +1,211 @@
+//=============================================================================
+// Simd.h - SSE2 vector math: float4/float8 lanes and structure of arrays
+//          Vector3 packets. RZVector3 stays the type used at the API
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+// Lanes of a where mask is set, else lanes of b
+inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Four floats. Comparisons return masks (all ones where true), for Select & MoveMask
+struct float4
+{
+  __m128 v;
+
+  float4() {}
+  float4(__m128 value) : v(value) {}
+  explicit float4(float s) : v(_mm_set1_ps(s)) {}
+  float4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+
+  operator __m128() const { return v; }
+
+  static float4 Zero() { return _mm_setzero_ps(); }
+  static float4 Load(const float* p) { return _mm_loadu_ps(p); }
+  void Store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline float4 operator+ (const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator- (const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator* (const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/ (const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+inline float4 operator- (const float4& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+inline float4 operator& (const float4& a, const float4& b) { return _mm_and_ps(a.v, b.v); }
+inline float4 operator| (const float4& a, const float4& b) { return _mm_or_ps(a.v, b.v); }
+inline float4 operator< (const float4& a, const float4& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline float4 operator<= (const float4& a, const float4& b) { return _mm_cmple_ps(a.v, b.v); }
+inline float4 operator> (const float4& a, const float4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline float4 operator>= (const float4& a, const float4& b) { return _mm_cmpge_ps(a.v, b.v); }
+
+inline float4 Min(const float4& a, const float4& b) { return _mm_min_ps(a.v, b.v); }
+inline float4 Max(const float4& a, const float4& b) { return _mm_max_ps(a.v, b.v); }
+inline float4 Abs(const float4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+inline float4 Sqrt(const float4& a) { return _mm_sqrt_ps(a.v); }
+
+// a & ~b, ie. to clear the lanes of a mask
+inline float4 AndNot(const float4& a, const float4& b) { return _mm_andnot_ps(b.v, a.v); }
+
+// Bit i set if lane i's sign (or mask) bit is
+inline int MoveMask(const float4& a) { return _mm_movemask_ps(a.v); }
+
+// 1 / sqrt(a), from the 12 bit estimate plus a Newton-Raphson step (about 22 bits).
+// Not exact like 1.f / sqrtf, so only for results that needn't match scalar code
+inline float4 Rsqrt(const float4& a)
+{
+  __m128 y = _mm_rsqrt_ps(a.v);
+  __m128 yya = _mm_mul_ps(_mm_mul_ps(y, y), a.v);
+  return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.f), yya));
+}
+
+// 1 / a, estimate plus a Newton-Raphson step
+inline float4 Rcp(const float4& a)
+{
+  __m128 y = _mm_rcp_ps(a.v);
+  return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(2.f), _mm_mul_ps(a.v, y)));
+}
+
+// Eight floats, as two SSE halves since the build only assumes SSE2
+struct float8
+{
+  float4 lo, hi;
+
+  float8() {}
+  float8(const float4& low, const float4& high) : lo(low), hi(high) {}
+  explicit float8(float s) : lo(s), hi(s) {}
+
+  static float8 Zero() { return float8(float4::Zero(), float4::Zero()); }
+  static float8 Load(const float* p) { return float8(float4::Load(p), float4::Load(p + 4)); }
+  void Store(float* p) const { lo.Store(p); hi.Store(p + 4); }
+};
+
+inline float8 operator+ (const float8& a, const float8& b) { return float8(a.lo + b.lo, a.hi + b.hi); }
+inline float8 operator- (const float8& a, const float8& b) { return float8(a.lo - b.lo, a.hi - b.hi); }
+inline float8 operator* (const float8& a, const float8& b) { return float8(a.lo * b.lo, a.hi * b.hi); }
+inline float8 operator/ (const float8& a, const float8& b) { return float8(a.lo / b.lo, a.hi / b.hi); }
+inline float8 operator- (const float8& a) { return float8(-a.lo, -a.hi); }
+inline float8 operator& (const float8& a, const float8& b) { return float8(a.lo & b.lo, a.hi & b.hi); }
+inline float8 operator| (const float8& a, const float8& b) { return float8(a.lo | b.lo, a.hi | b.hi); }
+inline float8 operator< (const float8& a, const float8& b) { return float8(a.lo < b.lo, a.hi < b.hi); }
+inline float8 operator<= (const float8& a, const float8& b) { return float8(a.lo <= b.lo, a.hi <= b.hi); }
+inline float8 operator> (const float8& a, const float8& b) { return float8(a.lo > b.lo, a.hi > b.hi); }
+inline float8 operator>= (const float8& a, const float8& b) { return float8(a.lo >= b.lo, a.hi >= b.hi); }
+
+inline float8 Min(const float8& a, const float8& b) { return float8(Min(a.lo, b.lo), Min(a.hi, b.hi)); }
+inline float8 Max(const float8& a, const float8& b) { return float8(Max(a.lo, b.lo), Max(a.hi, b.hi)); }
+inline float8 Abs(const float8& a) { return float8(Abs(a.lo), Abs(a.hi)); }
+inline float8 Sqrt(const float8& a) { return float8(Sqrt(a.lo), Sqrt(a.hi)); }
+inline float8 AndNot(const float8& a, const float8& b) { return float8(AndNot(a.lo, b.lo), AndNot(a.hi, b.hi)); }
+inline int MoveMask(const float8& a) { return MoveMask(a.lo) | (MoveMask(a.hi) << 4); }
+inline float8 Rsqrt(const float8& a) { return float8(Rsqrt(a.lo), Rsqrt(a.hi)); }
+inline float8 Rcp(const float8& a) { return float8(Rcp(a.lo), Rcp(a.hi)); }
+
+inline float8 Select(const float8& mask, const float8& a, const float8& b)
+{
+  return float8(Select(mask.lo, a.lo, b.lo), Select(mask.hi, a.hi, b.hi));
+}
+
+// An RZVector3 in the first three lanes, without reading past it. The fourth is 0
+inline float4 Load3(const RZVector3& v)
+{
+  return _mm_setr_ps(v.x, v.y, v.z, 0.f);
+}
+
+inline RZVector3 Store3(const float4& a)
+{
+  float lanes[4];
+  a.Store(lanes);
+  return RZVector3{ lanes[0], lanes[1], lanes[2] };
+}
+
+// One Vector3 per lane, as structure of arrays. The operations match RZVector3's
+// operation for operation, so results are the same as the scalar code's
+template <typename T>
+struct Vector3Packet
+{
+  T x, y, z;
+
+  static Vector3Packet Splat(const RZVector3& v)
+  {
+    return Vector3Packet{ T(v.x), T(v.y), T(v.z) };
+  }
+};
+
+typedef Vector3Packet<float4> Vector3x4;
+typedef Vector3Packet<float8> Vector3x8;
+
+template <typename T>
+inline Vector3Packet<T> operator+ (const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return Vector3Packet<T>{ a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+template <typename T>
+inline Vector3Packet<T> operator- (const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return Vector3Packet<T>{ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+template <typename T>
+inline Vector3Packet<T> operator- (const Vector3Packet<T>& a)
+{
+  return Vector3Packet<T>{ -a.x, -a.y, -a.z };
+}
+
+template <typename T>
+inline Vector3Packet<T> operator* (const Vector3Packet<T>& a, const T& s)
+{
+  return Vector3Packet<T>{ a.x * s, a.y * s, a.z * s };
+}
+
+template <typename T>
+inline T Dot(const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+template <typename T>
+inline Vector3Packet<T> Cross(const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return Vector3Packet<T>{ a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+template <typename T>
+inline Vector3Packet<T> Min(const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return Vector3Packet<T>{ Min(a.x, b.x), Min(a.y, b.y), Min(a.z, b.z) };
+}
+
+template <typename T>
+inline Vector3Packet<T> Max(const Vector3Packet<T>& a, const Vector3Packet<T>& b)
+{
+  return Vector3Packet<T>{ Max(a.x, b.x), Max(a.y, b.y), Max(a.z, b.z) };
+}
+
+template <typename T>
+inline T Length(const Vector3Packet<T>& a)
+{
+  return Sqrt(Dot(a, a));
+}
+
+// With the fast reciprocal square root, so not bit exact with RZVector3::Normalize
+template <typename T>
+inline Vector3Packet<T> Normalize(const Vector3Packet<T>& a)
+{
+  return a * Rsqrt(Dot(a, a));
+}
+
+// Set & read a single lane, ie. to gather packets from RZVector3s
+inline void SetLane(Vector3x4* p, int lane, const RZVector3& v)
+{
+  ((float*)&p->x)[lane] = v.x;
+  ((float*)&p->y)[lane] = v.y;
+  ((float*)&p->z)[lane] = v.z;
+}
+
+inline RZVector3 GetLane(const Vector3x4& p, int lane)
+{
+  return RZVector3{ ((const float*)&p.x)[lane], ((const float*)&p.y)[lane], ((const float*)&p.z)[lane] };
+}
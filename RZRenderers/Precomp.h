@@ -5,10 +5,18 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <emmintrin.h>
 
 #include <algorithm>
 #include <vector>
 #include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 
 #include "RZRenderers.h"
 #include "Util/BaseObject.h"
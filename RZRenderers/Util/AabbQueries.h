@@ -0,0 +1,266 @@
+//=============================================================================
+// AabbQueries.h - Queries for AabbTree::Traverse
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "Math/PrimitiveTests.h"
+#include "Math/Simd.h"
+
+// A query decides which boxes the traversal descends into:
+//
+//   // False culls the box. Otherwise out_key orders the passing children of a node
+//   // (smallest first), and boxes are skipped if it's over GetMaxKey() by the time
+//   // they're reached. Queries that don't care return 0
+//   bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const;
+//   float GetMaxKey() const;
+//
+// The traversal is instantiated per query type, so the tests inline into it.
+// Visitors can tighten a query as they go (ie. shorten a segment to the closest hit)
+
+// Infinite ray. Children are visited in tree order
+struct RayQuery
+{
+  RZVector3 start;
+  RZVector3 dir;
+
+  RayQuery(const RZVector3& ray_start, const RZVector3& ray_dir)
+    : start(ray_start), dir(ray_dir)
+  {}
+
+  bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const
+  {
+    *out_key = 0.f;
+    return TestRayBox(start, dir, min, max);
+  }
+
+  float GetMaxKey() const { return FLT_MAX; }
+};
+
+// Up to four infinite rays, for AabbTree::TraversePacket. A box is tested against
+// all of them at once, with TestRayBox's steps lane by lane, so every ray passes
+// exactly the boxes it would on its own
+struct RayPacketQuery
+{
+  static const int MaxRays = 4;
+  Vector3x4 start;
+  Vector3x4 dir;
+
+  // Lanes past count repeat the first ray
+  RayPacketQuery(const RZVector3* starts, const RZVector3* dirs, int count)
+  {
+    float lanes[6][MaxRays];
+    for (int i = 0; i < MaxRays; ++i)
+    {
+      int ray = (i < count) ? i : 0;
+      lanes[0][i] = starts[ray].x;
+      lanes[1][i] = starts[ray].y;
+      lanes[2][i] = starts[ray].z;
+      lanes[3][i] = dirs[ray].x;
+      lanes[4][i] = dirs[ray].y;
+      lanes[5][i] = dirs[ray].z;
+    }
+    start = Vector3x4{ float4::Load(lanes[0]), float4::Load(lanes[1]), float4::Load(lanes[2]) };
+    dir = Vector3x4{ float4::Load(lanes[3]), float4::Load(lanes[4]), float4::Load(lanes[5]) };
+  }
+
+  // The rays of ray_mask (bit i for ray i) that pass the box
+  int TestBox(const RZVector3& min, const RZVector3& max, int ray_mask) const
+  {
+    float4 min_x(min.x), min_y(min.y), min_z(min.z);
+    float4 max_x(max.x), max_y(max.y), max_z(max.z);
+    float4 rx = start.x, ry = start.y, rz = start.z;
+
+    ClipToSlab(dir.x, min_x, max_x, dir.y, dir.z, &rx, &ry, &rz);
+    ClipToSlab(dir.y, min_y, max_y, dir.x, dir.z, &ry, &rx, &rz);
+    ClipToSlab(dir.z, min_z, max_z, dir.x, dir.y, &rz, &rx, &ry);
+
+    float4 inside = (rx >= min_x) & (rx <= max_x) & (ry >= min_y) & (ry <= max_y) & (rz >= min_z) & (rz <= max_z);
+    return MoveMask(inside) & ray_mask;
+  }
+
+  // Rays that haven't reached the slab yet move onto its near side along d, dragging
+  // the other two coordinates with them. Other lanes are left as they are
+  static void ClipToSlab(const float4& d, const float4& slab_min, const float4& slab_max,
+    const float4& d1, const float4& d2, float4* r, float4* r1, float4* r2)
+  {
+    float4 zero = float4::Zero();
+    float4 below = (d > zero) & (*r < slab_min);
+    float4 above = (d < zero) & (*r > slab_max);
+    float4 plane = Select(below, slab_min, slab_max);
+    float4 s = (plane - *r) / d;
+    float4 moved = below | above;
+    *r1 = Select(moved, *r1 + d1 * s, *r1);
+    *r2 = Select(moved, *r2 + d2 * s, *r2);
+    *r = Select(moved, plane, *r);
+  }
+};
+
+// The first max_dist of a ray. Children are visited nearest first, and anything
+// starting past max_dist is skipped
+struct SegmentQuery
+{
+  RZVector3 start;
+  RZVector3 inv_dir;
+  float max_dist;
+
+  SegmentQuery(const RZVector3& ray_start, const RZVector3& ray_dir, float ray_max_dist)
+    : start(ray_start), max_dist(ray_max_dist)
+  {
+    // Avoid 0 * inf in the slab test for axis aligned rays
+    static const float min_component = 1e-20f;
+    inv_dir = RZVector3{
+      1.f / (fabsf(ray_dir.x) > min_component ? ray_dir.x : min_component),
+      1.f / (fabsf(ray_dir.y) > min_component ? ray_dir.y : min_component),
+      1.f / (fabsf(ray_dir.z) > min_component ? ray_dir.z : min_component) };
+  }
+
+  bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const
+  {
+    return TestSegmentBox(start, inv_dir, max_dist, min, max, out_key);
+  }
+
+  float GetMaxKey() const { return max_dist; }
+};
+
+// Boxes overlapping another box
+struct BoxQuery
+{
+  RZVector3 min;
+  RZVector3 max;
+
+  BoxQuery(const RZVector3& query_min, const RZVector3& query_max)
+    : min(query_min), max(query_max)
+  {}
+
+  bool TestBox(const RZVector3& box_min, const RZVector3& box_max, float* out_key) const
+  {
+    *out_key = 0.f;
+    return TestBoxBox(min, max, box_min, box_max);
+  }
+
+  float GetMaxKey() const { return FLT_MAX; }
+};
+
+// Boxes overlapping a sphere
+struct SphereQuery
+{
+  RZVector3 center;
+  float radius_sq;
+
+  SphereQuery(const RZVector3& sphere_center, float radius)
+    : center(sphere_center), radius_sq(radius * radius)
+  {}
+
+  bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const
+  {
+    *out_key = 0.f;
+    return DistanceSqPointBox(center, min, max) <= radius_sq;
+  }
+
+  float GetMaxKey() const { return FLT_MAX; }
+};
+
+// Boxes at least partly inside every plane of a view frustum. Conservative: boxes
+// just outside near the corners of the volume can pass. The planes are kept as
+// structure of arrays, so a box is tested against all of them at once
+struct FrustumQuery
+{
+  // Inside when Dot(normal, p) + d >= 0. Planes past the sixth always pass
+  static const int NumPlanes = 6;
+  float8 nx, ny, nz, d;
+  float8 positive_x, positive_y, positive_z;  // Normal component >= 0
+
+  FrustumQuery(const RZVector3 (&normals)[NumPlanes], const float (&dists)[NumPlanes])
+  {
+    float x[8], y[8], z[8], w[8];
+    for (int i = 0; i < 8; ++i)
+    {
+      bool used = (i < NumPlanes);
+      x[i] = used ? normals[i].x : 0.f;
+      y[i] = used ? normals[i].y : 0.f;
+      z[i] = used ? normals[i].z : 0.f;
+      w[i] = used ? dists[i] : 1.f;
+    }
+
+    nx = float8::Load(x);
+    ny = float8::Load(y);
+    nz = float8::Load(z);
+    d = float8::Load(w);
+    positive_x = (nx >= float8::Zero());
+    positive_y = (ny >= float8::Zero());
+    positive_z = (nz >= float8::Zero());
+  }
+
+  // Frustum of a camera at position, looking down +z with +y up, as RenderScene's
+  // viewer (which doesn't rotate). tan_half_fov_x/y give the slopes of the sides.
+  // Nothing is culled by distance, only what's behind the camera
+  static FrustumQuery FromCamera(const RZVector3& position, float tan_half_fov_x, float tan_half_fov_y)
+  {
+    RZVector3 normals[NumPlanes] =
+    {
+      RZVector3{ 1.f, 0.f, tan_half_fov_x },    // left
+      RZVector3{ -1.f, 0.f, tan_half_fov_x },   // right
+      RZVector3{ 0.f, 1.f, tan_half_fov_y },    // bottom
+      RZVector3{ 0.f, -1.f, tan_half_fov_y },   // top
+      RZVector3{ 0.f, 0.f, 1.f },               // near, through the camera
+      RZVector3{ 0.f, 0.f, 0.f },               // no far plane
+    };
+
+    float dists[NumPlanes];
+    for (int i = 0; i < NumPlanes; ++i)
+    {
+      dists[i] = -RZVector3::Dot(normals[i], position);
+    }
+    dists[NumPlanes - 1] = 1.f;
+
+    return FrustumQuery(normals, dists);
+  }
+
+  // False if the box is entirely outside a plane. Otherwise out_straddling gets a
+  // bit for every plane it crosses, so 0 means it's entirely inside
+  bool Classify(const RZVector3& min, const RZVector3& max, int* out_straddling) const
+  {
+    float8 min_x(min.x), min_y(min.y), min_z(min.z);
+    float8 max_x(max.x), max_y(max.y), max_z(max.z);
+
+    // The corner furthest along each normal is the last to leave its plane, and
+    // the opposite corner the first
+    float8 far_dist = nx * Select(positive_x, max_x, min_x) + ny * Select(positive_y, max_y, min_y) +
+      nz * Select(positive_z, max_z, min_z) + d;
+    float8 near_dist = nx * Select(positive_x, min_x, max_x) + ny * Select(positive_y, min_y, max_y) +
+      nz * Select(positive_z, min_z, max_z) + d;
+
+    *out_straddling = MoveMask(near_dist < float8::Zero());
+    return MoveMask(far_dist < float8::Zero()) == 0;
+  }
+
+  bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const
+  {
+    int straddling;
+    *out_key = 0.f;
+    return Classify(min, max, &straddling);
+  }
+
+  float GetMaxKey() const { return FLT_MAX; }
+};
+
+// Boxes within sqrtf(max_dist_sq) of a point, nearest first. For closest point
+// searches, visitors lower max_dist_sq as they find closer primitives
+struct PointQuery
+{
+  RZVector3 point;
+  float max_dist_sq;
+
+  PointQuery(const RZVector3& query_point, float max_dist)
+    : point(query_point), max_dist_sq(max_dist < FLT_MAX ? max_dist * max_dist : FLT_MAX)
+  {}
+
+  bool TestBox(const RZVector3& min, const RZVector3& max, float* out_key) const
+  {
+    *out_key = DistanceSqPointBox(point, min, max);
+    return *out_key <= max_dist_sq;
+  }
+
+  float GetMaxKey() const { return max_dist_sq; }
+};
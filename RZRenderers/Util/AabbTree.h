@@ -4,21 +4,88 @@
 //=============================================================================
 #pragma once
 
+#include "AabbQueries.h"
+#include "Arena.h"
+
+// Tree over an array of Primitives, referred to by their index in it.
+//
+// BoundsAccessor is called to get each primitive's box, and the point it's sorted by:
+//   void operator()(const Primitive& p, RZVector3* out_min, RZVector3* out_max, RZVector3* out_centroid) const;
+//
+// Leaves hold fewer than LeafSize primitives, except where they can't be split any
+// further. Nodes have up to NodeWidth children.
+template <typename Primitive, typename BoundsAccessor, int LeafSize = 32, int NodeWidth = 2>
 class AabbTree
 {
+public:
+  // A subtree of one tree and a subtree of another, with overlapping boxes
+  struct subtree_pair
+  {
+    int a, b;                 // >= 0 is node, else -(i+1) is leaf
+    RZVector3 min_a, max_a;
+    RZVector3 min_b, max_b;
+  };
+
 public:
   AabbTree() {}
   ~AabbTree() {}
 
-  // Clear out and rebuild the Aaabb tree
-  void Rebuild(
-    const RZVector3* centroids, const RZVector3* mins, const RZVector3* maxes,
-    int start, int count, const RZVector3& min, const RZVector3& max);
+  // Clear out and rebuild the Aabb tree. The primitives' bounds are kept in scratch
+  // while building (or a temporary arena, if null). The tree's own storage is kept
+  // between rebuilds, so rebuilding a similar scene needn't allocate
+  void Rebuild(const Primitive* primitives, int count, const BoundsAccessor& bounds = BoundsAccessor(),
+    Arena* scratch = nullptr);
+
+  // Same, but with all count primitives' bounds from a single call, ie. to a SIMD kernel:
+  //   void operator()(RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids);
+  template <typename BulkBounds>
+  void RebuildFromBounds(int count, BulkBounds&& bounds, Arena* scratch = nullptr);
+
+  // Box around every primitive, inverted (min > max) if the tree is empty
+  const RZVector3& GetMin() const { return min_; }
+  const RZVector3& GetMax() const { return max_; }
+
+  // Primitive indices in tree order: every leaf's (and subtree's) primitives are a
+  // contiguous run, and the runs visitors get point into this
+  const uint32_t* GetPrimitiveOrder() const { return indices_.data(); }
 
-  // Trace a ray through the tree, returning the list of primitives that could possibly be hit
-  bool TraceRay(
-    const RZVector3& start, const RZVector3& dir,
-    std::vector<uint32_t>* out_primitives) const;
+  // Bytes held by the nodes, leaves & primitive order
+  size_t GetMemorySize() const
+  {
+    return nodes_.capacity() * sizeof(node) + leaves_.capacity() * sizeof(leaf) + indices_.capacity() * sizeof(uint32_t);
+  }
+
+  // Walk the tree, calling the visitor for every leaf whose box (and all its parents')
+  // passes the query (see AabbQueries.h):
+  //   bool operator()(const uint32_t* primitives, int count);
+  // Returning false stops the traversal
+  template <typename Query, typename Visitor>
+  void Traverse(Query& query, Visitor&& visitor) const;
+
+  // Same for a frustum, except that subtrees entirely inside it aren't tested any
+  // further, and go to the visitor as a single run of primitives
+  template <typename Visitor>
+  void TraverseFrustum(const FrustumQuery& query, Visitor&& visitor) const;
+
+  // Walk the tree with a packet of rays together, in tree order like Traverse with a
+  // RayQuery. Each leaf goes to the visitor with the rays (bit i for ray i) that
+  // passed it and all its parents, so every ray sees the leaves it would on its own:
+  //   int operator()(const uint32_t* primitives, int count, int ray_mask);
+  // The visitor returns the rays of ray_mask that should carry on
+  template <typename Visitor>
+  void TraversePacket(const RayPacketQuery& query, int ray_mask, Visitor&& visitor) const;
+
+  // Overlapping subtrees of this tree & other, split breadth first from the roots until
+  // there are at least min_pairs (or only leaves are left). They cover separate parts
+  // of the overlap, so each can be traversed on its own, ie. on different threads
+  void SplitOverlaps(const AabbTree& other, int min_pairs, std::vector<subtree_pair>* out_pairs) const;
+
+  // Descend both trees together from the pair, calling the visitor for every pair of
+  // leaves whose boxes overlap:
+  //   bool operator()(const uint32_t* primitives, int count, const uint32_t* other_primitives, int other_count);
+  // Returning false stops the traversal, and false is returned
+  template <typename Visitor>
+  bool TraverseOverlaps(const AabbTree& other, const subtree_pair& start, Visitor&& visitor) const;
 
 private:
   struct leaf
@@ -29,26 +96,583 @@ private:
 
   struct node
   {
-    RZVector3 min[2], max[2]; // 2 bounding boxes
-    int child[2];             // >= 0 is node, else -(i+1) is leaf
+    RZVector3 min[NodeWidth], max[NodeWidth];
+    int child[NodeWidth];     // >= 0 is node, else -(i+1) is leaf
+    int num_children;
+    int start;                // Primitives of the whole subtree are contiguous in indices_
+    int count;
+  };
+
+  // Primitives [start, start + count) of indices_, and their bounds
+  struct range
+  {
+    int start;
+    int count;
+    RZVector3 min, max;
   };
 
 private:
   AabbTree(const AabbTree&) = delete;
   AabbTree& operator= (const AabbTree&) = delete;
 
-  int BuildNode(
-    const RZVector3* centroids, const RZVector3* mins, const RZVector3* maxes,
-    int start, int count, const RZVector3& min, const RZVector3& max);
+  int BuildNode(const range& r, int depth);
 
-  bool TraceRay(const RZVector3& start, const RZVector3& dir,
-    int node_index, std::vector<uint32_t>* out_primitives) const;
+  // The overlapping pairs of children, descending whichever sides are nodes. Returns
+  // how many were written, at most NodeWidth * NodeWidth
+  int ExpandPair(const AabbTree& other, const subtree_pair& p, subtree_pair* out_pairs) const;
+
+  // Bit k is set if the boxes of pair first + k overlap, four pairs at a time. Pair
+  // i * count_b + j is box i of a and box j of b
+  static int GetOverlapMask(const RZVector3* min_a, const RZVector3* max_a, const RZVector3* min_b,
+    const RZVector3* max_b, int count_b, int first, int num_pairs);
+
+  // Partition the range at the middle of its longest axis, trying the others if
+  // everything lands on one side. False if none of them split it
+  bool SplitRange(const range& r, range* out_lower, range* out_upper);
 
 private:
-  static const int MaxPrimitivesInLeaf = 32;
+  // Deeper ranges become (oversized) leaves, which bounds the traversal stack
+  static const int MaxDepth = 64;
+  static const int StackSize = MaxDepth * (NodeWidth - 1) + 1;
 
-  int root_node_ = 0;
+  // Every pair expanded descends at least one of the trees, so there are at most
+  // 2 * MaxDepth expansions on the way to any pair of leaves
+  static const int PairStackSize = 2 * MaxDepth * (NodeWidth * NodeWidth - 1) + 1;
+
+  int root_ = -1;
+  RZVector3 min_{};
+  RZVector3 max_{};
   std::vector<node> nodes_;
   std::vector<leaf> leaves_;
   std::vector<uint32_t> indices_;
+
+  // Build inputs, only set during a rebuild
+  RZVector3* mins_ = nullptr;
+  RZVector3* maxes_ = nullptr;
+  RZVector3* centroids_ = nullptr;
 };
+
+// Bounds accessor for triangles with i0, i1 & i2 indices into positions, sorted by centroid
+template <typename Triangle>
+struct IndexedTriangleBounds
+{
+  const RZVector3* positions;
+
+  void operator()(const Triangle& t, RZVector3* out_min, RZVector3* out_max, RZVector3* out_centroid) const
+  {
+    float4 v0 = Load3(positions[t.i0]);
+    float4 v1 = Load3(positions[t.i1]);
+    float4 v2 = Load3(positions[t.i2]);
+    *out_min = Store3(Min(Min(v0, v1), v2));
+    *out_max = Store3(Max(Max(v0, v1), v2));
+    *out_centroid = Store3((v0 + v1 + v2) / float4(3.f));
+  }
+};
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::Rebuild(
+  const Primitive* primitives, int count, const BoundsAccessor& bounds, Arena* scratch)
+{
+  RebuildFromBounds(count, [&](RZVector3* out_mins, RZVector3* out_maxes, RZVector3* out_centroids)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      bounds(primitives[i], &out_mins[i], &out_maxes[i], &out_centroids[i]);
+    }
+  }, scratch);
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+template <typename BulkBounds>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::RebuildFromBounds(
+  int count, BulkBounds&& bounds, Arena* scratch)
+{
+  Arena temporary;
+  Arena& arena = scratch ? *scratch : temporary;
+  mins_ = arena.Allocate<RZVector3>(count);
+  maxes_ = arena.Allocate<RZVector3>(count);
+  centroids_ = arena.Allocate<RZVector3>(count);
+  bounds(mins_, maxes_, centroids_);
+
+  // Leaves come from splitting ranges of LeafSize or more, so they rarely average
+  // under half of it, and nodes have at least two children, so they're fewer than the
+  // leaves. Reserving for that up front keeps the build from reallocating as it goes
+  int expected_leaves = 2 * count / LeafSize + 1;
+  leaves_.clear();
+  leaves_.reserve(expected_leaves);
+  nodes_.clear();
+  nodes_.reserve(expected_leaves);
+  indices_.resize(count);
+
+  min_ = RZVector3{ FLT_MAX, FLT_MAX, FLT_MAX };
+  max_ = -min_;
+
+  for (int i = 0; i < count; ++i)
+  {
+    min_ = RZVector3::Min(min_, mins_[i]);
+    max_ = RZVector3::Max(max_, maxes_[i]);
+    indices_[i] = i;
+  }
+
+  root_ = BuildNode(range{ 0, count, min_, max_ }, 0);
+  mins_ = maxes_ = centroids_ = nullptr;
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+template <typename Query, typename Visitor>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::Traverse(Query& query, Visitor&& visitor) const
+{
+  if (leaves_.empty())
+  {
+    // Never built
+    return;
+  }
+
+  // Pending children, with the key they passed the query with
+  int stack[StackSize];
+  float keys[StackSize];
+  int top = 0;
+
+  stack[top] = root_;
+  keys[top++] = 0.f;
+
+  while (top > 0)
+  {
+    --top;
+    int index = stack[top];
+
+    // The visitor may have tightened the query since this was pushed
+    if (keys[top] > query.GetMaxKey())
+    {
+      continue;
+    }
+
+    if (index < 0)
+    {
+      const leaf& l = leaves_[-(index + 1)];
+      if (l.count > 0 && !visitor(indices_.data() + l.start, l.count))
+      {
+        return;
+      }
+      continue;
+    }
+
+    // Sort the passing children by key, keeping tree order among equal keys, then
+    // push them so the first comes off the stack next
+    const node& n = nodes_[index];
+    int passed[NodeWidth];
+    float passed_keys[NodeWidth];
+    int num_passed = 0;
+
+    for (int i = 0; i < n.num_children; ++i)
+    {
+      float key;
+      if (!query.TestBox(n.min[i], n.max[i], &key))
+      {
+        continue;
+      }
+
+      int j = num_passed++;
+      for (; j > 0 && passed_keys[j - 1] > key; --j)
+      {
+        passed[j] = passed[j - 1];
+        passed_keys[j] = passed_keys[j - 1];
+      }
+      passed[j] = n.child[i];
+      passed_keys[j] = key;
+    }
+
+    for (int i = num_passed - 1; i >= 0; --i)
+    {
+      stack[top] = passed[i];
+      keys[top++] = passed_keys[i];
+    }
+  }
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+template <typename Visitor>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::TraversePacket(
+  const RayPacketQuery& query, int ray_mask, Visitor&& visitor) const
+{
+  if (leaves_.empty())
+  {
+    return;
+  }
+
+  // Pending children, with the rays that passed them. Rays the visitor drops are
+  // cleared from active, and from the pending entries as they come off
+  int stack[StackSize];
+  int masks[StackSize];
+  int top = 0;
+  int active = ray_mask;
+
+  stack[top] = root_;
+  masks[top++] = ray_mask;
+
+  while (top > 0)
+  {
+    --top;
+    int index = stack[top];
+    int mask = masks[top] & active;
+    if (mask == 0)
+    {
+      continue;
+    }
+
+    if (index < 0)
+    {
+      const leaf& l = leaves_[-(index + 1)];
+      if (l.count > 0)
+      {
+        active = (active & ~mask) | (visitor(indices_.data() + l.start, l.count, mask) & mask);
+        if (active == 0)
+        {
+          return;
+        }
+      }
+      continue;
+    }
+
+    const node& n = nodes_[index];
+    for (int i = n.num_children - 1; i >= 0; --i)
+    {
+      int passed = query.TestBox(n.min[i], n.max[i], mask);
+      if (passed != 0)
+      {
+        stack[top] = n.child[i];
+        masks[top++] = passed;
+      }
+    }
+  }
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+template <typename Visitor>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::TraverseFrustum(
+  const FrustumQuery& query, Visitor&& visitor) const
+{
+  int straddling;
+  if (leaves_.empty() || !query.Classify(min_, max_, &straddling))
+  {
+    return;
+  }
+
+  if (straddling == 0)
+  {
+    // All in view
+    if (!indices_.empty())
+    {
+      visitor(indices_.data(), (int)indices_.size());
+    }
+    return;
+  }
+
+  // Only subtrees crossing the frustum's boundary are pushed
+  int stack[StackSize];
+  int top = 0;
+  stack[top++] = root_;
+
+  while (top > 0)
+  {
+    int index = stack[--top];
+    if (index < 0)
+    {
+      const leaf& l = leaves_[-(index + 1)];
+      if (l.count > 0 && !visitor(indices_.data() + l.start, l.count))
+      {
+        return;
+      }
+      continue;
+    }
+
+    const node& n = nodes_[index];
+    for (int i = n.num_children - 1; i >= 0; --i)
+    {
+      if (!query.Classify(n.min[i], n.max[i], &straddling))
+      {
+        continue;
+      }
+
+      int child = n.child[i];
+      if (straddling != 0 && child >= 0)
+      {
+        stack[top++] = child;
+        continue;
+      }
+
+      // Entirely inside, or a leaf anyway
+      int start = (child >= 0) ? nodes_[child].start : leaves_[-(child + 1)].start;
+      int count = (child >= 0) ? nodes_[child].count : leaves_[-(child + 1)].count;
+      if (count > 0 && !visitor(indices_.data() + start, count))
+      {
+        return;
+      }
+    }
+  }
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+void AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::SplitOverlaps(
+  const AabbTree& other, int min_pairs, std::vector<subtree_pair>* out_pairs) const
+{
+  out_pairs->clear();
+  if (leaves_.empty() || other.leaves_.empty() || !TestBoxBox(min_, max_, other.min_, other.max_))
+  {
+    return;
+  }
+
+  out_pairs->push_back(subtree_pair{ root_, other.root_, min_, max_, other.min_, other.max_ });
+
+  std::vector<subtree_pair> next;
+  while ((int)out_pairs->size() < min_pairs)
+  {
+    next.clear();
+    bool expanded = false;
+    for (const subtree_pair& p : *out_pairs)
+    {
+      if (p.a < 0 && p.b < 0)
+      {
+        next.push_back(p);
+        continue;
+      }
+      subtree_pair children[NodeWidth * NodeWidth];
+      int count = ExpandPair(other, p, children);
+      next.insert(next.end(), children, children + count);
+      expanded = true;
+    }
+
+    out_pairs->swap(next);
+    if (!expanded)
+    {
+      break;
+    }
+  }
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+template <typename Visitor>
+bool AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::TraverseOverlaps(
+  const AabbTree& other, const subtree_pair& start, Visitor&& visitor) const
+{
+  subtree_pair stack[PairStackSize];
+  int top = 0;
+  stack[top++] = start;
+
+  while (top > 0)
+  {
+    subtree_pair p = stack[--top];
+
+    if (p.a < 0 && p.b < 0)
+    {
+      const leaf& la = leaves_[-(p.a + 1)];
+      const leaf& lb = other.leaves_[-(p.b + 1)];
+      if (la.count > 0 && lb.count > 0 &&
+        !visitor(indices_.data() + la.start, la.count, other.indices_.data() + lb.start, lb.count))
+      {
+        return false;
+      }
+      continue;
+    }
+
+    top += ExpandPair(other, p, stack + top);
+  }
+  return true;
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+int AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::ExpandPair(
+  const AabbTree& other, const subtree_pair& p, subtree_pair* out_pairs) const
+{
+  // A node's children, or a leaf itself (which doesn't descend)
+  const int* child_a = (p.a >= 0) ? nodes_[p.a].child : &p.a;
+  const RZVector3* min_a = (p.a >= 0) ? nodes_[p.a].min : &p.min_a;
+  const RZVector3* max_a = (p.a >= 0) ? nodes_[p.a].max : &p.max_a;
+  int count_a = (p.a >= 0) ? nodes_[p.a].num_children : 1;
+
+  const int* child_b = (p.b >= 0) ? other.nodes_[p.b].child : &p.b;
+  const RZVector3* min_b = (p.b >= 0) ? other.nodes_[p.b].min : &p.min_b;
+  const RZVector3* max_b = (p.b >= 0) ? other.nodes_[p.b].max : &p.max_b;
+  int count_b = (p.b >= 0) ? other.nodes_[p.b].num_children : 1;
+
+  // Both nodes' children are paired up, so two binary nodes fill all four lanes
+  int num_pairs = count_a * count_b;
+  int written = 0;
+  for (int first = 0; first < num_pairs; first += 4)
+  {
+    int mask = GetOverlapMask(min_a, max_a, min_b, max_b, count_b, first, num_pairs);
+    for (int k = first; k < std::min(first + 4, num_pairs); ++k)
+    {
+      if ((mask & (1 << (k - first))) != 0)
+      {
+        int i = k / count_b;
+        int j = k % count_b;
+        out_pairs[written++] = subtree_pair{ child_a[i], child_b[j], min_a[i], max_a[i], min_b[j], max_b[j] };
+      }
+    }
+  }
+  return written;
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+int AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::GetOverlapMask(const RZVector3* min_a,
+  const RZVector3* max_a, const RZVector3* min_b, const RZVector3* max_b, int count_b, int first, int num_pairs)
+{
+  // Gather both boxes of each pair into lanes. Missing pairs are inverted, so never overlap
+  float lane_min_a[3][4], lane_max_a[3][4], lane_min_b[3][4], lane_max_b[3][4];
+  for (int lane = 0; lane < 4; ++lane)
+  {
+    int k = first + lane;
+    int i = k / count_b;
+    int j = k % count_b;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      lane_min_a[axis][lane] = (k < num_pairs) ? (&min_a[i].x)[axis] : FLT_MAX;
+      lane_max_a[axis][lane] = (k < num_pairs) ? (&max_a[i].x)[axis] : -FLT_MAX;
+      lane_min_b[axis][lane] = (k < num_pairs) ? (&min_b[j].x)[axis] : FLT_MAX;
+      lane_max_b[axis][lane] = (k < num_pairs) ? (&max_b[j].x)[axis] : -FLT_MAX;
+    }
+  }
+
+  __m128 overlap = _mm_castsi128_ps(_mm_set1_epi32(-1));
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    overlap = _mm_and_ps(overlap, _mm_and_ps(
+      _mm_cmple_ps(_mm_loadu_ps(lane_min_a[axis]), _mm_loadu_ps(lane_max_b[axis])),
+      _mm_cmpge_ps(_mm_loadu_ps(lane_max_a[axis]), _mm_loadu_ps(lane_min_b[axis]))));
+  }
+  return _mm_movemask_ps(overlap);
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+int AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::BuildNode(const range& r, int depth)
+{
+  node n{};
+  range children[NodeWidth];
+  bool splittable[NodeWidth];
+
+  children[0] = r;
+  splittable[0] = (r.count >= LeafSize && depth < MaxDepth);
+  n.num_children = 1;
+  n.start = r.start;
+  n.count = r.count;
+
+  // Keep splitting the most populated child until the node is full. With two
+  // children, that's a single split of the range
+  while (n.num_children < NodeWidth)
+  {
+    int largest = -1;
+    for (int i = 0; i < n.num_children; ++i)
+    {
+      if (splittable[i] && (largest < 0 || children[i].count > children[largest].count))
+      {
+        largest = i;
+      }
+    }
+
+    if (largest < 0)
+    {
+      break;
+    }
+
+    range lower, upper;
+    if (!SplitRange(children[largest], &lower, &upper))
+    {
+      splittable[largest] = false;
+      continue;
+    }
+
+    children[largest] = lower;
+    children[n.num_children] = upper;
+    splittable[largest] = (lower.count >= LeafSize);
+    splittable[n.num_children] = (upper.count >= LeafSize);
+    ++n.num_children;
+  }
+
+  if (n.num_children == 1)
+  {
+    // Small enough, or can't be split (ie. identical centroids). Create a leaf
+    leaves_.push_back(leaf{ r.start, r.count });
+    return -(int)leaves_.size();
+  }
+
+  for (int i = 0; i < n.num_children; ++i)
+  {
+    n.min[i] = children[i].min;
+    n.max[i] = children[i].max;
+    n.child[i] = BuildNode(children[i], depth + 1);
+  }
+
+  nodes_.push_back(n);
+  return (int)nodes_.size() - 1;
+}
+
+template <typename Primitive, typename BoundsAccessor, int LeafSize, int NodeWidth>
+bool AabbTree<Primitive, BoundsAccessor, LeafSize, NodeWidth>::SplitRange(
+  const range& r, range* out_lower, range* out_upper)
+{
+  // find longest axis. divide there
+  int axis = 0;
+  float len = r.max.x - r.min.x;
+  if (r.max.y - r.min.y > len)
+  {
+    axis = 1;
+    len = r.max.y - r.min.y;
+  }
+  if (r.max.z - r.min.z > len)
+  {
+    axis = 2;
+    len = r.max.z - r.min.z;
+  }
+
+  for (int tries = 0; tries < 3; ++tries)
+  {
+    float value = (&r.min.x)[axis] + len * 0.5f;
+
+    // sort primitives based on centroids
+    int begin = r.start;
+    int end = r.start + r.count - 1;
+
+    RZVector3 min[2], max[2];
+    min[0] = min[1] = RZVector3{ FLT_MAX, FLT_MAX, FLT_MAX };
+    max[0] = max[1] = -min[0];
+
+    while (begin <= end)
+    {
+      if ((&centroids_[indices_[begin]].x)[axis] > value)
+      {
+        std::swap(indices_[begin], indices_[end]);
+
+        min[1] = RZVector3::Min(min[1], mins_[indices_[end]]);
+        max[1] = RZVector3::Max(max[1], maxes_[indices_[end]]);
+        --end;
+      }
+      else
+      {
+        min[0] = RZVector3::Min(min[0], mins_[indices_[begin]]);
+        max[0] = RZVector3::Max(max[0], maxes_[indices_[begin]]);
+        ++begin;
+      }
+    }
+
+    int count0 = begin - r.start;
+    int count1 = r.count - count0;
+
+    if (count0 > 0 && count1 > 0)
+    {
+      // success
+      *out_lower = range{ r.start, count0, min[0], max[0] };
+      *out_upper = range{ begin, count1, min[1], max[1] };
+      return true;
+    }
+
+    // not a good split. Try next axis
+    if (++axis > 2)
+    {
+      axis = 0;
+    }
+    len = (&r.max.x)[axis] - (&r.min.x)[axis];
+  }
+
+  return false;
+}
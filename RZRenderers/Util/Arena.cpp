@@ -0,0 +1,103 @@
+//=============================================================================
+// Arena.cpp - Linear allocator for scratch memory that's released all at once
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Arena.h"
+#include "MappedMemory.h"
+
+Arena::~Arena()
+{
+  FreeBlocks();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment)
+{
+  assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+  if (current_)
+  {
+    uintptr_t data = (uintptr_t)(current_ + 1);
+    uintptr_t p = (data + offset_ + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (p + size <= data + current_->size)
+    {
+      offset_ = p + size - data;
+      return (void*)p;
+    }
+  }
+
+  // Doesn't fit. Blocks at least double, so a growing round needs few of them
+  size_t block_size = std::max(size + alignment, MinBlockSize);
+  if (current_)
+  {
+    block_size = std::max(block_size, current_->size * 2);
+  }
+
+  block* b = NewBlock(block_size);
+  if (current_)
+  {
+    current_->next = b;
+  }
+  else
+  {
+    first_ = b;
+  }
+  current_ = b;
+  offset_ = 0;
+  return Allocate(size, alignment);
+}
+
+void Arena::SetMapped(bool mapped)
+{
+  assert(!first_);
+  mapped_ = mapped;
+}
+
+void Arena::Reset()
+{
+  if (first_ && first_ != current_)
+  {
+    size_t total = 0;
+    for (block* b = first_; b; b = b->next)
+    {
+      total += b->size;
+    }
+
+    FreeBlocks();
+    first_ = current_ = NewBlock(total);
+  }
+  offset_ = 0;
+}
+
+Arena::block* Arena::NewBlock(size_t size)
+{
+  block* b = (block*)(mapped_ ? AllocateMapped(sizeof(block) + size) : malloc(sizeof(block) + size));
+  if (!b)
+  {
+    throw std::bad_alloc();
+  }
+
+  ++heap_allocations_;
+  b->next = nullptr;
+  b->size = size;
+  return b;
+}
+
+void Arena::FreeBlocks()
+{
+  for (block* b = first_; b;)
+  {
+    block* next = b->next;
+    if (mapped_)
+    {
+      FreeMapped(b);
+    }
+    else
+    {
+      free(b);
+    }
+    b = next;
+  }
+  first_ = current_ = nullptr;
+  offset_ = 0;
+}
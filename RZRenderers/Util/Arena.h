@@ -0,0 +1,63 @@
+//=============================================================================
+// Arena.h - Linear allocator for scratch memory that's released all at once
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+// Allocations bump a pointer through large blocks, and are never freed one by one.
+// Reset releases all of them, but keeps the memory for the next round, so once a
+// round's worth (ie. a frame or tree build) has been seen, later ones make no heap
+// allocations. Like the standard containers (and MappedAllocator), running out of
+// memory, or of disk for mapped blocks, throws std::bad_alloc. Not thread safe
+class Arena
+{
+public:
+  Arena() {}
+  ~Arena();
+
+  // Room for count Ts, uninitialized. Nothing is ever destructed, so only for
+  // trivially destructible types
+  template <typename T>
+  T* Allocate(size_t count)
+  {
+    static_assert(std::is_trivially_destructible<T>::value, "Arena memory isn't destructed");
+    return (T*)Allocate(count * sizeof(T), alignof(T));
+  }
+
+  // size bytes, aligned to a power of 2
+  void* Allocate(size_t size, size_t alignment);
+
+  // Release everything allocated. If that took more than one block, they're replaced
+  // by a single block big enough for all of it
+  void Reset();
+
+  // Blocks allocated from the heap so far, ie. to check a frame allocated none
+  uint64_t GetHeapAllocations() const { return heap_allocations_; }
+
+  // Allocate blocks from temporary files (see AllocateMapped) rather than the heap,
+  // for scratch that may not fit in memory. Only before anything is allocated
+  void SetMapped(bool mapped);
+
+private:
+  Arena(const Arena&) = delete;
+  Arena& operator= (const Arena&) = delete;
+
+  // Blocks start with their header, followed by size bytes
+  struct block
+  {
+    block* next;
+    size_t size;
+  };
+
+  block* NewBlock(size_t size);
+  void FreeBlocks();
+
+private:
+  static const size_t MinBlockSize = 64 * 1024;
+
+  block* first_ = nullptr;
+  block* current_ = nullptr;    // Last in the list from first_
+  size_t offset_ = 0;           // Bytes used in current_
+  uint64_t heap_allocations_ = 0;
+  bool mapped_ = false;
+};
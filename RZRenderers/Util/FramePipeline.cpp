@@ -0,0 +1,190 @@
+//=============================================================================
+// FramePipeline.cpp - Background render & present threads for asynchronous frames
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "FramePipeline.h"
+
+FramePipeline::~FramePipeline()
+{
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  changed_.notify_all();
+
+  if (render_thread_.joinable())
+  {
+    render_thread_.join();
+  }
+  if (present_thread_.joinable())
+  {
+    present_thread_.join();
+  }
+}
+
+bool FramePipeline::Initialize(int num_buffers,
+  const std::function<void(frame&)>& render, const std::function<void(const frame&)>& present)
+{
+  if (num_buffers <= 0 || !render || !present)
+  {
+    assert(false);
+    return false;
+  }
+
+  num_buffers_ = num_buffers;
+  render_ = render;
+  present_ = present;
+  return true;
+}
+
+uint64_t FramePipeline::Submit(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+
+  if (!render_thread_.joinable())
+  {
+    render_thread_ = std::thread(&FramePipeline::RenderThread, this);
+    present_thread_ = std::thread(&FramePipeline::PresentThread, this);
+  }
+
+  // A frame's buffer is free once the frame num_buffers before it was presented
+  changed_.wait(lock, [this]() { return submitted_ - presented_ < (uint64_t)num_buffers_; });
+
+  uint64_t id = ++submitted_;
+  render_queue_.push_back(frame{ id, viewer_position, viewer_orientation, (int)(id % num_buffers_), 0, 0 });
+  lock.unlock();
+
+  changed_.notify_all();
+  return id;
+}
+
+void FramePipeline::Wait(uint64_t id)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  changed_.wait(lock, [this, id]() { return presented_ >= id; });
+}
+
+bool FramePipeline::IsComplete(uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(lock_);
+  return presented_ >= id;
+}
+
+void FramePipeline::Flush()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  changed_.wait(lock, [this]() { return presented_ >= submitted_ && !rendering_; });
+
+  rendering_ = true;
+  ApplyUpdates(lock, UINT64_MAX, nullptr);
+  rendering_ = false;
+  lock.unlock();
+
+  changed_.notify_all();
+}
+
+void FramePipeline::Update(std::function<void()> update)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  if (!render_queue_.empty() || rendering_)
+  {
+    updates_.push_back(pending_update{ submitted_, std::move(update) });
+    return;
+  }
+
+  // Updates queued behind frames that have since finished go first
+  rendering_ = true;
+  ApplyUpdates(lock, UINT64_MAX, update);
+  rendering_ = false;
+  lock.unlock();
+
+  changed_.notify_all();
+}
+
+void FramePipeline::RenderThread()
+{
+  for (;;)
+  {
+    frame f;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      // Updates applied from other threads have the scene until they're done
+      changed_.wait(lock, [this]() { return !rendering_ && (shutdown_ || !render_queue_.empty()); });
+      if (render_queue_.empty())
+      {
+        return;
+      }
+
+      f = render_queue_.front();
+      render_queue_.erase(render_queue_.begin());
+      rendering_ = true;
+      ApplyUpdates(lock, f.id, nullptr);
+    }
+
+    render_(f);
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      rendering_ = false;
+      present_queue_.push_back(f);
+    }
+    changed_.notify_all();
+  }
+}
+
+void FramePipeline::PresentThread()
+{
+  for (;;)
+  {
+    frame f;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      changed_.wait(lock, [this]() { return shutdown_ || !present_queue_.empty(); });
+      if (present_queue_.empty())
+      {
+        return;
+      }
+
+      f = present_queue_.front();
+      present_queue_.erase(present_queue_.begin());
+    }
+
+    present_(f);
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      presented_ = f.id;
+    }
+    changed_.notify_all();
+  }
+}
+
+void FramePipeline::ApplyUpdates(std::unique_lock<std::mutex>& lock, uint64_t id, const std::function<void()>& extra)
+{
+  // Queued in submission order, so the ones due are at the front
+  std::vector<pending_update> due;
+  size_t count = 0;
+  for (; count < updates_.size() && updates_[count].after_frame < id; ++count)
+  {
+    due.push_back(std::move(updates_[count]));
+  }
+  updates_.erase(updates_.begin(), updates_.begin() + count);
+  if (due.empty() && !extra)
+  {
+    return;
+  }
+
+  // Updates can take a while (ie. building a mesh's levels of detail). Waits on frames
+  // shouldn't have to sit through them
+  lock.unlock();
+  for (pending_update& u : due)
+  {
+    u.update();
+  }
+  if (extra)
+  {
+    extra();
+  }
+  lock.lock();
+}
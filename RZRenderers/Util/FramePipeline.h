@@ -0,0 +1,78 @@
+//=============================================================================
+// FramePipeline.h - Background render & present threads for asynchronous frames
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class FramePipeline
+{
+public:
+  struct frame
+  {
+    uint64_t id;                    // Tokens start at 1
+    RZVector3 viewer_position;
+    RZQuaternion viewer_orientation;
+    int buffer;                     // Framebuffer to render into & present from
+    int present_width;              // Set by the render stage, for the present stage
+    int present_height;
+  };
+
+  FramePipeline() {}
+  ~FramePipeline();
+
+  // Frames are rendered by render, then shown by present, each on its own thread.
+  // Up to num_buffers frames are in flight, so frame N + 1 renders while frame N is
+  // presented. Threads are only started by the first Submit
+  bool Initialize(int num_buffers,
+    const std::function<void(frame&)>& render, const std::function<void(const frame&)>& present);
+
+  // Queue a frame and return its token. Blocks while all buffers are in flight
+  uint64_t Submit(const RZVector3& viewer_position, const RZQuaternion& viewer_orientation);
+
+  // Block until the frame has been presented
+  void Wait(uint64_t id);
+
+  bool IsComplete(uint64_t id);
+
+  // Wait for every submitted frame, and apply any updates still queued
+  void Flush();
+
+  // Run update between frames: right away if no frame is queued or rendering,
+  // otherwise on the render thread before the next frame submitted after this call
+  void Update(std::function<void()> update);
+
+private:
+  FramePipeline(const FramePipeline&) = delete;
+  FramePipeline& operator= (const FramePipeline&) = delete;
+
+  struct pending_update
+  {
+    uint64_t after_frame;           // Applied before any frame with a larger id
+    std::function<void()> update;
+  };
+
+  void RenderThread();
+  void PresentThread();
+
+  // Run queued updates that belong before frame id, then extra if given. They run
+  // with lock held by the caller released, and rendering_ set so nothing else gets at
+  // the scene in the meantime. lock is held again on return
+  void ApplyUpdates(std::unique_lock<std::mutex>& lock, uint64_t id, const std::function<void()>& extra);
+
+private:
+  int num_buffers_ = 0;
+  std::function<void(frame&)> render_;
+  std::function<void(const frame&)> present_;
+
+  std::thread render_thread_;
+  std::thread present_thread_;
+  std::mutex lock_;
+  std::condition_variable changed_;
+  std::vector<frame> render_queue_;
+  std::vector<frame> present_queue_;
+  std::vector<pending_update> updates_;
+  uint64_t submitted_ = 0;
+  uint64_t presented_ = 0;
+  bool rendering_ = false;         // A frame or updates are using the scene
+  bool shutdown_ = false;
+};
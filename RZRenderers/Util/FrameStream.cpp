@@ -0,0 +1,311 @@
+//=============================================================================
+// FrameStream.cpp - Writes rendered frames to a file or pipe on a background thread
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "FrameStream.h"
+
+FrameStream::~FrameStream()
+{
+  Flush();
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  changed_.notify_all();
+
+  if (writer_thread_.joinable())
+  {
+    writer_thread_.join();
+  }
+
+  if (file_)
+  {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+bool FrameStream::Create(const RZFrameStreamCreateParams* params, IRZFrameStream** out_stream)
+{
+  FrameStream* stream = new FrameStream();
+  if (!stream->Initialize(params))
+  {
+    delete stream;
+    stream = nullptr;
+    return false;
+  }
+
+  *out_stream = stream;
+  return true;
+}
+
+bool FrameStream::Initialize(const RZFrameStreamCreateParams* params)
+{
+  if (!params->Path || params->Width <= 0 || params->Height <= 0 || params->Format > RZStreamFormat_RawRGBA)
+  {
+    assert(false);
+    return false;
+  }
+
+  format_ = params->Format;
+  width_ = params->Width;
+  height_ = params->Height;
+  drop_when_full_ = (params->Flags & RZStreamFlag_DropWhenFull) != 0;
+
+  // Binary mode, so nothing gets translated. Works for named pipes too
+  if (fopen_s(&file_, params->Path, "wb") != 0 || !file_)
+  {
+    file_ = nullptr;
+    return false;
+  }
+
+  // Y4M has a single header for the whole stream
+  if (format_ == RZStreamFormat_Y4M)
+  {
+    uint32_t frame_rate = params->FrameRate > 0 ? params->FrameRate : DefaultFrameRate;
+    if (fprintf(file_, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C420jpeg\n", width_, height_, frame_rate) < 0)
+    {
+      return false;
+    }
+  }
+
+  slot_format_ = (format_ == RZStreamFormat_PFM) ? RZPixelFormat_RGBA32F : RZPixelFormat_RGBA8;
+  row_pitch_ = width_ * (slot_format_ == RZPixelFormat_RGBA32F ? 16u : 4u);
+
+  uint32_t queue_length = params->QueueLength > 0 ? params->QueueLength : DefaultQueueLength;
+  slots_.resize(queue_length);
+  for (uint32_t i = 0; i < queue_length; ++i)
+  {
+    slots_[i].resize((size_t)row_pitch_ * height_);
+    free_slots_.push_back((int)i);
+  }
+
+  writer_thread_ = std::thread(&FrameStream::WriterThread, this);
+  return true;
+}
+
+bool FrameStream::BeginFrame(RZRenderTarget* out_target)
+{
+  if (!out_target || current_slot_ >= 0)
+  {
+    assert(false);
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(lock_);
+  if (failed_)
+  {
+    return false;
+  }
+
+  if (free_slots_.empty())
+  {
+    if (drop_when_full_)
+    {
+      ++frames_dropped_;
+      return false;
+    }
+
+    changed_.wait(lock, [this]() { return !free_slots_.empty() || failed_; });
+    if (failed_)
+    {
+      return false;
+    }
+  }
+
+  current_slot_ = free_slots_.back();
+  free_slots_.pop_back();
+
+  *out_target = RZRenderTarget{ slots_[current_slot_].data(), row_pitch_, slot_format_ };
+  return true;
+}
+
+void FrameStream::EndFrame()
+{
+  if (current_slot_ < 0)
+  {
+    assert(false);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    queued_slots_.push_back(current_slot_);
+    current_slot_ = -1;
+  }
+  changed_.notify_all();
+}
+
+bool FrameStream::Flush()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  changed_.wait(lock, [this]() { return (queued_slots_.empty() && !writing_) || failed_; });
+  if (!failed_ && fflush(file_) != 0)
+  {
+    failed_ = true;
+  }
+  return !failed_;
+}
+
+void FrameStream::GetStats(RZFrameStreamStats* stats)
+{
+  if (!stats)
+  {
+    assert(false);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(lock_);
+  stats->FramesWritten = frames_written_;
+  stats->FramesDropped = frames_dropped_;
+  stats->QueuedFrames = (uint32_t)queued_slots_.size() + (writing_ ? 1 : 0);
+  stats->WriteFailed = failed_;
+}
+
+void FrameStream::WriterThread()
+{
+  for (;;)
+  {
+    int slot;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      changed_.wait(lock, [this]() { return shutdown_ || !queued_slots_.empty(); });
+      if (queued_slots_.empty())
+      {
+        return;
+      }
+
+      slot = queued_slots_.front();
+      queued_slots_.erase(queued_slots_.begin());
+      writing_ = true;
+    }
+
+    bool written = WriteFrame(slots_[slot].data());
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      writing_ = false;
+      free_slots_.push_back(slot);
+      if (written)
+      {
+        ++frames_written_;
+      }
+      else
+      {
+        // Nothing queued will make it either (the reader of a pipe may have gone)
+        failed_ = true;
+        for (int queued : queued_slots_)
+        {
+          free_slots_.push_back(queued);
+        }
+        queued_slots_.clear();
+      }
+    }
+    changed_.notify_all();
+  }
+}
+
+bool FrameStream::WriteFrame(const uint8_t* pixels)
+{
+  switch (format_)
+  {
+  case RZStreamFormat_PPM:
+    return WritePPM(pixels);
+
+  case RZStreamFormat_PFM:
+    return WritePFM(pixels);
+
+  case RZStreamFormat_Y4M:
+    return WriteY4M(pixels);
+
+  case RZStreamFormat_RawRGBA:
+    // Slots are already tightly packed RGBA8
+    return fwrite(pixels, (size_t)row_pitch_ * height_, 1, file_) == 1;
+
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+bool FrameStream::WritePPM(const uint8_t* pixels)
+{
+  size_t count = (size_t)width_ * height_;
+  output_.resize(count * 3);
+  for (size_t i = 0; i < count; ++i)
+  {
+    output_[i * 3] = pixels[i * 4];
+    output_[i * 3 + 1] = pixels[i * 4 + 1];
+    output_[i * 3 + 2] = pixels[i * 4 + 2];
+  }
+
+  return fprintf(file_, "P6\n%d %d\n255\n", width_, height_) >= 0 &&
+    fwrite(output_.data(), output_.size(), 1, file_) == 1;
+}
+
+bool FrameStream::WritePFM(const uint8_t* pixels)
+{
+  // Little endian (negative scale), and rows go bottom to top
+  output_.resize((size_t)width_ * height_ * 3 * sizeof(float));
+  float* out = (float*)output_.data();
+  for (int y = height_ - 1; y >= 0; --y)
+  {
+    const float* row = (const float*)(pixels + (size_t)y * row_pitch_);
+    for (int x = 0; x < width_; ++x)
+    {
+      *out++ = row[x * 4];
+      *out++ = row[x * 4 + 1];
+      *out++ = row[x * 4 + 2];
+    }
+  }
+
+  return fprintf(file_, "PF\n%d %d\n-1.0\n", width_, height_) >= 0 &&
+    fwrite(output_.data(), output_.size(), 1, file_) == 1;
+}
+
+bool FrameStream::WriteY4M(const uint8_t* pixels)
+{
+  // Full range BT.601 (as in JPEG), in 8.8 fixed point. Chroma is taken from the
+  // average of each 2x2 block, clamped at odd edges
+  int chroma_width = (width_ + 1) / 2;
+  int chroma_height = (height_ + 1) / 2;
+  size_t luma_size = (size_t)width_ * height_;
+  size_t chroma_size = (size_t)chroma_width * chroma_height;
+  output_.resize(luma_size + chroma_size * 2);
+  uint8_t* out_y = output_.data();
+  uint8_t* out_u = out_y + luma_size;
+  uint8_t* out_v = out_u + chroma_size;
+
+  for (size_t i = 0; i < luma_size; ++i)
+  {
+    const uint8_t* p = pixels + i * 4;
+    out_y[i] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+  }
+
+  for (int cy = 0; cy < chroma_height; ++cy)
+  {
+    int y0 = cy * 2;
+    int y1 = std::min(y0 + 1, height_ - 1);
+    for (int cx = 0; cx < chroma_width; ++cx)
+    {
+      int x0 = cx * 2;
+      int x1 = std::min(x0 + 1, width_ - 1);
+      const uint8_t* p00 = pixels + ((size_t)y0 * width_ + x0) * 4;
+      const uint8_t* p01 = pixels + ((size_t)y0 * width_ + x1) * 4;
+      const uint8_t* p10 = pixels + ((size_t)y1 * width_ + x0) * 4;
+      const uint8_t* p11 = pixels + ((size_t)y1 * width_ + x1) * 4;
+      int r = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+      int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+      int b = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+
+      // Offset by 128.5 (in 8.8) before shifting, so the result is never negative
+      size_t i = (size_t)cy * chroma_width + cx;
+      out_u[i] = (uint8_t)std::min((-43 * r - 85 * g + 128 * b + 32896) >> 8, 255);
+      out_v[i] = (uint8_t)std::min((128 * r - 107 * g - 21 * b + 32896) >> 8, 255);
+    }
+  }
+
+  return fputs("FRAME\n", file_) >= 0 && fwrite(output_.data(), output_.size(), 1, file_) == 1;
+}
@@ -0,0 +1,62 @@
+//=============================================================================
+// FrameStream.h - Writes rendered frames to a file or pipe on a background thread
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class FrameStream : public BaseObject<IRZFrameStream>
+{
+public:
+  static bool Create(const RZFrameStreamCreateParams* params, IRZFrameStream** out_stream);
+
+  virtual bool BeginFrame(RZRenderTarget* out_target) override;
+
+  virtual void EndFrame() override;
+
+  virtual bool Flush() override;
+
+  virtual void GetStats(RZFrameStreamStats* stats) override;
+
+private:
+  FrameStream() {}
+  virtual ~FrameStream();
+
+  bool Initialize(const RZFrameStreamCreateParams* params);
+
+  void WriterThread();
+
+  // Convert a slot's pixels to the stream format and write them out
+  bool WriteFrame(const uint8_t* pixels);
+
+  bool WritePPM(const uint8_t* pixels);
+  bool WritePFM(const uint8_t* pixels);
+  bool WriteY4M(const uint8_t* pixels);
+
+private:
+  static const uint32_t DefaultQueueLength = 4;
+  static const uint32_t DefaultFrameRate = 30;
+
+  RZStreamFormat format_ = RZStreamFormat_PPM;
+  int width_ = 0;
+  int height_ = 0;
+  bool drop_when_full_ = false;
+  FILE* file_ = nullptr;
+
+  // Slots hold RGBA8 pixels, or RGBA32F for PFM, converted by the writer thread
+  RZPixelFormat slot_format_ = RZPixelFormat_RGBA8;
+  uint32_t row_pitch_ = 0;
+  std::vector<std::vector<uint8_t>> slots_;
+  std::vector<int> free_slots_;
+  std::vector<int> queued_slots_;   // In the order they were ended
+  int current_slot_ = -1;           // Between BeginFrame & EndFrame
+  std::vector<uint8_t> output_;     // Writer thread's converted frame
+
+  std::thread writer_thread_;
+  std::mutex lock_;
+  std::condition_variable changed_;
+  bool writing_ = false;
+  bool shutdown_ = false;
+  bool failed_ = false;
+  uint64_t frames_written_ = 0;
+  uint64_t frames_dropped_ = 0;
+};
@@ -0,0 +1,113 @@
+//=============================================================================
+// Framebuffer.cpp - 32bpp GDI backbuffers presented to a window
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "Framebuffer.h"
+
+Framebuffer::~Framebuffer()
+{
+  for (auto& buffer : buffers_)
+  {
+    if (buffer.hdc)
+    {
+      DeleteDC(buffer.hdc);
+    }
+  }
+  buffers_.clear();
+}
+
+bool Framebuffer::Initialize(HWND window, int width, int height, int num_buffers)
+{
+  if (num_buffers <= 0)
+  {
+    assert(false);
+    return false;
+  }
+
+  window_ = window;
+  width_ = width;
+  height_ = height;
+
+  HDC hdc = GetDC(window_);
+  if (!hdc)
+  {
+    assert(false);
+    return false;
+  }
+
+  buffers_.resize(num_buffers, backbuffer{ nullptr, nullptr });
+  for (auto& buffer : buffers_)
+  {
+    buffer.hdc = CreateCompatibleDC(hdc);
+    if (!buffer.hdc)
+    {
+      break;
+    }
+  }
+
+  // done with the hwnd's hdc.
+  ReleaseDC(window_, hdc);
+
+  BITMAPINFO bmi{};
+  bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+  bmi.bmiHeader.biWidth = width_;
+  bmi.bmiHeader.biHeight = -height_; // Negative means top-down
+  bmi.bmiHeader.biPlanes = 1;
+  bmi.bmiHeader.biBitCount = 32;
+  bmi.bmiHeader.biCompression = BI_RGB;
+
+  for (auto& buffer : buffers_)
+  {
+    if (!buffer.hdc)
+    {
+      assert(false);
+      return false;
+    }
+
+    HBITMAP bitmap = CreateDIBSection(buffer.hdc, &bmi, DIB_RGB_COLORS, (PVOID*)&buffer.pixels, nullptr, 0);
+    if (!bitmap)
+    {
+      assert(false);
+      return false;
+    }
+
+    // Select the bitmap (this takes a reference on it)
+    SelectObject(buffer.hdc, bitmap);
+
+    // Delete the object (the DC still has a reference)
+    DeleteObject(bitmap);
+  }
+
+  return true;
+}
+
+void Framebuffer::Present(int buffer)
+{
+  Present(buffer, width_, height_);
+}
+
+void Framebuffer::Present(int buffer, int width, int height)
+{
+  assert(width <= width_ && height <= height_);
+
+  RECT client_rect{};
+  GetClientRect(window_, &client_rect);
+
+  HDC hdc = GetDC(window_);
+  HDC source = buffers_[buffer].hdc;
+
+  int client_width = client_rect.right - client_rect.left;
+  int client_height = client_rect.bottom - client_rect.top;
+
+  if (client_width != width || client_height != height)
+  {
+    StretchBlt(hdc, 0, 0, client_width, client_height, source, 0, 0, width, height, SRCCOPY);
+  }
+  else
+  {
+    BitBlt(hdc, 0, 0, width, height, source, 0, 0, SRCCOPY);
+  }
+
+  ReleaseDC(window_, hdc);
+}
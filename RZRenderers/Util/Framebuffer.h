@@ -0,0 +1,44 @@
+//=============================================================================
+// Framebuffer.h - 32bpp GDI backbuffers presented to a window
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class Framebuffer
+{
+public:
+  Framebuffer() {}
+  ~Framebuffer();
+
+  // num_buffers separate backbuffers, so one can be presented while another is drawn
+  bool Initialize(HWND window, int width, int height, int num_buffers);
+
+  // Top-down rows of 0xAARRGGBB pixels, width pixels apart
+  uint32_t* GetPixels(int buffer) const
+  {
+    return buffers_[buffer].pixels;
+  }
+
+  // Copy to the window, stretching to the client area if needed
+  void Present(int buffer);
+
+  // Same, but only the top left width x height pixels (ie. rendered at a lower
+  // resolution) are stretched over the client area
+  void Present(int buffer, int width, int height);
+
+private:
+  Framebuffer(const Framebuffer&) = delete;
+  Framebuffer& operator= (const Framebuffer&) = delete;
+
+  struct backbuffer
+  {
+    HDC hdc;
+    uint32_t* pixels;
+  };
+
+private:
+  HWND window_ = nullptr;
+  std::vector<backbuffer> buffers_;
+  int width_ = 0;
+  int height_ = 0;
+};
@@ -0,0 +1,73 @@
+//=============================================================================
+// MappedMemory.cpp - Memory backed by temporary files instead of the page file
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "MappedMemory.h"
+
+// Views start with the handles to close, padded so the data stays aligned
+struct mapped_header
+{
+  HANDLE file;
+  HANDLE mapping;
+};
+
+static const size_t MappedHeaderSize = 64;
+
+void* AllocateMapped(size_t size)
+{
+  // Failures come from the environment (no temporary directory, full disk), so
+  // they're left to the caller rather than asserted
+  char directory[MAX_PATH];
+  char path[MAX_PATH];
+  DWORD length = GetTempPathA(MAX_PATH, directory);
+  if (length == 0 || length > MAX_PATH || GetTempFileNameA(directory, "rz", 0, path) == 0)
+  {
+    return nullptr;
+  }
+
+  // Temporary files are only written out when memory runs low, and this one is
+  // deleted once closed
+  HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    return nullptr;
+  }
+
+  // Mapping more than the file holds grows it
+  uint64_t total = (uint64_t)size + MappedHeaderSize;
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(total >> 32), (DWORD)total, nullptr);
+  if (!mapping)
+  {
+    CloseHandle(file);
+    return nullptr;
+  }
+
+  uint8_t* view = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+  if (!view)
+  {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return nullptr;
+  }
+
+  mapped_header* header = (mapped_header*)view;
+  header->file = file;
+  header->mapping = mapping;
+  return view + MappedHeaderSize;
+}
+
+void FreeMapped(void* p)
+{
+  if (!p)
+  {
+    return;
+  }
+
+  uint8_t* view = (uint8_t*)p - MappedHeaderSize;
+  mapped_header header = *(mapped_header*)view;
+  UnmapViewOfFile(view);
+  CloseHandle(header.mapping);
+  CloseHandle(header.file);
+}
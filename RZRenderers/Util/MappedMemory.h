@@ -0,0 +1,71 @@
+//=============================================================================
+// MappedMemory.h - Memory backed by temporary files instead of the page file
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+// size bytes in a mapped view of a new temporary file, 64 byte aligned. The OS
+// writes the pages out and drops them when memory runs low, so arrays larger than
+// RAM fit. The file is deleted by FreeMapped. Returns nullptr on failure
+void* AllocateMapped(size_t size);
+
+void FreeMapped(void* p);
+
+// Allocator for containers that may be file backed (see AllocateMapped). Default
+// constructed ones use the heap, so only containers given a mapped allocator go
+// to files
+template <typename T>
+class MappedAllocator
+{
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  MappedAllocator() {}
+  explicit MappedAllocator(bool mapped) : mapped_(mapped) {}
+
+  template <typename U>
+  MappedAllocator(const MappedAllocator<U>& other) : mapped_(other.IsMapped()) {}
+
+  T* allocate(size_t count)
+  {
+    if (!mapped_)
+    {
+      return std::allocator<T>().allocate(count);
+    }
+
+    // Out of disk is out of memory, as far as containers are concerned
+    void* p = AllocateMapped(count * sizeof(T));
+    if (!p)
+    {
+      throw std::bad_alloc();
+    }
+    return (T*)p;
+  }
+
+  void deallocate(T* p, size_t count)
+  {
+    if (!mapped_)
+    {
+      std::allocator<T>().deallocate(p, count);
+      return;
+    }
+    FreeMapped(p);
+  }
+
+  bool IsMapped() const { return mapped_; }
+
+private:
+  bool mapped_ = false;
+};
+
+template <typename T, typename U>
+bool operator== (const MappedAllocator<T>& a, const MappedAllocator<U>& b) { return a.IsMapped() == b.IsMapped(); }
+
+template <typename T, typename U>
+bool operator!= (const MappedAllocator<T>& a, const MappedAllocator<U>& b) { return a.IsMapped() != b.IsMapped(); }
+
+template <typename T>
+using mapped_vector = std::vector<T, MappedAllocator<T>>;
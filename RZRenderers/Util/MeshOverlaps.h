@@ -0,0 +1,88 @@
+//=============================================================================
+// MeshOverlaps.h - Intersecting triangle pairs between two meshes, using AabbTree
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "AabbTree.h"
+#include "ThreadPool.h"
+
+// Shared by the renderers' FindMeshOverlaps. Each mesh has its own tree, over its
+// run of triangles (with i0, i1 & i2 indices into positions)
+template <typename Tree, typename Triangle>
+class MeshOverlapSearch
+{
+public:
+  MeshOverlapSearch(const Triangle* triangles, const RZVector3* positions)
+    : triangles_(triangles), positions_(positions)
+  {}
+
+  // Append the intersecting pairs of mesh a's triangles (starting at first_a, in tree_a)
+  // & mesh b's. The trees are descended together, and overlapping subtree pairs are
+  // split out to be searched on the pool's threads. With first_only, the search stops
+  // at the first pair any thread finds
+  void FindOverlaps(ThreadPool& thread_pool,
+    const Tree& tree_a, uint32_t first_a, const Tree& tree_b, uint32_t first_b,
+    bool first_only, std::vector<RZTrianglePair>* out_pairs) const
+  {
+    std::vector<typename Tree::subtree_pair> subtrees;
+    tree_a.SplitOverlaps(tree_b, thread_pool.GetThreadCount() * SubtreesPerThread, &subtrees);
+
+    // Kept per subtree pair and joined in order, so the results don't depend on timing
+    std::vector<std::vector<RZTrianglePair>> found(subtrees.size());
+    std::atomic<bool> stop = ATOMIC_VAR_INIT(false);
+
+    thread_pool.ParallelFor((int)subtrees.size(), [&](int index, int)
+    {
+      if (stop)
+      {
+        return;
+      }
+
+      std::vector<RZTrianglePair>& pairs = found[index];
+      tree_a.TraverseOverlaps(tree_b, subtrees[index],
+        [&](const uint32_t* triangles_a, int count_a, const uint32_t* triangles_b, int count_b)
+      {
+        for (int i = 0; i < count_a; ++i)
+        {
+          const Triangle& ta = triangles_[first_a + triangles_a[i]];
+          for (int j = 0; j < count_b; ++j)
+          {
+            const Triangle& tb = triangles_[first_b + triangles_b[j]];
+            if (TestTriangleTriangle(positions_[ta.i0], positions_[ta.i1], positions_[ta.i2],
+              positions_[tb.i0], positions_[tb.i1], positions_[tb.i2]))
+            {
+              pairs.push_back(RZTrianglePair{ { first_a + triangles_a[i], first_b + triangles_b[j] } });
+              if (first_only)
+              {
+                stop = true;
+                return false;
+              }
+            }
+          }
+        }
+        return !stop;
+      });
+    });
+
+    for (const std::vector<RZTrianglePair>& pairs : found)
+    {
+      out_pairs->insert(out_pairs->end(), pairs.begin(), pairs.end());
+      if (first_only && !out_pairs->empty())
+      {
+        out_pairs->resize(1);
+        break;
+      }
+    }
+  }
+
+private:
+  MeshOverlapSearch& operator= (const MeshOverlapSearch&) = delete;
+
+private:
+  // Enough work items to balance uneven subtrees
+  static const int SubtreesPerThread = 8;
+
+  const Triangle* triangles_;
+  const RZVector3* positions_;
+};
@@ -0,0 +1,150 @@
+//=============================================================================
+// NearestPoints.h - Closest point searches over a tree of indexed triangles
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+#include "AabbTree.h"
+#include "ThreadPool.h"
+
+// Shared by the renderers' FindNearestSurfacePoint(s). Triangle has i0, i1 & i2
+// indices into positions, and the tree holds triangles by their index in the array
+template <typename Tree, typename Triangle>
+class NearestPointSearch
+{
+public:
+  static const uint32_t NoTriangle = 0xFFFFFFFF;
+
+  NearestPointSearch(const Tree& tree, const Triangle* triangles, const RZVector3* positions)
+    : tree_(tree), triangles_(triangles), positions_(positions)
+  {}
+
+  // Branch and bound: boxes are visited nearest first, and the range shrinks to each
+  // closer triangle found, culling the rest. hint is a triangle likely to be close
+  // (ie. the answer for a nearby point), tested first to start with a tight range.
+  // Ties go to whichever triangle was found first
+  bool FindNearest(const RZVector3& point, float max_dist, uint32_t hint, RZSurfacePoint* out_result) const
+  {
+    PointQuery query(point, max_dist > 0.f ? max_dist : FLT_MAX);
+    uint32_t best = NoTriangle;
+    float best_b = 0.f, best_c = 0.f;
+
+    auto test = [&](uint32_t index)
+    {
+      const Triangle& t = triangles_[index];
+      float b, c;
+      float dist_sq = DistanceSqPointTriangle(point, positions_[t.i0], positions_[t.i1], positions_[t.i2], &b, &c);
+      if (dist_sq < query.max_dist_sq || (best == NoTriangle && dist_sq <= query.max_dist_sq))
+      {
+        query.max_dist_sq = dist_sq;
+        best = index;
+        best_b = b;
+        best_c = c;
+      }
+    };
+
+    if (hint != NoTriangle)
+    {
+      test(hint);
+    }
+
+    tree_.Traverse(query, [&](const uint32_t* triangles, int count)
+    {
+      for (int i = 0; i < count; ++i)
+      {
+        test(triangles[i]);
+      }
+
+      // Nothing beats a point on the surface
+      return best == NoTriangle || query.max_dist_sq > 0.f;
+    });
+
+    out_result->PrimitiveID = best;
+    out_result->MeshID = NoTriangle;
+    if (best == NoTriangle)
+    {
+      out_result->Distance = FLT_MAX;
+      out_result->Barycentrics[0] = out_result->Barycentrics[1] = 0.f;
+      out_result->Position = RZVector3{};
+      return false;
+    }
+
+    const Triangle& t = triangles_[best];
+    out_result->Distance = sqrtf(query.max_dist_sq);
+    out_result->Barycentrics[0] = best_b;
+    out_result->Barycentrics[1] = best_c;
+    out_result->Position = positions_[t.i0] * (1.f - best_b - best_c) + positions_[t.i1] * best_b + positions_[t.i2] * best_c;
+    return true;
+  }
+
+  // Sort the points along a Morton curve within their bounds, then search runs of
+  // them on the pool's threads. Each search is hinted with the previous point's
+  // answer, which is usually close for a near neighbor. sort_keys is scratch space
+  void FindNearestBatch(ThreadPool& thread_pool, uint32_t num_points, const RZVector3* points, float max_dist,
+    RZSurfacePoint* out_results, std::vector<uint64_t>* sort_keys) const
+  {
+    RZVector3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+    RZVector3 max = -min;
+    for (uint32_t i = 0; i < num_points; ++i)
+    {
+      min = RZVector3::Min(min, points[i]);
+      max = RZVector3::Max(max, points[i]);
+    }
+
+    // 10 bits per axis
+    RZVector3 extent = max - min;
+    RZVector3 scale{
+      extent.x > 0.f ? 1023.f / extent.x : 0.f,
+      extent.y > 0.f ? 1023.f / extent.y : 0.f,
+      extent.z > 0.f ? 1023.f / extent.z : 0.f };
+
+    sort_keys->resize(num_points);
+    for (uint32_t i = 0; i < num_points; ++i)
+    {
+      RZVector3 p = points[i] - min;
+      uint32_t morton = SpreadBits((uint32_t)(p.x * scale.x)) |
+        (SpreadBits((uint32_t)(p.y * scale.y)) << 1) |
+        (SpreadBits((uint32_t)(p.z * scale.z)) << 2);
+      (*sort_keys)[i] = ((uint64_t)morton << 32) | i;
+    }
+    std::sort(sort_keys->begin(), sort_keys->end());
+
+    // Runs are fixed, not per thread, so results don't depend on the thread count
+    const std::vector<uint64_t>& keys = *sort_keys;
+    int num_runs = (int)((num_points + RunSize - 1) / RunSize);
+    thread_pool.ParallelFor(num_runs, [&](int run, int)
+    {
+      uint32_t hint = NoTriangle;
+      uint32_t end = std::min(num_points, (uint32_t)(run + 1) * RunSize);
+      for (uint32_t i = (uint32_t)run * RunSize; i < end; ++i)
+      {
+        uint32_t index = (uint32_t)(keys[i] & 0xFFFFFFFF);
+        if (FindNearest(points[index], max_dist, hint, &out_results[index]))
+        {
+          hint = out_results[index].PrimitiveID;
+        }
+      }
+    });
+  }
+
+private:
+  NearestPointSearch& operator= (const NearestPointSearch&) = delete;
+
+  // Spread the low 10 bits of v so there are 2 zero bits between each
+  static uint32_t SpreadBits(uint32_t v)
+  {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  }
+
+private:
+  static const uint32_t RunSize = 64;
+
+  const Tree& tree_;
+  const Triangle* triangles_;
+  const RZVector3* positions_;
+};
@@ -0,0 +1,228 @@
+//=============================================================================
+// PageCache.cpp - Residency of memory mapped pages, kept within a budget
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "PageCache.h"
+
+static const size_t OSPageSize = 4096;
+
+PageCache::~PageCache()
+{
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  changed_.notify_all();
+
+  if (pager_thread_.joinable())
+  {
+    pager_thread_.join();
+  }
+}
+
+bool PageCache::Initialize(uint64_t budget)
+{
+  if (budget == 0)
+  {
+    assert(false);
+    return false;
+  }
+
+  budget_ = budget;
+  pager_thread_ = std::thread(&PageCache::PagerThread, this);
+  return true;
+}
+
+void PageCache::SetPages(int count, int ranges_per_page, const range* ranges)
+{
+  if (ranges_per_page > MaxRangesPerPage)
+  {
+    assert(false);
+    return;
+  }
+
+  WaitForRequests();
+
+  ranges_.assign(ranges, ranges + count * ranges_per_page);
+  pages_.reset(new page[count]);
+  num_pages_ = count;
+  ranges_per_page_ = ranges_per_page;
+  resident_bytes_ = 0;
+
+  for (int i = 0; i < count; ++i)
+  {
+    page& p = pages_[i];
+    p.state = Dropped;
+    p.last_pass = 0;
+    p.size = 0;
+    for (int r = 0; r < ranges_per_page; ++r)
+    {
+      const range& rg = ranges_[i * ranges_per_page + r];
+      p.size += rg.size;
+
+      // Whatever writing the data left in the working set goes, so the budget holds
+      // from the start. The range isn't locked, so this fails, but drops it anyway
+      if (rg.size > 0)
+      {
+        VirtualUnlock((void*)rg.data, rg.size);
+      }
+    }
+  }
+}
+
+void PageCache::Acquire(int index)
+{
+  page& p = pages_[index];
+  if (p.state != Resident)
+  {
+    Load(index);
+  }
+  if (p.last_pass != pass_)
+  {
+    p.last_pass = pass_;
+  }
+}
+
+bool PageCache::TryAcquire(int index)
+{
+  page& p = pages_[index];
+  if (p.state == Resident)
+  {
+    if (p.last_pass != pass_)
+    {
+      p.last_pass = pass_;
+    }
+    return true;
+  }
+
+  // Only the first to ask queues it
+  uint32_t expected = Dropped;
+  if (!p.state.compare_exchange_strong(expected, Requested))
+  {
+    return false;
+  }
+
+  WIN32_MEMORY_RANGE_ENTRY entries[MaxRangesPerPage];
+  int num_entries = 0;
+  for (int r = 0; r < ranges_per_page_; ++r)
+  {
+    const range& rg = ranges_[index * ranges_per_page_ + r];
+    if (rg.size > 0)
+    {
+      entries[num_entries].VirtualAddress = (void*)rg.data;
+      entries[num_entries].NumberOfBytes = rg.size;
+      ++num_entries;
+    }
+  }
+  PrefetchVirtualMemory(GetCurrentProcess(), num_entries, entries, 0);
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    requests_.push_back(index);
+  }
+  changed_.notify_all();
+  return false;
+}
+
+void PageCache::WaitForRequests()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  changed_.wait(lock, [this]() { return requests_.empty(); });
+}
+
+void PageCache::Trim()
+{
+  ++pass_;
+  if (resident_bytes_ <= budget_)
+  {
+    return;
+  }
+
+  // Oldest pass first, and pages in order within a pass
+  lru_keys_.clear();
+  for (int i = 0; i < num_pages_; ++i)
+  {
+    if (pages_[i].state == Resident)
+    {
+      lru_keys_.push_back(((uint64_t)pages_[i].last_pass << 32) | (uint32_t)i);
+    }
+  }
+  std::sort(lru_keys_.begin(), lru_keys_.end());
+
+  for (uint64_t key : lru_keys_)
+  {
+    if (resident_bytes_ <= budget_)
+    {
+      break;
+    }
+
+    int index = (int)(uint32_t)key;
+    page& p = pages_[index];
+    p.state = Dropped;
+    resident_bytes_ -= p.size;
+    for (int r = 0; r < ranges_per_page_; ++r)
+    {
+      const range& rg = ranges_[index * ranges_per_page_ + r];
+      if (rg.size > 0)
+      {
+        VirtualUnlock((void*)rg.data, rg.size);
+      }
+    }
+  }
+}
+
+void PageCache::Load(int index)
+{
+  // Touching every OS page faults it in
+  for (int r = 0; r < ranges_per_page_; ++r)
+  {
+    const range& rg = ranges_[index * ranges_per_page_ + r];
+    for (size_t offset = 0; offset < rg.size; offset += OSPageSize)
+    {
+      (void)*(volatile const uint8_t*)(rg.data + offset);
+    }
+  }
+
+  // Whoever gets here first counts it
+  page& p = pages_[index];
+  uint32_t state = p.state;
+  while (state != Resident)
+  {
+    if (p.state.compare_exchange_weak(state, Resident))
+    {
+      resident_bytes_ += p.size;
+      ++pages_loaded_;
+      break;
+    }
+  }
+}
+
+void PageCache::PagerThread()
+{
+  for (;;)
+  {
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      changed_.wait(lock, [this]() { return shutdown_ || next_request_ < requests_.size(); });
+      if (shutdown_)
+      {
+        return;
+      }
+      index = requests_[next_request_];
+    }
+
+    Load(index);
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (++next_request_ == requests_.size())
+      {
+        requests_.clear();
+        next_request_ = 0;
+      }
+    }
+    changed_.notify_all();
+  }
+}
@@ -0,0 +1,95 @@
+//=============================================================================
+// PageCache.h - Residency of memory mapped pages, kept within a budget
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+// Tracks which pages of file backed data are in memory. A page is a few address
+// ranges, ie. the parts of several arrays that are always used together. Acquired
+// pages count as resident until Trim drops the least recently used ones from the
+// working set, to get back within budget. Pages can also be requested from a pager
+// thread, which brings them in while the requester gets on with something else.
+//
+// Dropped pages stay mapped, so using one without acquiring it is slow, not unsafe
+class PageCache
+{
+public:
+  struct range
+  {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  PageCache() {}
+  ~PageCache();
+
+  // budget is in bytes
+  bool Initialize(uint64_t budget);
+
+  static const int MaxRangesPerPage = 4;
+
+  // Replace the pages, ie. after rebuilding the data they cover. Page i is made of
+  // ranges [i * ranges_per_page, (i + 1) * ranges_per_page). All start out dropped
+  void SetPages(int count, int ranges_per_page, const range* ranges);
+
+  // Make the page resident, reading it in on this thread if it isn't
+  void Acquire(int page);
+
+  // True if the page is resident. Otherwise it's requested from the pager (with a
+  // prefetch hint to the OS, so requests in the order they're needed start early)
+  bool TryAcquire(int page);
+
+  // Wait for the pager to bring in every requested page
+  void WaitForRequests();
+
+  // Start a new pass, first dropping the least recently used pages until the rest
+  // fit the budget. Pages acquired during a pass may go over it until the next.
+  // Not while pages are being acquired
+  void Trim();
+
+  uint64_t GetResidentBytes() const { return resident_bytes_; }
+
+  // Pages read in so far
+  uint64_t GetPagesLoaded() const { return pages_loaded_; }
+
+private:
+  PageCache(const PageCache&) = delete;
+  PageCache& operator= (const PageCache&) = delete;
+
+  enum page_state : uint32_t
+  {
+    Dropped,
+    Requested,
+    Resident,
+  };
+
+  struct page
+  {
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> last_pass;  // Last acquired in
+    size_t size;
+  };
+
+  // Read the page's ranges in, and mark it resident
+  void Load(int index);
+
+  void PagerThread();
+
+private:
+  uint64_t budget_ = 0;
+  std::unique_ptr<page[]> pages_;
+  int num_pages_ = 0;
+  int ranges_per_page_ = 0;
+  std::vector<range> ranges_;
+  uint32_t pass_ = 0;
+  std::atomic<uint64_t> resident_bytes_{ 0 };
+  std::atomic<uint64_t> pages_loaded_{ 0 };
+  std::vector<uint64_t> lru_keys_;      // Trim scratch
+
+  std::thread pager_thread_;
+  std::mutex lock_;
+  std::condition_variable changed_;
+  std::vector<int> requests_;           // In the order they were made
+  size_t next_request_ = 0;
+  bool shutdown_ = false;
+};
@@ -0,0 +1,40 @@
+//=============================================================================
+// Random.h - Small, fast pseudo random number generator (PCG32)
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class Random
+{
+public:
+  Random() {}
+
+  // Select a sequence. Different streams with the same seed are independent
+  void Seed(uint64_t seed, uint64_t stream)
+  {
+    state_ = 0;
+    inc_ = (stream << 1) | 1;
+    Next();
+    state_ += seed;
+    Next();
+  }
+
+  uint32_t Next()
+  {
+    uint64_t old = state_;
+    state_ = old * 6364136223846793005ULL + inc_;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  // Uniform in [0, 1)
+  float NextFloat()
+  {
+    return (Next() >> 8) * (1.f / 16777216.f);
+  }
+
+private:
+  uint64_t state_ = 0x853c49e6748fea9bULL;
+  uint64_t inc_ = 0xda3e39cb94b95bdbULL;
+};
@@ -0,0 +1,113 @@
+//=============================================================================
+// ThreadPool.cpp - Persistent worker threads for data parallel loops (ie. tiles)
+// Reza Nourai, 2016
+//=============================================================================
+#include "Precomp.h"
+#include "ThreadPool.h"
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  work_available_.notify_all();
+
+  for (auto& worker : workers_)
+  {
+    worker.join();
+  }
+}
+
+bool ThreadPool::Initialize(int num_threads)
+{
+  if (num_threads <= 0)
+  {
+    num_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+  }
+
+  // The calling thread is the first worker
+  for (int i = 1; i < num_threads; ++i)
+  {
+    workers_.push_back(std::thread(&ThreadPool::WorkerThread, this, i));
+  }
+
+  return true;
+}
+
+void ThreadPool::Run(int count, item_func func, void* context)
+{
+  if (count <= 0)
+  {
+    return;
+  }
+
+  if (workers_.empty() || count == 1)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      func(context, i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    func_ = func;
+    func_context_ = context;
+    count_ = count;
+    next_item_ = 0;
+    busy_workers_ = (int)workers_.size();
+    ++generation_;
+  }
+  work_available_.notify_all();
+
+  RunItems(0);
+
+  std::unique_lock<std::mutex> lock(lock_);
+  work_done_.wait(lock, [this]() { return busy_workers_ == 0; });
+  func_ = nullptr;
+  func_context_ = nullptr;
+}
+
+void ThreadPool::WorkerThread(int thread_index)
+{
+  uint64_t last_generation = 0;
+
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_available_.wait(lock, [&]() { return shutdown_ || generation_ != last_generation; });
+      if (shutdown_)
+      {
+        return;
+      }
+      last_generation = generation_;
+    }
+
+    RunItems(thread_index);
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (--busy_workers_ == 0)
+      {
+        work_done_.notify_one();
+      }
+    }
+  }
+}
+
+void ThreadPool::RunItems(int thread_index)
+{
+  for (;;)
+  {
+    int index = next_item_++;
+    if (index >= count_)
+    {
+      break;
+    }
+
+    func_(func_context_, index, thread_index);
+  }
+}
@@ -0,0 +1,59 @@
+//=============================================================================
+// ThreadPool.h - Persistent worker threads for data parallel loops (ie. tiles)
+// Reza Nourai, 2016
+//=============================================================================
+#pragma once
+
+class ThreadPool
+{
+public:
+  ThreadPool() {}
+  ~ThreadPool();
+
+  // Start the workers. 0 means one thread per hardware thread
+  bool Initialize(int num_threads);
+
+  // Number of threads that run work, including the calling thread
+  int GetThreadCount() const
+  {
+    return (int)workers_.size() + 1;
+  }
+
+  // Call func(index, thread_index) for every index in [0, count), and wait for all
+  // of them to finish. Items are handed out dynamically, so uneven items balance out.
+  // thread_index is in [0, GetThreadCount()) and can be used to pick per-thread state.
+  // func is called through a pointer rather than wrapped in a std::function, which
+  // could allocate on every loop
+  template <typename Func>
+  void ParallelFor(int count, Func&& func)
+  {
+    typedef typename std::remove_reference<Func>::type func_type;
+    Run(count, [](void* context, int index, int thread_index)
+    {
+      (*(func_type*)context)(index, thread_index);
+    }, (void*)&func);
+  }
+
+private:
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator= (const ThreadPool&) = delete;
+
+  typedef void(*item_func)(void* context, int index, int thread_index);
+
+  void Run(int count, item_func func, void* context);
+  void WorkerThread(int thread_index);
+  void RunItems(int thread_index);
+
+private:
+  std::vector<std::thread> workers_;
+  std::mutex lock_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  item_func func_ = nullptr;
+  void* func_context_ = nullptr;
+  int count_ = 0;
+  std::atomic<int> next_item_ = ATOMIC_VAR_INIT(0);
+  int busy_workers_ = 0;
+  uint64_t generation_ = 0;
+  bool shutdown_ = false;
+};
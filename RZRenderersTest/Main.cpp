@@ -18,6 +18,11 @@ int WINAPI WinMain(HINSTANCE instance, HINSTANCE, LPSTR, int show_command)
   params.RenderWidth = 640;
   params.RenderHeight = 480;
   params.HorizFOV = 60.f * (3.14156f / 180.f);
+  params.Flags = RZRenderFlag_Progressive | RZRenderFlag_Adaptive | RZRenderFlag_Reproject;
+  params.MaxSamplesPerPixel = 64;
+  params.MaxSamplesPerFrame = 4;
+  params.FrameTimeBudget = 33.f;
+  params.TargetFrameTime = 33.f;
 
   if (!RZRendererCreate(RZRenderer_CPURaytracer, &params, &renderer))
   {
@@ -38,8 +43,11 @@ int WINAPI WinMain(HINSTANCE instance, HINSTANCE, LPSTR, int show_command)
   RZVector3 position{ 0.f, 25.f, -200.f };
   //RZVector3 position{ 0.f, 0.f, -1.5f };
   RZQuaternion orientation{ 0.f, 0.f, 0.f, 1.f };
+  bool foveate = false;  // Full detail only around the cursor
+  bool pipelined = false; // Render on background threads, overlapping with presenting
 
   wchar_t title[1024]{};
+  RZRenderStats stats{};
   LARGE_INTEGER start, end, freq;
   QueryPerformanceFrequency(&freq);
 
@@ -63,10 +71,39 @@ int WINAPI WinMain(HINSTANCE instance, HINSTANCE, LPSTR, int show_command)
         position.z -= speed;
       if (GetAsyncKeyState(VK_UP) & 0x8000)
         position.z += speed;
-      renderer->RenderScene(position, orientation);
+
+      if (foveate)
+      {
+        POINT cursor{};
+        RECT client{};
+        GetCursorPos(&cursor);
+        ScreenToClient(window, &cursor);
+        GetClientRect(window, &client);
+        if (PtInRect(&client, cursor))
+        {
+          RZRegionOfInterest region{ (float)cursor.x / client.right, (float)cursor.y / client.bottom, 0.15f, 0.1f };
+          renderer->SetRegionsOfInterest(1, &region);
+        }
+        else
+        {
+          renderer->SetRegionsOfInterest(0, nullptr);
+        }
+      }
+
+      if (pipelined)
+      {
+        // Only blocks once all the frame buffers are in flight
+        renderer->BeginRender(position, orientation);
+      }
+      else
+      {
+        renderer->RenderScene(position, orientation);
+      }
 
       QueryPerformanceCounter(&end);
-      swprintf_s(title, L"Elapsed: %3.2fms", 1000. * (end.QuadPart - start.QuadPart) / (double)freq.QuadPart);
+      renderer->GetStats(&stats);
+      swprintf_s(title, L"Elapsed: %3.2fms, Samples: %u, Rays: %llu, Retraced: %3.1f%%", 1000. * (end.QuadPart - start.QuadPart) / (double)freq.QuadPart,
+        stats.SamplesPerPixel, stats.PrimaryRays, stats.RetraceFraction * 100.f);
       SetWindowText(window, title);
     }
   }